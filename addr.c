@@ -0,0 +1,63 @@
+#include "addr.h"
+
+#include <string.h>
+#include <stdio.h>
+#ifdef __WIN32__
+    #define _WIN32_WINNT 0x0600 /* inet_ntop() */
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+#else
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+#endif
+
+static const unsigned char v4_mapped_prefix[12] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+int client_addr_from_sockaddr(struct ClientAddr *addr, const void *sa,
+                              size_t sa_len)
+{
+    const struct sockaddr *s = sa;
+
+    memset(addr, 0, sizeof(struct ClientAddr));
+    if(s->sa_family == AF_INET && sa_len >= sizeof(struct sockaddr_in))
+    {
+        const struct sockaddr_in *sin = sa;
+        memcpy(addr->bytes, &sin->sin_addr, 4);
+        addr->family = 4;
+        return 0;
+    }
+    if(s->sa_family == AF_INET6 && sa_len >= sizeof(struct sockaddr_in6))
+    {
+        const struct sockaddr_in6 *sin6 = sa;
+        const unsigned char *bytes = (const unsigned char*)&sin6->sin6_addr;
+        if(memcmp(bytes, v4_mapped_prefix, sizeof(v4_mapped_prefix)) == 0)
+        {
+            memcpy(addr->bytes, bytes + 12, 4);
+            addr->family = 4;
+        }
+        else
+        {
+            memcpy(addr->bytes, bytes, 16);
+            addr->family = 6;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+const char *client_addr_format(const struct ClientAddr *addr,
+                               char *buf, size_t size)
+{
+    const char *ret = NULL;
+    if(addr->family == 4)
+        ret = inet_ntop(AF_INET, (void*)addr->bytes, buf, size);
+    else if(addr->family == 6)
+        ret = inet_ntop(AF_INET6, (void*)addr->bytes, buf, size);
+    if(ret == NULL && size > 0)
+        snprintf(buf, size, "?");
+    return buf;
+}
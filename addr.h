@@ -0,0 +1,30 @@
+#ifndef ADDR_H
+#define ADDR_H
+
+/* Fixed-size binary form of a client's IP address.
+ *
+ * It is captured once when the connection is accepted and used as-is for
+ * cache lookups; it is only turned into text when something is logged.
+ * IPv4-mapped IPv6 addresses (from dual-stack sockets) are stored as plain
+ * IPv4, so that a client gets the same key whichever listener it used. */
+
+#include <stddef.h>
+
+#define CLIENT_ADDR_STRLEN 46 /* INET6_ADDRSTRLEN */
+
+struct ClientAddr {
+    unsigned char bytes[16]; /* IPv4 uses the first 4, the rest is zero */
+    unsigned char family;    /* 4 or 6, 0 if unknown */
+};
+
+/* Fills addr from a struct sockaddr (as returned by accept()). Returns 0 on
+ * success, -1 for unsupported address families (addr is then zeroed). */
+int client_addr_from_sockaddr(struct ClientAddr *addr, const void *sa,
+                              size_t sa_len);
+
+/* Writes the textual form of addr into buf (at least CLIENT_ADDR_STRLEN
+ * bytes) and returns buf */
+const char *client_addr_format(const struct ClientAddr *addr,
+                               char *buf, size_t size);
+
+#endif /* ADDR_H */
@@ -0,0 +1,157 @@
+/* Concurrent cache stress and throughput benchmark.
+ *
+ * Runs a mix of cache_get() (90%) and cache_add() (10%) on random client
+ * addresses with 1, 2, 4 and 8 threads, and reports the aggregate throughput.
+ * Every value stored is derived from its key, so every hit also checks that
+ * the copied-out value was not torn by a concurrent writer; the program
+ * exits with an error if one was.
+ *
+ * Usage: bench-cache [seconds per run] [cache capacity] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "../cache.h"
+#include "../timer.h"
+
+#define KEY_SPACE_FACTOR 2 /* distinct keys per cache entry */
+
+struct Thread {
+    pthread_t thread;
+    uint64_t seed;
+    uint32_t key_space;
+    uint64_t ops;
+    uint64_t hits;
+    uint64_t corrupted;
+};
+
+static volatile int stop = 0;
+
+static uint64_t next_random(uint64_t *state)
+{
+    /* splitmix64 */
+    uint64_t z = (*state += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+static void make_key(struct ClientAddr *key, uint32_t n)
+{
+    memset(key, 0, sizeof(*key));
+    key->family = 4;
+    key->bytes[0] = 10;
+    key->bytes[1] = (unsigned char)(n >> 16);
+    key->bytes[2] = (unsigned char)(n >> 8);
+    key->bytes[3] = (unsigned char)n;
+}
+
+static void make_value(unsigned char *value, uint32_t n)
+{
+    size_t i;
+    for(i = 0; i < CACHE_VALUE_SIZE; ++i)
+        value[i] = (unsigned char)(n * 31 + i);
+}
+
+static void *run(void *arg)
+{
+    struct Thread *t = arg;
+    unsigned char expected[CACHE_VALUE_SIZE], value[CACHE_VALUE_SIZE];
+    struct ClientAddr key;
+
+    while(!stop)
+    {
+        int i;
+        /* Check the stop flag every few operations only */
+        for(i = 0; i < 256; ++i)
+        {
+            uint64_t r = next_random(&t->seed);
+            uint32_t n = (uint32_t)(r % t->key_space);
+            make_key(&key, n);
+            make_value(expected, n);
+            if((r >> 32) % 10 == 0)
+                cache_add(&key, expected, CACHE_VALUE_SIZE);
+            else
+            {
+                size_t size = sizeof(value);
+                if(cache_get(&key, value, &size) == 0)
+                {
+                    ++t->hits;
+                    if(size != CACHE_VALUE_SIZE
+                     || memcmp(value, expected, CACHE_VALUE_SIZE) != 0)
+                        ++t->corrupted;
+                }
+            }
+        }
+        t->ops += 256;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    static const int thread_counts[] = { 1, 2, 4, 8 };
+    struct Thread threads[8];
+    double seconds = (argc > 1)?atof(argv[1]):1.0;
+    size_t capacity = (argc > 2)?(size_t)atol(argv[2]):65536;
+    uint64_t total_corrupted = 0;
+    size_t r;
+
+    if(seconds <= 0 || capacity == 0)
+    {
+        fprintf(stderr, "Usage: bench-cache [seconds per run] [capacity]\n");
+        return 1;
+    }
+
+    printf("capacity %zu, %u shards, %d%% writes\n",
+           capacity, (unsigned int)CACHE_SHARDS, 10);
+    printf("threads      Mops/s   hit ratio   corrupted\n");
+    for(r = 0; r < sizeof(thread_counts) / sizeof(thread_counts[0]); ++r)
+    {
+        int n = thread_counts[r], i;
+        uint64_t ops = 0, hits = 0, corrupted = 0, start, elapsed;
+
+        if(cache_init(capacity, 3600) != 0)
+            return 1;
+
+        stop = 0;
+        start = timer_now_ms();
+        for(i = 0; i < n; ++i)
+        {
+            memset(&threads[i], 0, sizeof(threads[i]));
+            threads[i].seed = (uint64_t)i * 7919 + 1;
+            threads[i].key_space = (uint32_t)(capacity * KEY_SPACE_FACTOR);
+            if(pthread_create(&threads[i].thread, NULL, run, &threads[i]) != 0)
+            {
+                fprintf(stderr, "Error: can't start thread\n");
+                return 1;
+            }
+        }
+        while(timer_now_ms() - start < (uint64_t)(seconds * 1000))
+        {
+            struct timespec ts = { 0, 10000000 };
+            nanosleep(&ts, NULL);
+        }
+        stop = 1;
+        for(i = 0; i < n; ++i)
+        {
+            pthread_join(threads[i].thread, NULL);
+            ops += threads[i].ops;
+            hits += threads[i].hits;
+            corrupted += threads[i].corrupted;
+        }
+        elapsed = timer_now_ms() - start;
+
+        printf("%7d  %10.2f   %9.3f   %9llu\n", n,
+               (double)ops / (double)elapsed / 1000.0,
+               (double)hits / (double)(ops - ops / 10),
+               (unsigned long long)corrupted);
+        total_corrupted += corrupted;
+        cache_destroy();
+    }
+
+    return (total_corrupted == 0)?0:1;
+}
@@ -0,0 +1,498 @@
+/* End-to-end load test of the server over loopback.
+ *
+ * For each scenario, starts the server on a free loopback port, keeps
+ * a number of persistent connections busy with one request in flight each
+ * (a closed loop, like clients waiting for their answer), and measures
+ * every request from send() to the end of its response:
+ *  - redirect: a plain request, redirected to the destination
+ *  - probe-miss: captive.apple.com probes from a client that is not granted
+ *    yet (the grant delay is an hour)
+ *  - probe-hit: the same probes once the client is in the cache (the grant
+ *    delay is 0, and one probe is sent before measuring)
+ * Every response's status is checked; the program exits with an error if
+ * one is wrong or a connection fails. The results (throughput, and p50, p99
+ * and p99.9 latency) are printed as JSON, to compare builds.
+ *
+ * Usage: bench-load [seconds per scenario] [connections] [threads] [workers]
+ * HTTP_REDIRECT names the server binary (default: ./http-redirect). */
+
+#define _GNU_SOURCE /* memmem() */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define MAX_CONNECTIONS 4096
+#define MAX_THREADS 64
+#define RESPONSE_BUFFER 2048
+
+/* The cache forgets a client after CACHE_TTL (30 s): longer probe-hit runs
+ * would measure misses too */
+#define MAX_SECONDS 20
+
+struct Scenario {
+    const char *name;
+    const char *grant_delay;    /* server's -g */
+    const char *request;
+    const char *status;         /* expected status line prefix */
+    int warm_up;                /* send one request before measuring */
+};
+
+static const struct Scenario scenarios[] = {
+    {"redirect", "3600000",
+     "GET /index.html HTTP/1.1\r\n"
+     "Host: www.example.org\r\n"
+     "User-Agent: bench-load\r\n"
+     "\r\n",
+     "HTTP/1.1 307 ", 0},
+    {"probe-miss", "3600000",
+     "GET /hotspot-detect.html HTTP/1.1\r\n"
+     "Host: captive.apple.com\r\n"
+     "User-Agent: CaptiveNetworkSupport-481.100.2 wispr\r\n"
+     "\r\n",
+     "HTTP/1.1 307 ", 0},
+    {"probe-hit", "0",
+     "GET /hotspot-detect.html HTTP/1.1\r\n"
+     "Host: captive.apple.com\r\n"
+     "User-Agent: CaptiveNetworkSupport-481.100.2 wispr\r\n"
+     "\r\n",
+     "HTTP/1.1 200 ", 1}
+};
+
+struct Connection {
+    int sock;
+    uint64_t sent_at;           /* ns, 0 if no request in flight */
+    size_t received;
+    char buffer[RESPONSE_BUFFER];
+};
+
+struct Thread {
+    pthread_t thread;
+    const struct Scenario *scenario;
+    struct Connection *connections;
+    int count;
+    uint64_t *latencies;        /* ns, one per completed request */
+    size_t latency_count, latency_capacity;
+    unsigned long errors;
+};
+
+static struct sockaddr_in server_addr;
+static volatile int stop = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+static int connect_server(void)
+{
+    int one = 1;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock == -1)
+        return -1;
+    if(connect(sock, (struct sockaddr*)&server_addr,
+               sizeof(server_addr)) == -1)
+    {
+        close(sock);
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+/* A loopback port nothing listens on, as far as we can tell */
+static int free_port(void)
+{
+    struct sockaddr_in addr;
+    socklen_t size = sizeof(addr);
+    int port = -1;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(sock != -1 && bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0
+     && getsockname(sock, (struct sockaddr*)&addr, &size) == 0)
+        port = ntohs(addr.sin_port);
+    if(sock != -1)
+        close(sock);
+    return port;
+}
+
+/* Starts the server and waits until it accepts connections. Returns its
+ * pid, or -1. */
+static pid_t start_server(const char *binary, const char *grant_delay,
+                          const char *workers)
+{
+    char port[16];
+    pid_t pid;
+    int tries, p = free_port();
+
+    if(p == -1)
+        return -1;
+    sprintf(port, "%d", p);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port = htons((uint16_t)p);
+
+    pid = fork();
+    if(pid == -1)
+        return -1;
+    if(pid == 0)
+    {
+        /* Keep-alive long enough, and no limit on requests per connection,
+         * so that only requests are measured */
+        execl(binary, binary, "-q", "-b", "127.0.0.1", "-p", port,
+              "-g", grant_delay, "-k", "60000", "-m", "1000000",
+              "-n", "8192", "-w", workers, "example.com", (char*)NULL);
+        fprintf(stderr, "Error: can't run %s: %s\n", binary, strerror(errno));
+        _exit(127);
+    }
+
+    for(tries = 0; tries < 300; ++tries)
+    {
+        int sock = connect_server();
+        if(sock != -1)
+        {
+            close(sock);
+            return pid;
+        }
+        if(waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        sleep_ms(10);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stop_server(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+static int send_request(struct Connection *c, const char *request)
+{
+    size_t length = strlen(request), sent = 0;
+    c->received = 0;
+    c->sent_at = now_ns();
+    while(sent < length)
+    {
+        ssize_t n = send(c->sock, request + sent, length - sent, MSG_NOSIGNAL);
+        if(n <= 0)
+            return -1;
+        sent += (size_t)n;
+    }
+    return 0;
+}
+
+/* 1 if the buffer holds a whole response, 0 if not yet, -1 if it is
+ * malformed */
+static int response_complete(const struct Connection *c)
+{
+    const char *end, *length;
+    size_t head, body = 0;
+
+    end = memmem(c->buffer, c->received, "\r\n\r\n", 4);
+    if(end == NULL)
+        return (c->received == sizeof(c->buffer))?-1:0;
+    head = (size_t)(end - c->buffer) + 4;
+    length = memmem(c->buffer, head, "Content-Length: ", 16);
+    if(length != NULL)
+        body = (size_t)strtoul(length + 16, NULL, 10);
+    if(head + body > sizeof(c->buffer))
+        return -1;
+    return (c->received >= head + body)?1:0;
+}
+
+static void record(struct Thread *t, uint64_t latency)
+{
+    if(t->latency_count == t->latency_capacity)
+    {
+        size_t capacity = t->latency_capacity?t->latency_capacity * 2:65536;
+        uint64_t *p = realloc(t->latencies, capacity * sizeof(uint64_t));
+        if(p == NULL)
+        {
+            ++t->errors;
+            return;
+        }
+        t->latencies = p;
+        t->latency_capacity = capacity;
+    }
+    t->latencies[t->latency_count++] = latency;
+}
+
+static void *run(void *arg)
+{
+    struct Thread *t = arg;
+    const struct Scenario *s = t->scenario;
+    struct pollfd fds[MAX_CONNECTIONS];
+    int i, busy = t->count;
+
+    for(i = 0; i < t->count; ++i)
+    {
+        fds[i].fd = t->connections[i].sock;
+        fds[i].events = POLLIN;
+        if(send_request(&t->connections[i], s->request) == -1)
+        {
+            ++t->errors;
+            return NULL;
+        }
+    }
+
+    /* Once stopped, wait for the requests in flight, but not forever */
+    while(busy > 0)
+    {
+        int n = poll(fds, (nfds_t)t->count, 1000);
+        if(n == 0 && stop)
+        {
+            t->errors += (unsigned long)busy;
+            break;
+        }
+        if(n <= 0)
+            continue;
+        for(i = 0; i < t->count; ++i)
+        {
+            struct Connection *c = &t->connections[i];
+            ssize_t r;
+            int complete;
+
+            if(!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            r = recv(c->sock, c->buffer + c->received,
+                     sizeof(c->buffer) - c->received, 0);
+            if(r <= 0)
+            {
+                /* The server must keep every connection open */
+                ++t->errors;
+                fds[i].fd = -1;
+                --busy;
+                continue;
+            }
+            c->received += (size_t)r;
+            complete = response_complete(c);
+            if(complete == 0)
+                continue;
+            if(complete == -1 || strncmp(c->buffer, s->status,
+                                         strlen(s->status)) != 0)
+                ++t->errors;
+            else
+                record(t, now_ns() - c->sent_at);
+
+            if(stop)
+            {
+                c->sent_at = 0;
+                fds[i].fd = -1;
+                --busy;
+            }
+            else if(send_request(c, s->request) == -1)
+            {
+                ++t->errors;
+                fds[i].fd = -1;
+                --busy;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* In µs, from sorted latencies */
+static double percentile(const uint64_t *sorted, size_t count, double p)
+{
+    size_t i;
+    if(count == 0)
+        return 0;
+    i = (size_t)(p * (double)(count - 1) + 0.5);
+    return (double)sorted[i] / 1000.0;
+}
+
+/* Sends one request on a connection of its own and checks its status line;
+ * used to put the client in the cache */
+static int warm_up(const struct Scenario *s)
+{
+    static struct Connection c;
+    int complete = 0;
+
+    c.sock = connect_server();
+    if(c.sock == -1 || send_request(&c, s->request) == -1)
+        return -1;
+    while(complete == 0)
+    {
+        ssize_t r = recv(c.sock, c.buffer + c.received,
+                         sizeof(c.buffer) - c.received, 0);
+        if(r <= 0)
+            break;
+        c.received += (size_t)r;
+        complete = response_complete(&c);
+    }
+    close(c.sock);
+    /* The grant timer needs a tick */
+    sleep_ms(100);
+    return (complete == 1)?0:-1;
+}
+
+static int run_scenario(const struct Scenario *s, const char *binary,
+                        double seconds, int connections, int thread_count,
+                        const char *workers, int first)
+{
+    static struct Connection conns[MAX_CONNECTIONS];
+    struct Thread threads[MAX_THREADS];
+    uint64_t *all = NULL, start, elapsed;
+    size_t total = 0;
+    unsigned long errors = 0;
+    pid_t pid;
+    int i, ret = 0;
+
+    pid = start_server(binary, s->grant_delay, workers);
+    if(pid == -1)
+    {
+        fprintf(stderr, "Error: can't start %s\n", binary);
+        return -1;
+    }
+    if(s->warm_up && warm_up(s) == -1)
+    {
+        fprintf(stderr, "Error: %s: warm-up request failed\n", s->name);
+        stop_server(pid);
+        return -1;
+    }
+    for(i = 0; i < connections; ++i)
+    {
+        conns[i].sock = connect_server();
+        if(conns[i].sock == -1)
+        {
+            fprintf(stderr, "Error: %s: can't open connection %d: %s\n",
+                    s->name, i, strerror(errno));
+            while(i-- > 0)
+                close(conns[i].sock);
+            stop_server(pid);
+            return -1;
+        }
+    }
+
+    stop = 0;
+    start = now_ns();
+    for(i = 0; i < thread_count; ++i)
+    {
+        /* Connections split as evenly as possible */
+        int first_conn = connections * i / thread_count;
+        memset(&threads[i], 0, sizeof(threads[i]));
+        threads[i].scenario = s;
+        threads[i].connections = &conns[first_conn];
+        threads[i].count = connections * (i + 1) / thread_count - first_conn;
+        if(pthread_create(&threads[i].thread, NULL, run, &threads[i]) != 0)
+        {
+            fprintf(stderr, "Error: can't start thread\n");
+            exit(1);
+        }
+    }
+    sleep_ms((long)(seconds * 1000));
+    stop = 1;
+    elapsed = now_ns() - start;
+    for(i = 0; i < thread_count; ++i)
+    {
+        pthread_join(threads[i].thread, NULL);
+        total += threads[i].latency_count;
+        errors += threads[i].errors;
+    }
+    for(i = 0; i < connections; ++i)
+        close(conns[i].sock);
+    stop_server(pid);
+
+    all = malloc((total + 1) * sizeof(uint64_t));
+    if(all == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    total = 0;
+    for(i = 0; i < thread_count; ++i)
+    {
+        memcpy(all + total, threads[i].latencies,
+               threads[i].latency_count * sizeof(uint64_t));
+        total += threads[i].latency_count;
+        free(threads[i].latencies);
+    }
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+
+    printf("%s    {\"name\": \"%s\", \"requests\": %lu, \"errors\": %lu, "
+           "\"requests_per_second\": %.0f, \"p50_us\": %.1f, "
+           "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}",
+           first?"":",\n", s->name, (unsigned long)total, errors,
+           (double)total * 1e9 / (double)elapsed,
+           percentile(all, total, 0.50), percentile(all, total, 0.99),
+           percentile(all, total, 0.999), percentile(all, total, 1.0));
+    fflush(stdout);
+    if(errors > 0 || total == 0)
+    {
+        fprintf(stderr, "Error: %s: %lu failed requests\n", s->name, errors);
+        ret = -1;
+    }
+    free(all);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = (argc > 1)?atof(argv[1]):3.0;
+    int connections = (argc > 2)?atoi(argv[2]):64;
+    int thread_count = (argc > 3)?atoi(argv[3]):2;
+    const char *workers = (argc > 4)?argv[4]:"1";
+    const char *binary = getenv("HTTP_REDIRECT");
+    int ret = 0;
+    size_t i;
+
+    if(binary == NULL)
+        binary = "./http-redirect";
+    if(seconds <= 0 || seconds > MAX_SECONDS
+     || connections < 1 || connections > MAX_CONNECTIONS
+     || thread_count < 1 || thread_count > MAX_THREADS
+     || thread_count > connections || atoi(workers) < 1)
+    {
+        fprintf(stderr, "Usage: bench-load [seconds per scenario (at most "
+                "%d)] [connections]\n"
+                "                  [threads] [server workers]\n",
+                MAX_SECONDS);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("{\n  \"server\": \"%s\", \"seconds\": %g, \"connections\": %d, "
+           "\"threads\": %d, \"workers\": %d,\n  \"scenarios\": [\n",
+           binary, seconds, connections, thread_count, atoi(workers));
+    for(i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i)
+        if(run_scenario(&scenarios[i], binary, seconds, connections,
+                        thread_count, workers, i == 0) != 0)
+            ret = 1;
+    printf("\n  ]\n}\n");
+    return ret;
+}
@@ -0,0 +1,198 @@
+/* Request-head parser benchmark.
+ *
+ * Parses a corpus of captive-portal probes as sent by iOS, Android, Windows
+ * and Firefox, and reports how many request heads are parsed per second.
+ * Before timing anything, every request is also fed to the parser one byte
+ * at a time and the result compared with a one-shot parse, and a few
+ * malformed or oversized heads are checked to be rejected; the program exits
+ * with an error if any of this fails.
+ *
+ * Usage: bench-parse [seconds] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../request.h"
+#include "../scan.h"
+#include "../timer.h"
+
+#define BUFFER_SIZE 1024
+
+struct Probe {
+    const char *name;
+    const char *data;
+    const char *host; /* expected Host, without port */
+    const char *path; /* expected path */
+};
+
+static const struct Probe corpus[] = {
+    {"iOS",
+     "GET /hotspot-detect.html HTTP/1.0\r\n"
+     "Host: captive.apple.com\r\n"
+     "Connection: close\r\n"
+     "User-Agent: CaptiveNetworkSupport-481.100.2 wispr\r\n"
+     "\r\n",
+     "captive.apple.com", "/hotspot-detect.html"},
+    {"macOS",
+     "GET /hotspot-detect.html HTTP/1.1\r\n"
+     "Host: captive.apple.com\r\n"
+     "Accept: */*\r\n"
+     "Accept-Language: en-US,en;q=0.9\r\n"
+     "Connection: keep-alive\r\n"
+     "Accept-Encoding: gzip, deflate\r\n"
+     "User-Agent: CaptiveNetworkSupport-481.100.2 wispr\r\n"
+     "\r\n",
+     "captive.apple.com", "/hotspot-detect.html"},
+    {"Android",
+     "GET /generate_204 HTTP/1.1\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+     "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+     "Host: connectivitycheck.gstatic.com\r\n"
+     "Connection: Keep-Alive\r\n"
+     "Accept-Encoding: gzip\r\n"
+     "\r\n",
+     "connectivitycheck.gstatic.com", "/generate_204"},
+    {"Windows",
+     "GET /connecttest.txt HTTP/1.1\r\n"
+     "Connection: Close\r\n"
+     "User-Agent: Microsoft NCSI\r\n"
+     "Host: www.msftconnecttest.com\r\n"
+     "\r\n",
+     "www.msftconnecttest.com", "/connecttest.txt"},
+    {"Firefox",
+     "GET /canonical.html HTTP/1.1\r\n"
+     "Host: detectportal.firefox.com\r\n"
+     "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:121.0) "
+     "Gecko/20100101 Firefox/121.0\r\n"
+     "Accept: */*\r\n"
+     "Accept-Language: en-US,en;q=0.5\r\n"
+     "Accept-Encoding: gzip, deflate\r\n"
+     "Cache-Control: no-cache\r\n"
+     "Pragma: no-cache\r\n"
+     "Connection: keep-alive\r\n"
+     "\r\n",
+     "detectportal.firefox.com", "/canonical.html"},
+    {"curl (port, query)",
+     "GET /probe?x=1 HTTP/1.1\n"
+     "Host: [::1]:8080\n"
+     "User-Agent: curl/8.5.0\n"
+     "Accept: */*\n"
+     "\n",
+     "[::1]", "/probe"},
+};
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+static const char *const rejected[] = {
+    "GET /\r\n\r\n",
+    "GET / HTTP/2.0\r\n\r\n",
+    " GET / HTTP/1.1\r\n\r\n",
+    "GET / HTTP/1.1\r\nNo colon here\r\n\r\n",
+    "GET / HTTP/1.1\r\nHost : example.com\r\n\r\n",
+};
+#define REJECTED_SIZE (sizeof(rejected) / sizeof(rejected[0]))
+
+static int parse(struct RequestParser *parser, const char *data, size_t len)
+{
+    request_parser_init(parser);
+    return request_parse(parser, data, len, BUFFER_SIZE);
+}
+
+static int check(void)
+{
+    size_t i, j, len;
+    int errors = 0;
+    struct RequestParser whole, bytes;
+    char big[BUFFER_SIZE + 64];
+    int ret;
+
+    for(i = 0; i < CORPUS_SIZE; ++i)
+    {
+        const struct Probe *p = &corpus[i];
+        const struct Request *r = &whole.request;
+        len = strlen(p->data);
+
+        ret = parse(&whole, p->data, len);
+        if(ret != REQUEST_COMPLETE || r->head_size != len
+         || !span_equals(p->data, r->host, p->host)
+         || !span_equals(p->data, r->path, p->path)
+         || !span_equals(p->data, r->method, "get"))
+        {
+            fprintf(stderr, "%s: wrong one-shot parse\n", p->name);
+            ++errors;
+            continue;
+        }
+
+        /* Same request, split at every possible byte */
+        request_parser_init(&bytes);
+        ret = REQUEST_INCOMPLETE;
+        for(j = 1; j <= len && ret == REQUEST_INCOMPLETE; ++j)
+            ret = request_parse(&bytes, p->data, j, BUFFER_SIZE);
+        if(ret != REQUEST_COMPLETE
+         || memcmp(&whole.request, &bytes.request, sizeof(struct Request)) != 0)
+        {
+            fprintf(stderr, "%s: incremental parse differs\n", p->name);
+            ++errors;
+        }
+    }
+
+    for(i = 0; i < REJECTED_SIZE; ++i)
+        if(parse(&whole, rejected[i], strlen(rejected[i])) != REQUEST_BAD)
+        {
+            fprintf(stderr, "malformed request %u was accepted\n",
+                    (unsigned)i);
+            ++errors;
+        }
+
+    /* A head that doesn't end within the buffer */
+    memcpy(big, "GET / HTTP/1.1\r\nX-Padding: ", 27);
+    memset(big + 27, 'a', sizeof(big) - 27);
+    if(parse(&whole, big, BUFFER_SIZE) != REQUEST_TOO_LARGE)
+    {
+        fprintf(stderr, "oversized request was not rejected\n");
+        ++errors;
+    }
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = (argc > 1)?atof(argv[1]):2.0;
+    uint64_t start, elapsed, count = 0, bytes = 0;
+    struct RequestParser parser;
+    size_t i, lengths[CORPUS_SIZE];
+
+    printf("using %s scanning kernels\n", scan_init());
+    if(check() != 0)
+    {
+        fprintf(stderr, "FAILED\n");
+        return 1;
+    }
+    printf("corpus of %u requests checked (one-shot and byte by byte)\n",
+           (unsigned)CORPUS_SIZE);
+
+    for(i = 0; i < CORPUS_SIZE; ++i)
+        lengths[i] = strlen(corpus[i].data);
+
+    start = timer_now_ms();
+    do
+    {
+        int n;
+        for(n = 0; n < 1000; ++n)
+            for(i = 0; i < CORPUS_SIZE; ++i)
+            {
+                if(parse(&parser, corpus[i].data, lengths[i])
+                   != REQUEST_COMPLETE)
+                    return 1;
+                bytes += lengths[i];
+                ++count;
+            }
+        elapsed = timer_now_ms() - start;
+    } while(elapsed < (uint64_t)(seconds * 1000));
+
+    printf("%.2f Mreq/s, %.1f MB/s (%llu requests in %llu ms)\n",
+           count / (elapsed * 1000.0), bytes / (elapsed * 1000.0),
+           (unsigned long long)count, (unsigned long long)elapsed);
+    return 0;
+}
@@ -0,0 +1,175 @@
+/* Routing table benchmark.
+ *
+ * Builds tables of 10, 1000 and 100000 rules (tenant hosts with a few path
+ * prefixes each, plus "*" rules) and measures the cost of rules_lookup() on
+ * a mix of known hosts, unknown hosts and paths of various depths. Before
+ * timing, a sample of the lookups is checked against a linear scan of the
+ * rules; the program exits with an error if they disagree.
+ *
+ * Usage: bench-rules [lookups per table] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../rules.h"
+#include "../scan.h"
+#include "../timer.h"
+
+#define REQUESTS 4096
+#define CHECKED 2000
+
+static const char *const paths[] = {"/", "/guest", "/guest/login", "/api/"};
+#define PATH_COUNT (sizeof(paths) / sizeof(paths[0]))
+
+static const char *const request_paths[] = {
+    "/", "/guest", "/guest/login", "/guest/login/step2", "/guestbook",
+    "/api/v1/status", "/hotspot-detect.html", "/generate_204",
+};
+#define REQUEST_PATH_COUNT (sizeof(request_paths) / sizeof(request_paths[0]))
+
+struct Request {
+    char host[64];
+    const char *path;
+    size_t host_len, path_len;
+};
+
+static uint64_t next_random(uint64_t *state)
+{
+    /* splitmix64 */
+    uint64_t z = (*state += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+static int build(struct RuleTable *table, size_t count)
+{
+    char host[64], dest[64];
+    size_t i;
+
+    /* A couple of catch-all rules, then tenants with a rule per path */
+    if(rules_add(table, "*", "/", RULE_REDIRECT, "portal.example.net") != 0
+     || rules_add(table, "*", "/generate_204", RULE_SUCCESS, NULL) != 0)
+        return -1;
+    for(i = 2; i < count; ++i)
+    {
+        size_t tenant = (i - 2) / PATH_COUNT;
+        sprintf(host, "Tenant%lu.Example.NET", (unsigned long)tenant);
+        sprintf(dest, "login.tenant%lu.example.net", (unsigned long)tenant);
+        if(rules_add(table, host, paths[(i - 2) % PATH_COUNT],
+                     (i % 7 == 0)?RULE_PORTAL:RULE_REDIRECT, dest) != 0)
+            return -1;
+    }
+    return rules_compile(table);
+}
+
+/* What rules_lookup() should return, by scanning every rule */
+static const struct Rule *reference(const struct RuleTable *table,
+                                    const struct Request *req)
+{
+    const struct Rule *best = NULL;
+    int pass;
+    size_t i;
+
+    for(pass = 0; pass < 2 && best == NULL; ++pass)
+        for(i = 0; i < rules_count(table); ++i)
+        {
+            const struct Rule *rule = rules_get(table, i);
+            size_t len = strlen(rule->path);
+            int host_ok = (pass == 0)
+                ?(req->host_len != 0 && strlen(rule->host) == req->host_len
+                  && scan_equals_lower(req->host, rule->host, req->host_len))
+                :strcmp(rule->host, "*") == 0;
+            if(host_ok && len <= req->path_len
+             && memcmp(rule->path, req->path, len) == 0
+             && (best == NULL || len > strlen(best->path)))
+                best = rule;
+        }
+    return best;
+}
+
+static void make_requests(struct Request *requests, size_t tenants,
+                          uint64_t *seed)
+{
+    size_t i;
+    for(i = 0; i < REQUESTS; ++i)
+    {
+        struct Request *req = &requests[i];
+        uint64_t r = next_random(seed);
+        /* 80% known tenants (in random case), 20% unknown hosts */
+        if(r % 10 < 8 && tenants > 0)
+            sprintf(req->host, (r & 16)?"tenant%lu.example.net"
+                                       :"TENANT%lu.EXAMPLE.NET",
+                    (unsigned long)((r >> 8) % tenants));
+        else
+            sprintf(req->host, "unknown%lu.example.org",
+                    (unsigned long)((r >> 8) % 1000));
+        req->host_len = strlen(req->host);
+        req->path = request_paths[(r >> 40) % REQUEST_PATH_COUNT];
+        req->path_len = strlen(req->path);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = {10, 1000, 100000};
+    static struct Request requests[REQUESTS];
+    long lookups = (argc > 1)?atol(argv[1]):4000000;
+    uint64_t seed = 1;
+    size_t s;
+
+    if(lookups <= 0)
+        lookups = 1;
+    scan_init();
+
+    printf("%8s %12s %14s\n", "rules", "compile ms", "ns/lookup");
+    for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        struct RuleTable *table = rules_new();
+        uint64_t start, elapsed;
+        size_t i, matched = 0;
+        long n;
+
+        start = timer_now_ms();
+        if(table == NULL || build(table, sizes[s]) != 0)
+        {
+            fprintf(stderr, "Error: out of memory\n");
+            return 1;
+        }
+        elapsed = timer_now_ms() - start;
+        make_requests(requests, (sizes[s] - 2 + PATH_COUNT - 1) / PATH_COUNT,
+                      &seed);
+
+        for(i = 0; i < CHECKED; ++i)
+        {
+            const struct Request *req = &requests[i];
+            if(rules_lookup(table, req->host, req->host_len,
+                            req->path, req->path_len) != reference(table, req))
+            {
+                fprintf(stderr, "FAILED: wrong rule for %s%s\n",
+                        req->host, req->path);
+                return 1;
+            }
+        }
+
+        start = timer_now_ms();
+        for(n = 0; n < lookups; ++n)
+        {
+            const struct Request *req = &requests[n & (REQUESTS - 1)];
+            matched += rules_lookup(table, req->host, req->host_len,
+                                    req->path, req->path_len) != NULL;
+        }
+        printf("%8lu %12llu %14.1f\n", (unsigned long)sizes[s],
+               (unsigned long long)elapsed,
+               (timer_now_ms() - start) * 1e6 / (double)lookups);
+        if(matched != (size_t)lookups)
+        {
+            fprintf(stderr, "FAILED: some requests matched no rule\n");
+            return 1;
+        }
+        rules_free(table);
+    }
+    return 0;
+}
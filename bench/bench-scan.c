@@ -0,0 +1,200 @@
+/* Header-scanning kernel benchmark.
+ *
+ * For every set of kernels the CPU supports (scalar, SSE2, AVX2), measures
+ * on request heads of realistic sizes:
+ * - lines: splitting the head into lines (find_byte '\n'),
+ * - head end: looking for "\r\n\r\n",
+ * - compare: case-insensitive comparison with a lowercase copy,
+ * and reports bytes per cycle (per nanosecond where there is no cycle
+ * counter). Before timing, every kernel is checked against the scalar one
+ * on random inputs of every length up to 300 bytes; the program exits with
+ * an error if one disagrees.
+ *
+ * Usage: bench-scan [iterations] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../scan.h"
+#include "../timer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define HAVE_CYCLES
+#endif
+
+#define MAX_HEAD 4096
+
+static const char *const lines[] = {
+    "GET /generate_204 HTTP/1.1\r\n",
+    "Host: connectivitycheck.gstatic.com\r\n",
+    "User-Agent: Mozilla/5.0 (Linux; Android 14; Pixel 8) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/120.0.0.0 Mobile Safari/537.36\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n",
+    "Accept-Language: en-US,en;q=0.5\r\n",
+    "Accept-Encoding: gzip, deflate\r\n",
+    "Connection: keep-alive\r\n",
+    "Cookie: session=8f2a61c4d0b94e7aa1e3c5f7b9d1e3f5; theme=dark; lang=en\r\n",
+};
+#define LINE_COUNT (sizeof(lines) / sizeof(lines[0]))
+
+static const size_t sizes[] = {128, 256, 512, 1024, 4096};
+#define SIZE_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+static uint64_t now_ticks(void)
+{
+#ifdef HAVE_CYCLES
+    return __rdtsc();
+#else
+    return timer_now_ms() * 1000000;
+#endif
+}
+
+/* A head of exactly size bytes: request line, headers, padding, CRLF CRLF */
+static size_t build_head(char *head, size_t size)
+{
+    size_t len = 0, i = 0;
+    while(len + strlen(lines[i % LINE_COUNT]) + 2 <= size)
+    {
+        size_t n = strlen(lines[i % LINE_COUNT]);
+        memcpy(head + len, lines[i % LINE_COUNT], n);
+        len += n;
+        ++i;
+    }
+    /* Pad the last header value so that the head is exactly size bytes */
+    while(len + 2 < size)
+        head[len++] = 'x';
+    memcpy(head + len, "\r\n", 2);
+    memcpy(head + size - 4, "\r\n\r\n", 4);
+    return size;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    /* splitmix64 */
+    uint64_t z = (*state += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+static int check(const struct ScanKernels *k)
+{
+    const struct ScanKernels *ref = &scan_all_kernels[0];
+    static const char alphabet[] = "\r\n\r\nAaZz:@[`{ -\x80\xff";
+    char buf[300], low[300];
+    uint64_t seed = 42;
+    size_t len, i;
+    int round;
+
+    for(round = 0; round < 50; ++round)
+        for(len = 0; len <= sizeof(buf); ++len)
+        {
+            for(i = 0; i < len; ++i)
+            {
+                buf[i] = alphabet[next_random(&seed) % (sizeof(alphabet) - 1)];
+                low[i] = (buf[i] >= 'A' && buf[i] <= 'Z')?buf[i] + 32:buf[i];
+            }
+            /* Break the match at a random place half of the time */
+            if(len > 0 && (round & 1))
+                low[next_random(&seed) % len] ^= 1;
+
+            if(k->find_byte(buf, len, '\n') != ref->find_byte(buf, len, '\n')
+             || k->find_byte(buf, len, ':') != ref->find_byte(buf, len, ':')
+             || k->find_head_end(buf, len) != ref->find_head_end(buf, len)
+             || !k->equals_lower(buf, low, len)
+                != !ref->equals_lower(buf, low, len))
+            {
+                fprintf(stderr, "%s disagrees with scalar (length %u)\n",
+                        k->name, (unsigned)len);
+                return -1;
+            }
+        }
+    return 0;
+}
+
+static volatile size_t sink;
+
+static double run_lines(const struct ScanKernels *k, const char *head,
+                        size_t len, long iterations)
+{
+    uint64_t start = now_ticks();
+    long n;
+    for(n = 0; n < iterations; ++n)
+    {
+        const char *p = head, *end = head + len;
+        size_t count = 0;
+        while(p < end && (p = k->find_byte(p, (size_t)(end - p), '\n')) != NULL)
+        {
+            ++p;
+            ++count;
+        }
+        sink += count;
+    }
+    return (double)len * iterations / (double)(now_ticks() - start);
+}
+
+static double run_head_end(const struct ScanKernels *k, const char *head,
+                           size_t len, long iterations)
+{
+    uint64_t start = now_ticks();
+    long n;
+    for(n = 0; n < iterations; ++n)
+        sink += (size_t)(k->find_head_end(head, len) - head);
+    return (double)len * iterations / (double)(now_ticks() - start);
+}
+
+static double run_compare(const struct ScanKernels *k, const char *head,
+                          const char *low, size_t len, long iterations)
+{
+    uint64_t start = now_ticks();
+    long n;
+    for(n = 0; n < iterations; ++n)
+        sink += (size_t)k->equals_lower(head, low, len);
+    return (double)len * iterations / (double)(now_ticks() - start);
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = (argc > 1)?atol(argv[1]):200000;
+    static char head[MAX_HEAD], low[MAX_HEAD];
+    const struct ScanKernels *k;
+    size_t s, i;
+
+    if(iterations <= 0)
+        iterations = 1;
+
+    for(k = scan_all_kernels; k->name != NULL; ++k)
+        if(scan_supported(k) && check(k) != 0)
+        {
+            fprintf(stderr, "FAILED\n");
+            return 1;
+        }
+    printf("kernels checked against scalar; default: %s\n", scan_init());
+
+#ifdef HAVE_CYCLES
+    printf("%-7s %6s %10s %10s %10s   (bytes/cycle)\n",
+#else
+    printf("%-7s %6s %10s %10s %10s   (bytes/ns)\n",
+#endif
+           "kernels", "size", "lines", "head end", "compare");
+    for(s = 0; s < SIZE_COUNT; ++s)
+    {
+        size_t len = build_head(head, sizes[s]);
+        for(i = 0; i < len; ++i)
+            low[i] = (head[i] >= 'A' && head[i] <= 'Z')?head[i] + 32:head[i];
+
+        for(k = scan_all_kernels; k->name != NULL; ++k)
+        {
+            long it = (long)(iterations * 512 / len);
+            if(!scan_supported(k))
+                continue;
+            printf("%-7s %6u %10.2f %10.2f %10.2f\n", k->name, (unsigned)len,
+                   run_lines(k, head, len, it), run_head_end(k, head, len, it),
+                   run_compare(k, head, low, len, it));
+        }
+    }
+    return 0;
+}
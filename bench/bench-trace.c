@@ -0,0 +1,452 @@
+/* Trace-driven benchmark of the captive-portal cache.
+ *
+ * Replays client probes against cache_get()/cache_add() the way the server
+ * issues them: a probe is a cache_get(), a miss schedules a cache_add() of
+ * the client grant_delay ms later, and cache_expire() sweeps the table every
+ * second. Time is simulated (the cache's clock is replaced with the
+ * replay's), so an hour of a venue's traffic takes a few seconds, and the
+ * grants and sweeps are driven by a timer wheel as in the server.
+ *
+ * The trace is either synthetic or recorded:
+ *
+ * - synthetic: a steady population of clients, each probing every reprobe
+ *   interval (+/- 25%) and staying for an exponentially distributed time
+ *   before being replaced by a newcomer with a new address. Without -n, the
+ *   population is swept from 256 to 65536 clients.
+ * - recorded (-f): lines starting with "<seconds> <ip>", in time order, such
+ *   as the access log in the compact format; every line is a probe.
+ *
+ * For each run it reports the hit ratio, the grants, the live entries
+ * evicted to make room for others (the churn that makes a granted client see
+ * the portal again), the entries expired by the sweeps, the most entries
+ * alive at once, and the throughput of the cache_get() and cache_add() calls
+ * alone. The memory the table takes per entry of capacity is printed first.
+ *
+ * Usage: bench-trace [-c capacity] [-t ttl s] [-g grant delay ms]
+ *                    [-r reprobe s] [-d mean stay s, 0 for ever]
+ *                    [-T duration s] [-n clients | -f trace] */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "../addr.h"
+#include "../cache.h"
+#include "../log.h"
+#include "../timer.h"
+
+/* As in http-redirect.c */
+#define CACHE_EXPIRE_BUDGET 16384
+
+/* Simulated time starts here, so that no expiry time is near zero */
+#define EPOCH 1000000000
+
+struct Options {
+    size_t capacity;
+    int ttl;                /* s */
+    uint64_t grant_delay;   /* ms */
+    uint64_t reprobe;       /* ms */
+    uint64_t stay;          /* ms, mean; 0 if clients never leave */
+    uint64_t duration;      /* ms */
+};
+
+struct Result {
+    uint64_t probes;
+    uint64_t hits;
+    uint64_t grants;
+    uint64_t evictions;
+    uint64_t expired;
+    size_t peak;
+    uint64_t cache_ns;      /* spent in cache_get() and cache_add() */
+    uint64_t cache_calls;
+};
+
+/* A miss being granted, as struct Grant in http-redirect.c */
+struct Grant {
+    struct Timer timer;
+    struct ClientAddr key;
+};
+
+/* A client of the synthetic trace */
+struct Client {
+    struct Timer probe;
+    struct ClientAddr key;
+    uint64_t leaves;        /* ms */
+};
+
+static struct TimerWheel wheel;
+static struct Timer expire_timer;
+static uint64_t now;        /* ms of simulated time */
+static struct Result result;
+static const struct Options *options;
+static uint64_t random_state = 1;
+static uint32_t next_address = 0;
+static uint64_t clock_overhead; /* ns taken by a pair of clock reads */
+
+static time_t simulated_clock(void)
+{
+    return (time_t)(EPOCH + now / 1000);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Adds the time since start to the cache calls' */
+static void account(uint64_t start)
+{
+    uint64_t elapsed = now_ns() - start;
+    result.cache_ns += (elapsed > clock_overhead)?elapsed - clock_overhead:0;
+    ++result.cache_calls;
+}
+
+static uint64_t next_random(void)
+{
+    /* splitmix64 */
+    uint64_t z = (random_state += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double next_uniform(void)
+{
+    return (double)(next_random() >> 11) / 9007199254740992.0;
+}
+
+static void grant_expired(struct Timer *timer)
+{
+    struct Grant *grant = timer->data;
+    uint64_t start = now_ns();
+    int added = cache_add(&grant->key, (void *)"1", 1);
+    size_t count;
+
+    account(start);
+    if(added == 0)
+        ++result.grants;
+    count = cache_count();
+    if(count > result.peak)
+        result.peak = count;
+    free(grant);
+}
+
+static void expire_cache(struct Timer *timer)
+{
+    /* Background work: not part of the throughput */
+    result.expired += cache_expire(CACHE_EXPIRE_BUDGET);
+    timer_schedule(&wheel, timer, now, 1000);
+}
+
+/* A probe from key: granted clients get through, others are granted later */
+static void probe(const struct ClientAddr *key)
+{
+    uint64_t start = now_ns();
+    int hit = (cache_get(key, NULL, NULL) == 0);
+    struct Grant *grant;
+
+    account(start);
+    ++result.probes;
+    if(hit)
+    {
+        ++result.hits;
+        return;
+    }
+    grant = malloc(sizeof(struct Grant));
+    if(grant == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    grant->key = *key;
+    timer_init(&grant->timer, grant_expired, grant);
+    timer_schedule(&wheel, &grant->timer, now, options->grant_delay);
+}
+
+/* Fires everything due up to t */
+static void advance(uint64_t t)
+{
+    if(t > now)
+        now = t;
+    timer_wheel_advance(&wheel, now);
+}
+
+/* Gives a synthetic client a new address and a time to leave */
+static void arrive(struct Client *client)
+{
+    uint32_t n = next_address++;
+
+    memset(&client->key, 0, sizeof(client->key));
+    client->key.family = 4;
+    client->key.bytes[0] = (unsigned char)(10 + (n >> 24));
+    client->key.bytes[1] = (unsigned char)(n >> 16);
+    client->key.bytes[2] = (unsigned char)(n >> 8);
+    client->key.bytes[3] = (unsigned char)n;
+    client->leaves = UINT64_MAX;
+    if(options->stay != 0)
+        client->leaves = now + (uint64_t)(-log(1.0 - next_uniform())
+                                          * (double)options->stay);
+}
+
+static void client_probe(struct Timer *timer)
+{
+    struct Client *client = timer->data;
+    uint64_t jitter = options->reprobe / 2;
+
+    if(now >= client->leaves)
+        arrive(client);
+    probe(&client->key);
+    timer_schedule(&wheel, timer, now, options->reprobe - jitter / 2
+                   + (jitter != 0?next_random() % jitter:0));
+}
+
+static void begin_run(void)
+{
+    memset(&result, 0, sizeof(result));
+    now = 0;
+    next_address = 0;
+    if(cache_init(options->capacity, options->ttl) != 0)
+        exit(1);
+    timer_wheel_init(&wheel, 0);
+    timer_init(&expire_timer, expire_cache, NULL);
+    timer_schedule(&wheel, &expire_timer, now, 1000);
+}
+
+static void end_run(void)
+{
+    struct Timer *timer;
+
+    while((timer = timer_wheel_pop(&wheel)) != NULL)
+    {
+        if(timer->callback == grant_expired)
+            free(timer->data);
+    }
+    result.evictions = cache_evictions();
+    cache_destroy();
+}
+
+static void run_synthetic(size_t clients)
+{
+    struct Client *population = calloc(clients, sizeof(struct Client));
+    size_t i;
+
+    if(population == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    begin_run();
+    /* Everyone is already there, with probes spread over an interval */
+    for(i = 0; i < clients; ++i)
+    {
+        arrive(&population[i]);
+        timer_init(&population[i].probe, client_probe, &population[i]);
+        timer_schedule(&wheel, &population[i].probe, now,
+                       next_random() % (options->reprobe + 1));
+    }
+    while(now < options->duration)
+    {
+        uint64_t t = now + (uint64_t)timer_wheel_timeout(&wheel, now, 1000);
+        advance((t < options->duration)?t:options->duration);
+    }
+    end_run();
+    free(population);
+}
+
+/* Returns 0, or -1 if the trace can't be read */
+static int run_recorded(const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    char line[512];
+    double first = -1;
+    unsigned long lineno = 0, skipped = 0;
+
+    if(file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+    begin_run();
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        char ip[64];
+        double seconds;
+        struct sockaddr_in sin;
+        struct sockaddr_in6 sin6;
+        struct ClientAddr key;
+
+        ++lineno;
+        if(sscanf(line, "%lf %63s", &seconds, ip) != 2)
+        {
+            ++skipped;
+            continue;
+        }
+        memset(&sin, 0, sizeof(sin));
+        memset(&sin6, 0, sizeof(sin6));
+        if(inet_pton(AF_INET, ip, &sin.sin_addr) == 1)
+        {
+            sin.sin_family = AF_INET;
+            client_addr_from_sockaddr(&key, &sin, sizeof(sin));
+        }
+        else if(inet_pton(AF_INET6, ip, &sin6.sin6_addr) == 1)
+        {
+            sin6.sin6_family = AF_INET6;
+            client_addr_from_sockaddr(&key, &sin6, sizeof(sin6));
+        }
+        else
+        {
+            ++skipped;
+            continue;
+        }
+        if(first < 0)
+            first = seconds;
+        /* Lines out of order are replayed at the current time */
+        advance((seconds > first)?(uint64_t)((seconds - first) * 1000):0);
+        probe(&key);
+    }
+    fclose(file);
+    if(skipped != 0)
+        fprintf(stderr, "%lu of %lu lines skipped\n", skipped, lineno);
+    end_run();
+    return 0;
+}
+
+static void print_header(void)
+{
+    size_t slots, bytes;
+
+    if(cache_init(options->capacity, options->ttl) != 0)
+        exit(1);
+    slots = CACHE_SHARDS * (global_cache.shards[0].mask + 1);
+    bytes = slots * sizeof(CacheEntry) + CACHE_SHARDS * sizeof(CacheShard);
+    cache_destroy();
+
+    printf("capacity %zu, ttl %d s, grant delay %llu ms, reprobe %llu s, "
+           "stay %llu s, %u shards\n", options->capacity, options->ttl,
+           (unsigned long long)options->grant_delay,
+           (unsigned long long)(options->reprobe / 1000),
+           (unsigned long long)(options->stay / 1000),
+           (unsigned int)CACHE_SHARDS);
+    printf("memory %zu bytes: %zu slots of %zu bytes, %.1f bytes per entry\n",
+           bytes, slots, sizeof(CacheEntry),
+           (double)bytes / (double)options->capacity);
+    printf(" clients      probes  hit ratio     grants  evictions"
+           "    expired     peak   Mops/s\n");
+    fflush(stdout);
+}
+
+static void print_result(const char *clients)
+{
+    printf("%8s  %10llu  %9.3f  %9llu  %9llu  %9llu  %7zu  %7.2f\n",
+           clients, (unsigned long long)result.probes,
+           (result.probes != 0)
+               ?(double)result.hits / (double)result.probes:0.0,
+           (unsigned long long)result.grants,
+           (unsigned long long)result.evictions,
+           (unsigned long long)result.expired, result.peak,
+           (result.cache_ns != 0)
+               ?(double)result.cache_calls * 1000.0 / (double)result.cache_ns
+               :0.0);
+}
+
+/* Measures what account() should leave out */
+static void calibrate(void)
+{
+    uint64_t start = now_ns(), total;
+    int i;
+
+    for(i = 0; i < 1000000; ++i)
+        (void)now_ns();
+    total = now_ns() - start;
+    /* account() reads the clock twice, which costs one of these per call */
+    clock_overhead = total / 1000000;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: bench-trace [-c capacity] [-t ttl s] "
+            "[-g grant delay ms] [-r reprobe s] [-d mean stay s] "
+            "[-T duration s] [-n clients | -f trace]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sweep[] = { 256, 1024, 4096, 16384, 65536 };
+    struct Options opts;
+    const char *trace = NULL;
+    long clients = 0;
+    int c;
+
+    /* Defaults of http-redirect */
+    opts.capacity = 1024;
+    opts.ttl = 30;
+    opts.grant_delay = 2000;
+    opts.reprobe = 60000;
+    opts.stay = 1800000;
+    opts.duration = 3600000;
+    while((c = getopt(argc, argv, "c:t:g:r:d:T:n:f:")) != -1)
+    {
+        long value = (optarg != NULL)?atol(optarg):0;
+        switch(c)
+        {
+            case 'c': opts.capacity = (size_t)value; break;
+            case 't': opts.ttl = (int)value; break;
+            case 'g': opts.grant_delay = (uint64_t)value; break;
+            case 'r': opts.reprobe = (uint64_t)value * 1000; break;
+            case 'd': opts.stay = (uint64_t)value * 1000; break;
+            case 'T': opts.duration = (uint64_t)value * 1000; break;
+            case 'n': clients = value; break;
+            case 'f': trace = optarg; break;
+            default: usage();
+        }
+        if(c != 'f' && value < 0)
+            usage();
+    }
+    if(optind != argc || opts.capacity == 0 || opts.ttl <= 0
+     || opts.reprobe == 0 || (trace != NULL && clients != 0))
+        usage();
+    options = &opts;
+
+    /* The table's own messages would get in the way of the results */
+    log_init(LOG_LEVEL_WARNING, LOG_ACCESS_TEXT, NULL);
+    cache_set_clock(simulated_clock);
+    calibrate();
+    print_header();
+    if(trace != NULL)
+    {
+        if(run_recorded(trace) != 0)
+            return 1;
+        print_result("trace");
+    }
+    else if(clients > 0)
+    {
+        char label[24];
+        run_synthetic((size_t)clients);
+        snprintf(label, sizeof(label), "%ld", clients);
+        print_result(label);
+    }
+    else
+    {
+        size_t i;
+        for(i = 0; i < sizeof(sweep) / sizeof(sweep[0]); ++i)
+        {
+            char label[24];
+            run_synthetic(sweep[i]);
+            snprintf(label, sizeof(label), "%zu", sweep[i]);
+            print_result(label);
+        }
+    }
+    return 0;
+}
@@ -1,164 +1,722 @@
 #include "cache.h"
+#include <stdio.h> // For rename()
 #include <stdlib.h>
 #include <string.h>
-#include <stdio.h> // For debugging, can be removed later
 #include <time.h> // Include time.h for time()
+#ifndef __WIN32__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "log.h"
 
 // Global cache instance definition
 Cache global_cache = { NULL, 0, 0, 0 };
 
-int cache_init(size_t capacity, int default_ttl) {
-    if (global_cache.entries != NULL) {
+#ifdef __WIN32__
+static void lock_shard(CacheShard *shard) { EnterCriticalSection(&shard->lock); }
+static void unlock_shard(CacheShard *shard) { LeaveCriticalSection(&shard->lock); }
+#else
+static void lock_shard(CacheShard *shard) { pthread_mutex_lock(&shard->lock); }
+static void unlock_shard(CacheShard *shard) { pthread_mutex_unlock(&shard->lock); }
+#endif
+
+// Source of the current time for expiry, replaceable for simulations
+static time_t system_clock(void) { return time(NULL); }
+static time_t (*cache_clock)(void) = system_clock;
+
+// Seqlock, writer side: called with the shard lock held
+static void write_begin(CacheShard *shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(CacheShard *shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+// FNV-1a over the binary address
+static uint32_t hash_key(const struct ClientAddr *key) {
+    const unsigned char *bytes = (const unsigned char *)key;
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < sizeof(struct ClientAddr); ++i) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// The top bits pick the shard, the low bits the slot inside it
+static CacheShard *shard_of(uint32_t hash) {
+    return &global_cache.shards[(hash >> 24) & (CACHE_SHARDS - 1)];
+}
+
+// Only formats the key when verbose logging needs it
+#define LOG_KEY(fmt, key) do { \
+        if (global_cache.verbose) { \
+            char key_str[CLIENT_ADDR_STRLEN]; \
+            log_message(LOG_LEVEL_INFO, fmt, client_addr_format(key, key_str, sizeof(key_str))); \
+        } \
+    } while (0)
+
+// Returns the slot holding key, or -1 if it is not in the table
+// Gives up after visiting every slot, which can only happen to a reader
+// racing with a writer (it will retry anyway)
+static long find_slot(const CacheShard *shard, const struct ClientAddr *key, uint32_t hash) {
+    size_t i = hash & shard->mask;
+    size_t n;
+    for (n = 0; n <= shard->mask && shard->entries[i].used; ++n) {
+        const CacheEntry *e = &shard->entries[i];
+        if (e->hash == hash && memcmp(&e->key, key, sizeof(struct ClientAddr)) == 0)
+            return (long)i;
+        i = (i + 1) & shard->mask;
+    }
+    return -1;
+}
+
+// Removes the entry in slot i, moving later entries of the same probe
+// sequence back so that no tombstones are needed
+static void remove_slot(CacheShard *shard, size_t i) {
+    CacheEntry *entries = shard->entries;
+    size_t mask = shard->mask;
+    size_t j = i;
+
+    for (;;) {
+        size_t home;
+        j = (j + 1) & mask;
+        if (!entries[j].used)
+            break;
+        home = entries[j].hash & mask;
+        // The entry at j can fill the hole unless its home slot lies
+        // cyclically in (i, j]
+        if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+            entries[i] = entries[j];
+            i = j;
+        }
+    }
+    entries[i].used = 0;
+    __atomic_store_n(&shard->count, shard->count - 1, __ATOMIC_RELAXED);
+}
+
+// Frees one slot using the CLOCK algorithm: expired entries and entries not
+// referenced since the hand last passed are evicted, others get a second chance
+static void evict_one(CacheShard *shard, time_t current_time) {
+    for (;;) {
+        size_t i = shard->clock_hand;
+        CacheEntry *e = &shard->entries[i];
+        shard->clock_hand = (i + 1) & shard->mask;
+        if (!e->used)
+            continue;
+        if (e->expires_at <= current_time || !__atomic_load_n(&e->referenced, __ATOMIC_RELAXED)) {
+            LOG_KEY("Evicting key '%s' from cache.", &e->key);
+            // Expired entries would have gone anyway
+            if (e->expires_at > current_time)
+                __atomic_store_n(&shard->evictions, shard->evictions + 1, __ATOMIC_RELAXED);
+            remove_slot(shard, i);
+            return;
+        }
+        __atomic_store_n(&e->referenced, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Slots of a shard holding capacity entries in all: the load factor stays at
+// or below 1/2 so probe sequences stay short. Returns 0 if that's too many.
+static size_t slots_for(size_t capacity) {
+    size_t shard_capacity = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    size_t slots = 1;
+    while (slots < shard_capacity * 2) {
+        if (slots > ((size_t)-1) / 2 / sizeof(CacheEntry) / CACHE_SHARDS)
+            return 0;
+        slots *= 2;
+    }
+    return slots;
+}
+
+// Checks what cache_init() and cache_init_file() can't accept
+static int check_init(size_t capacity) {
+    if (global_cache.shards != NULL) {
         // Cache already initialized
-        fprintf(stderr, "Cache already initialized.\n");
+        log_message(LOG_LEVEL_ERROR, "Cache already initialized.");
         return -1;
     }
 
     if (capacity == 0) {
-        fprintf(stderr, "Cache capacity cannot be zero.\n");
+        log_message(LOG_LEVEL_ERROR, "Cache capacity cannot be zero.");
         return -1;
     }
 
-    global_cache.entries = (CacheEntry *)calloc(capacity, sizeof(CacheEntry));
-    if (global_cache.entries == NULL) {
-        perror("Failed to allocate memory for cache entries");
+    if (slots_for(capacity) == 0) {
+        log_message(LOG_LEVEL_ERROR, "Cache capacity %zu is too large.", capacity);
+        return -1;
+    }
+    return 0;
+}
+
+// Sets up the shards, with their slots in storage (CACHE_SHARDS * slots of
+// them, whose entries are kept) or allocated if storage is NULL
+static int setup_shards(size_t capacity, int default_ttl, CacheEntry *storage) {
+    size_t shard_capacity = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    size_t slots = slots_for(capacity);
+    size_t i, j;
+
+    global_cache.shards = (CacheShard *)calloc(CACHE_SHARDS, sizeof(CacheShard));
+    if (global_cache.shards == NULL) {
+        log_message(LOG_LEVEL_ERROR, "Failed to allocate memory for cache shards");
         return -1;
     }
 
+    for (i = 0; i < CACHE_SHARDS; ++i) {
+        CacheShard *shard = &global_cache.shards[i];
+        if (storage != NULL) {
+            shard->entries = storage + i * slots;
+            for (j = 0; j < slots; ++j)
+                shard->count += shard->entries[j].used ? 1 : 0;
+        } else {
+            shard->entries = (CacheEntry *)calloc(slots, sizeof(CacheEntry));
+        }
+        if (shard->entries == NULL) {
+            log_message(LOG_LEVEL_ERROR, "Failed to allocate memory for cache entries");
+            while (i-- > 0)
+                free(global_cache.shards[i].entries);
+            free(global_cache.shards);
+            global_cache.shards = NULL;
+            return -1;
+        }
+        shard->mask = slots - 1;
+        shard->capacity = shard_capacity;
+#ifdef __WIN32__
+        InitializeCriticalSection(&shard->lock);
+#else
+        pthread_mutex_init(&shard->lock, NULL);
+#endif
+    }
+
     global_cache.capacity = capacity;
     global_cache.default_ttl = default_ttl;
-    global_cache.count = 0;
-
-    fprintf(stdout, "Cache initialized with capacity %zu and default TTL %d.\n", capacity, default_ttl);
     return 0;
 }
 
-int cache_add(const char *key, void *value, size_t value_size) {
-    if (global_cache.entries == NULL) {
-        fprintf(stderr, "Cache not initialized.\n");
+int cache_init(size_t capacity, int default_ttl) {
+    if (check_init(capacity) != 0 || setup_shards(capacity, default_ttl, NULL) != 0)
         return -1;
-    }
 
-    if (key == NULL || value == NULL || value_size == 0) {
-        fprintf(stderr, "Invalid arguments for cache_add.\n");
-        return -1;
+    log_message(LOG_LEVEL_INFO, "Cache initialized with capacity %zu and default TTL %d.", capacity, default_ttl);
+    return 0;
+}
+
+// Puts back an entry saved by another run or process (with a different
+// layout, or interrupted while writing); returns 1 if it was kept
+static int restore_entry(const CacheEntry *saved, time_t current_time) {
+    uint32_t hash;
+    CacheShard *shard;
+    size_t i;
+    int kept = 0;
+
+    if (!saved->used || (saved->key.family != 4 && saved->key.family != 6)
+        || saved->value_size == 0 || saved->value_size > CACHE_VALUE_SIZE
+        || saved->expires_at <= current_time)
+        return 0;
+    hash = hash_key(&saved->key);
+    shard = shard_of(hash);
+    lock_shard(shard);
+    write_begin(shard);
+    if (shard->count < shard->capacity && find_slot(shard, &saved->key, hash) == -1) {
+        i = hash & shard->mask;
+        while (shard->entries[i].used)
+            i = (i + 1) & shard->mask;
+        shard->entries[i] = *saved;
+        shard->entries[i].hash = hash;
+        shard->entries[i].referenced = 0;
+        __atomic_store_n(&shard->count, shard->count + 1, __ATOMIC_RELAXED);
+        kept = 1;
     }
+    write_end(shard);
+    unlock_shard(shard);
+    return kept;
+}
+
+#ifndef __WIN32__
 
-    // Find an empty slot or an expired entry to replace
+// Snapshot file: this header, padded to CACHE_FILE_HEADER_SIZE so that the
+// slots are page-aligned, then the slots of every shard in order, exactly as
+// they are in memory
+#define CACHE_FILE_MAGIC 0x50435248 // "HRCP" in little-endian memory
+#define CACHE_FILE_VERSION 1
+#define CACHE_FILE_HEADER_SIZE 4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;   // sizeof(CacheEntry), which depends on the ABI
+    uint32_t shards;       // CACHE_SHARDS of the program that wrote it
+    uint64_t slots;        // per shard
+    uint32_t clean;        // 1 once saved by cache_destroy(), 0 while in use
+    uint32_t reserved;
+    uint64_t checksum;     // of the slots, meaningful only if clean
+} CacheFileHeader;
+
+static unsigned char *file_map = NULL; // The whole file, NULL without one
+static size_t file_size = 0;
+static int file_fd = -1;
+
+// FNV-1a over 64-bit words (the slots are a multiple of 8 bytes)
+static uint64_t checksum_slots(const unsigned char *slots, size_t size) {
+    uint64_t hash = 14695981039346656037u;
     size_t i;
-    int found_slot = -1;
-    time_t current_time = time(NULL);
+    for (i = 0; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, slots + i, 8);
+        hash ^= word;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
 
-    for (i = 0; i < global_cache.capacity; ++i) {
-        if (global_cache.entries[i].key == NULL || global_cache.entries[i].expires_at <= current_time) {
-            // Found an empty or expired slot
-            found_slot = i;
-            break;
+// Reads the slots saved in fd if it holds a snapshot of any layout; *count
+// is 0 if it doesn't. Returns -1 if fd holds something else.
+static int read_saved(int fd, size_t size, const char *path, CacheEntry **saved, size_t *count) {
+    CacheFileHeader header;
+    size_t bytes, done = 0;
+
+    *saved = NULL;
+    *count = 0;
+    if (size == 0)
+        return 0;
+    if (size < CACHE_FILE_HEADER_SIZE
+        || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+        || header.magic != CACHE_FILE_MAGIC) {
+        log_message(LOG_LEVEL_ERROR, "%s is not a cache file.", path);
+        return -1;
+    }
+    if (header.version != CACHE_FILE_VERSION || header.entry_size != sizeof(CacheEntry)
+        || header.slots == 0 || header.shards == 0
+        || (size - CACHE_FILE_HEADER_SIZE) / sizeof(CacheEntry) / header.shards != header.slots) {
+        log_message(LOG_LEVEL_WARNING, "Ignoring the incompatible cache file %s.", path);
+        return 0;
+    }
+    bytes = (size_t)header.shards * (size_t)header.slots * sizeof(CacheEntry);
+    *saved = (CacheEntry *)malloc(bytes);
+    if (*saved == NULL) {
+        log_message(LOG_LEVEL_WARNING, "Not enough memory to restore %s.", path);
+        return 0;
+    }
+    while (done < bytes) {
+        ssize_t n = pread(fd, (char *)*saved + done, bytes - done, CACHE_FILE_HEADER_SIZE + (off_t)done);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            log_message(LOG_LEVEL_WARNING, "Can't read %s, ignoring it.", path);
+            free(*saved);
+            *saved = NULL;
+            return 0;
         }
+        done += (size_t)n;
     }
+    *count = bytes / sizeof(CacheEntry);
+    return 0;
+}
 
-    if (found_slot == -1) {
-        // Cache is full and no expired entries found
-        fprintf(stderr, "Cache is full. Cannot add entry for key '%s'.\n", key);
+int cache_init_file(size_t capacity, int default_ttl, const char *path) {
+    size_t slots, bytes, size, count = 0, restored = 0, i;
+    CacheFileHeader *header;
+    CacheEntry *saved = NULL;
+    char *tmp_path;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (check_init(capacity) != 0)
+        return -1;
+    slots = slots_for(capacity);
+    bytes = CACHE_SHARDS * slots * sizeof(CacheEntry);
+    size = CACHE_FILE_HEADER_SIZE + bytes;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        log_message(LOG_LEVEL_ERROR, "Can't open cache file %s: %s", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
         return -1;
     }
 
-    // If replacing an existing entry, free old memory
-    if (global_cache.entries[found_slot].key != NULL) {
-        free(global_cache.entries[found_slot].key);
-        free(global_cache.entries[found_slot].value);
-        global_cache.count--; // Decrement count as we are replacing
+    // Fast path: a clean snapshot of this very layout is used in place
+    if ((size_t)st.st_size == size) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            header = (CacheFileHeader *)map;
+            if (header->magic == CACHE_FILE_MAGIC && header->version == CACHE_FILE_VERSION
+                && header->entry_size == sizeof(CacheEntry) && header->shards == CACHE_SHARDS
+                && header->slots == slots && header->clean
+                && header->checksum == checksum_slots((unsigned char *)map + CACHE_FILE_HEADER_SIZE, bytes)) {
+                if (setup_shards(capacity, default_ttl, (CacheEntry *)((unsigned char *)map + CACHE_FILE_HEADER_SIZE)) != 0) {
+                    munmap(map, size);
+                    close(fd);
+                    return -1;
+                }
+                header->clean = 0;
+                msync(map, CACHE_FILE_HEADER_SIZE, MS_SYNC);
+                file_map = (unsigned char *)map;
+                file_size = size;
+                file_fd = fd;
+                log_message(LOG_LEVEL_INFO, "Cache initialized with capacity %zu and default TTL %d, %zu clients loaded from %s.",
+                            capacity, default_ttl, cache_count(), path);
+                return 0;
+            }
+            munmap(map, size);
+        }
     }
 
-    // Allocate memory for key and value
-    global_cache.entries[found_slot].key = strdup(key);
-    if (global_cache.entries[found_slot].key == NULL) {
-        perror("Failed to allocate memory for cache key");
-        // Attempt to clean up if value was already allocated
-        if (global_cache.entries[found_slot].value != NULL) {
-             free(global_cache.entries[found_slot].value);
-             global_cache.entries[found_slot].value = NULL;
+    // Otherwise the entries still valid are moved into a new snapshot, which
+    // replaces the file only once complete. A process still using the old
+    // one (when a new one takes over) keeps its own copy.
+    if (read_saved(fd, (size_t)st.st_size, path, &saved, &count) != 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    tmp_path = (char *)malloc(strlen(path) + 5);
+    if (tmp_path == NULL) {
+        log_message(LOG_LEVEL_ERROR, "Failed to allocate memory for cache file name");
+        free(saved);
+        return -1;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1 || ftruncate(fd, (off_t)size) == -1) {
+        log_message(LOG_LEVEL_ERROR, "Can't create cache file %s: %s", tmp_path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp_path);
         }
+        free(tmp_path);
+        free(saved);
+        return -1;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        log_message(LOG_LEVEL_ERROR, "Can't map cache file %s: %s", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        free(saved);
+        return -1;
+    }
+    if (setup_shards(capacity, default_ttl, (CacheEntry *)((unsigned char *)map + CACHE_FILE_HEADER_SIZE)) != 0) {
+        munmap(map, size);
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        free(saved);
+        return -1;
+    }
+    for (i = 0; i < count; ++i)
+        restored += (size_t)restore_entry(&saved[i], cache_clock());
+    free(saved);
+
+    header = (CacheFileHeader *)map;
+    header->magic = CACHE_FILE_MAGIC;
+    header->version = CACHE_FILE_VERSION;
+    header->entry_size = sizeof(CacheEntry);
+    header->shards = CACHE_SHARDS;
+    header->slots = slots;
+    header->clean = 0;
+    msync(map, CACHE_FILE_HEADER_SIZE, MS_SYNC);
+    if (rename(tmp_path, path) == -1)
+        log_message(LOG_LEVEL_WARNING, "Can't replace %s, using %s: %s", path, tmp_path, strerror(errno));
+    free(tmp_path);
+    file_map = (unsigned char *)map;
+    file_size = size;
+    file_fd = fd;
+    log_message(LOG_LEVEL_INFO, "Cache initialized with capacity %zu and default TTL %d, %zu clients restored from %s.",
+                capacity, default_ttl, restored, path);
+    return 0;
+}
+
+// Marks the snapshot as complete and unmaps it
+static void close_file(void) {
+    CacheFileHeader *header = (CacheFileHeader *)file_map;
+    header->checksum = checksum_slots(file_map + CACHE_FILE_HEADER_SIZE, file_size - CACHE_FILE_HEADER_SIZE);
+    header->clean = 1;
+    if (msync(file_map, file_size, MS_SYNC) == -1)
+        log_message(LOG_LEVEL_WARNING, "Can't save the cache file: %s", strerror(errno));
+    munmap(file_map, file_size);
+    close(file_fd);
+    file_map = NULL;
+    file_size = 0;
+    file_fd = -1;
+}
+
+#else
+
+int cache_init_file(size_t capacity, int default_ttl, const char *path) {
+    (void)capacity;
+    (void)default_ttl;
+    (void)path;
+    log_message(LOG_LEVEL_ERROR, "Cache files are not available on Windows.");
+    return -1;
+}
+
+#endif
+
+void cache_set_verbose(int verbose) {
+    global_cache.verbose = verbose;
+}
+
+void cache_set_clock(time_t (*clock)(void)) {
+    cache_clock = (clock != NULL) ? clock : system_clock;
+}
+
+int cache_add(const struct ClientAddr *key, void *value, size_t value_size) {
+    uint32_t hash;
+    long slot;
+    CacheShard *shard;
+    CacheEntry *e;
+    time_t current_time = cache_clock();
+
+    if (global_cache.shards == NULL) {
+        log_message(LOG_LEVEL_ERROR, "Cache not initialized.");
         return -1;
     }
 
-    global_cache.entries[found_slot].value = malloc(value_size);
-    if (global_cache.entries[found_slot].value == NULL) {
-        perror("Failed to allocate memory for cache value");
-        free(global_cache.entries[found_slot].key); // Free key if value allocation fails
-        global_cache.entries[found_slot].key = NULL;
+    if (key == NULL || value == NULL || value_size == 0 || value_size > CACHE_VALUE_SIZE) {
+        log_message(LOG_LEVEL_ERROR, "Invalid arguments for cache_add.");
         return -1;
     }
 
+    hash = hash_key(key);
+    shard = shard_of(hash);
+    lock_shard(shard);
+    write_begin(shard);
+
+    slot = find_slot(shard, key, hash);
+    if (slot == -1) {
+        size_t i;
+        if (shard->count >= shard->capacity)
+            evict_one(shard, current_time);
+
+        // Take the first free slot of the probe sequence
+        i = hash & shard->mask;
+        while (shard->entries[i].used)
+            i = (i + 1) & shard->mask;
+        e = &shard->entries[i];
+        e->hash = hash;
+        e->key = *key;
+        e->used = 1;
+        __atomic_store_n(&shard->count, shard->count + 1, __ATOMIC_RELAXED);
+    } else {
+        e = &shard->entries[slot];
+    }
+
     // Copy value and set expiration
-    memcpy(global_cache.entries[found_slot].value, value, value_size);
-    global_cache.entries[found_slot].value_size = value_size;
-    global_cache.entries[found_slot].expires_at = current_time + global_cache.default_ttl;
+    memcpy(e->value, value, value_size);
+    e->value_size = (unsigned char)value_size;
+    e->expires_at = current_time + global_cache.default_ttl;
+    e->referenced = 1;
+
+    write_end(shard);
+    unlock_shard(shard);
 
-    global_cache.count++;
-    fprintf(stdout, "Added key '%s' to cache. Expires at %ld.\n", key, (long)global_cache.entries[found_slot].expires_at);
+    if (global_cache.verbose) {
+        char key_str[CLIENT_ADDR_STRLEN];
+        log_message(LOG_LEVEL_INFO, "Added key '%s' to cache. Expires at %ld.",
+                client_addr_format(key, key_str, sizeof(key_str)),
+                (long)(current_time + global_cache.default_ttl));
+    }
 
     return 0;
 }
 
-void *cache_get(const char *key, size_t *value_size) {
-    if (global_cache.entries == NULL) {
-        fprintf(stderr, "Cache not initialized.\n");
-        return NULL;
+int cache_get(const struct ClientAddr *key, void *value, size_t *value_size) {
+    uint32_t hash;
+    CacheShard *shard;
+    unsigned char copy[CACHE_VALUE_SIZE];
+    size_t copy_size = 0;
+    time_t expires_at = 0;
+    unsigned int seq;
+    long slot = -1;
+
+    if (global_cache.shards == NULL) {
+        log_message(LOG_LEVEL_ERROR, "Cache not initialized.");
+        return -1;
     }
 
-    if (key == NULL || value_size == NULL) {
-        fprintf(stderr, "Invalid arguments for cache_get.\n");
-        return NULL;
+    if (key == NULL || (value != NULL && value_size == NULL)) {
+        log_message(LOG_LEVEL_ERROR, "Invalid arguments for cache_get.");
+        return -1;
     }
 
-    time_t current_time = time(NULL);
+    hash = hash_key(key);
+    shard = shard_of(hash);
 
-    // Find the entry by key
-    size_t i;
-    for (i = 0; i < global_cache.capacity; ++i) {
-        if (global_cache.entries[i].key != NULL && strcmp(global_cache.entries[i].key, key) == 0) {
-            // Found the key, check if expired
-            if (global_cache.entries[i].expires_at > current_time) {
-                // Not expired, return value
-                *value_size = global_cache.entries[i].value_size;
-                fprintf(stdout, "Cache hit for key '%s'.\n", key);
-                return global_cache.entries[i].value;
+    // Optimistic read: copy the entry out, then make sure no writer touched
+    // the shard in the meantime
+    do {
+        seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue; // A writer is active, its critical section is short
+        slot = find_slot(shard, key, hash);
+        if (slot != -1) {
+            CacheEntry *e = &shard->entries[slot];
+            copy_size = e->value_size;
+            if (copy_size > CACHE_VALUE_SIZE)
+                copy_size = CACHE_VALUE_SIZE;
+            memcpy(copy, e->value, copy_size);
+            expires_at = e->expires_at;
+            // Harmless if the entry moved meanwhile: CLOCK is approximate
+            __atomic_store_n(&e->referenced, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&shard->seq, __ATOMIC_RELAXED) != seq);
+
+    if (slot == -1) {
+        // Key not found
+        LOG_KEY("Cache miss for key '%s'.", key);
+        return -1;
+    }
+
+    if (expires_at <= cache_clock()) {
+        // Expired; cache_expire() or an eviction will reclaim the slot
+        LOG_KEY("Cache entry for key '%s' expired.", key);
+        return -1;
+    }
+
+    if (value != NULL) {
+        memcpy(value, copy, (*value_size < copy_size) ? *value_size : copy_size);
+        *value_size = copy_size;
+    } else if (value_size != NULL) {
+        *value_size = copy_size;
+    }
+    LOG_KEY("Cache hit for key '%s'.", key);
+    return 0;
+}
+
+size_t cache_expire(size_t max_slots) {
+    static size_t next_shard = 0; // Only advisory, races are harmless
+    size_t removed = 0;
+    size_t budget, s;
+    time_t current_time = cache_clock();
+
+    if (global_cache.shards == NULL)
+        return 0;
+
+    // Spread the budget over all shards, starting with a different one
+    // each time so that small budgets still reach every shard
+    budget = max_slots / CACHE_SHARDS;
+    if (budget == 0)
+        budget = 1;
+    for (s = 0; s < CACHE_SHARDS && max_slots > 0; ++s) {
+        CacheShard *shard = &global_cache.shards[(next_shard + s) & (CACHE_SHARDS - 1)];
+        size_t n = budget;
+        if (n > max_slots)
+            n = max_slots;
+        if (n > shard->mask + 1)
+            n = shard->mask + 1;
+        max_slots -= n;
+
+        lock_shard(shard);
+        write_begin(shard);
+        while (n-- > 0) {
+            size_t i = shard->expire_hand;
+            CacheEntry *e = &shard->entries[i];
+            if (e->used && e->expires_at <= current_time) {
+                LOG_KEY("Cache entry for key '%s' expired.", &e->key);
+                // Another entry may be shifted into this slot: look at it again
+                remove_slot(shard, i);
+                removed++;
             } else {
-                // Expired, free memory and invalidate entry
-                fprintf(stdout, "Cache entry for key '%s' expired.\n", key);
-                free(global_cache.entries[i].key);
-                free(global_cache.entries[i].value);
-                global_cache.entries[i].key = NULL;
-                global_cache.entries[i].value = NULL;
-                global_cache.entries[i].value_size = 0;
-                global_cache.entries[i].expires_at = 0;
-                global_cache.count--;
-                return NULL;
+                shard->expire_hand = (i + 1) & shard->mask;
             }
         }
+        write_end(shard);
+        unlock_shard(shard);
+    }
+    next_shard = (next_shard + 1) & (CACHE_SHARDS - 1);
+    return removed;
+}
+
+size_t cache_export(CacheEntry **entries) {
+    size_t count = 0, max = 0, s, i;
+    time_t current_time = cache_clock();
+
+    *entries = NULL;
+    if (global_cache.shards == NULL)
+        return 0;
+    for (s = 0; s < CACHE_SHARDS; ++s)
+        max += global_cache.shards[s].mask + 1;
+    *entries = (CacheEntry *)malloc(max * sizeof(CacheEntry));
+    if (*entries == NULL)
+        return 0;
+    for (s = 0; s < CACHE_SHARDS; ++s) {
+        CacheShard *shard = &global_cache.shards[s];
+        lock_shard(shard);
+        for (i = 0; i <= shard->mask; ++i)
+            if (shard->entries[i].used && shard->entries[i].expires_at > current_time)
+                (*entries)[count++] = shard->entries[i];
+        unlock_shard(shard);
+    }
+    if (count == 0) {
+        free(*entries);
+        *entries = NULL;
     }
+    return count;
+}
+
+size_t cache_import(const CacheEntry *entries, size_t count) {
+    size_t kept = 0, i;
+    time_t current_time = cache_clock();
 
-    // Key not found
-    fprintf(stdout, "Cache miss for key '%s'.\n", key);
-    *value_size = 0;
-    return NULL;
+    if (global_cache.shards == NULL)
+        return 0;
+    for (i = 0; i < count; ++i)
+        kept += (size_t)restore_entry(&entries[i], current_time);
+    return kept;
+}
+
+size_t cache_count(void) {
+    size_t count = 0;
+    size_t i;
+    if (global_cache.shards == NULL)
+        return 0;
+    for (i = 0; i < CACHE_SHARDS; ++i)
+        count += __atomic_load_n(&global_cache.shards[i].count, __ATOMIC_RELAXED);
+    return count;
+}
+
+size_t cache_evictions(void) {
+    size_t evictions = 0;
+    size_t i;
+    if (global_cache.shards == NULL)
+        return 0;
+    for (i = 0; i < CACHE_SHARDS; ++i)
+        evictions += __atomic_load_n(&global_cache.shards[i].evictions, __ATOMIC_RELAXED);
+    return evictions;
 }
 
 void cache_destroy() {
-    if (global_cache.entries != NULL) {
+    if (global_cache.shards != NULL) {
         size_t i;
-        for (i = 0; i < global_cache.capacity; ++i) {
-            if (global_cache.entries[i].key != NULL) {
-                free(global_cache.entries[i].key);
-                free(global_cache.entries[i].value);
-            }
+        for (i = 0; i < CACHE_SHARDS; ++i) {
+#ifndef __WIN32__
+            if (file_map == NULL)
+#endif
+                free(global_cache.shards[i].entries);
+#ifdef __WIN32__
+            DeleteCriticalSection(&global_cache.shards[i].lock);
+#else
+            pthread_mutex_destroy(&global_cache.shards[i].lock);
+#endif
         }
-        free(global_cache.entries);
-        global_cache.entries = NULL;
+#ifndef __WIN32__
+        if (file_map != NULL)
+            close_file();
+#endif
+        free(global_cache.shards);
+        global_cache.shards = NULL;
         global_cache.capacity = 0;
         global_cache.default_ttl = 0;
-        global_cache.count = 0;
-        fprintf(stdout, "Cache destroyed.\n");
+        log_message(LOG_LEVEL_INFO, "Cache destroyed.");
     }
-}
\ No newline at end of file
+}
@@ -2,46 +2,134 @@
 #define CACHE_H
 
 #include <stddef.h> // For size_t
+#include <stdint.h> // For uint32_t
 #include <time.h>   // For time_t
+#ifdef __WIN32__
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "addr.h"   // For struct ClientAddr, the key type
 
-// Structure for a cache entry
+// Values are stored inline in the table, no allocation per entry
+#define CACHE_VALUE_SIZE 16 // Largest value in bytes
+
+// Number of independent shards (a power of two)
+#ifndef CACHE_SHARDS
+#define CACHE_SHARDS 16
+#endif
+
+// Structure for a cache entry (one slot of the hash table, 48 bytes)
 typedef struct {
-    char *key;
-    void *value;
-    size_t value_size;
+    uint32_t hash;              // Hash of the key, used to skip comparisons
+    unsigned char used;         // Non-zero if the slot holds an entry
+    unsigned char referenced;   // CLOCK bit, set on every hit
+    unsigned char value_size;
+    struct ClientAddr key;      // Binary client address
+    unsigned char value[CACHE_VALUE_SIZE];
     time_t expires_at;
 } CacheEntry;
 
-// Structure for the cache module
+// One shard: an open-addressing hash table (linear probing) at most half
+// full, with CLOCK eviction once `capacity` entries are live
+// Writers serialize on `lock`; readers never take it: they copy what they
+// need and retry if `seq` shows that a writer was active meanwhile (seqlock)
 typedef struct {
-    CacheEntry *entries; // Array of cache entries
+    unsigned int seq;    // Odd while a writer is modifying the table
+#ifdef __WIN32__
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+    CacheEntry *entries; // Hash table slots
+    size_t mask;         // Number of slots minus one (a power of two)
     size_t capacity;     // Maximum number of entries
-    int default_ttl;     // Default time-to-live in seconds
     size_t count;        // Current number of entries
+    size_t clock_hand;   // Next slot examined for eviction
+    size_t expire_hand;  // Next slot examined by cache_expire()
+    size_t evictions;    // Live entries evicted to make room for others
+    unsigned char padding[64]; // Keeps shards on separate cache lines
+} CacheShard;
+
+// Structure for the cache module
+typedef struct {
+    CacheShard *shards;  // CACHE_SHARDS shards, selected by key hash
+    size_t capacity;     // Maximum number of entries (all shards)
+    int default_ttl;     // Default time-to-live in seconds
+    int verbose;         // Log every hit, miss, insertion and removal
 } Cache;
 
 // Global cache instance (for simplicity in this example)
 extern Cache global_cache;
 
 // Initialize the cache
-// capacity: maximum number of entries
+// capacity: maximum number of entries, spread over the shards
 // default_ttl: default time-to-live for entries in seconds
+// cache_init() and cache_destroy() must not race with other cache calls;
+// everything else is thread-safe
 int cache_init(size_t capacity, int default_ttl);
 
-// Add an entry to the cache
-// key: the cache key (string)
+// Same as cache_init(), with the table kept in a memory-mapped file at path
+// (created if needed) so that granted clients survive a restart
+// A snapshot saved by cache_destroy() with the same capacity is used in
+// place, without reading it; one with another capacity, or left by a crash
+// (its checksum no longer matches), has its unexpired entries moved into a
+// new file that then replaces it. Changes reach the file as the kernel
+// writes back the mapping.
+// Returns -1 if the file can't be used, or holds something else
+int cache_init_file(size_t capacity, int default_ttl, const char *path);
+
+// Log (or not) every hit, miss, insertion and removal; off by default
+void cache_set_verbose(int verbose);
+
+// Take the current time (in seconds) from clock instead of time(), so that
+// a simulation can replay hours of traffic in seconds; NULL restores time()
+// Like cache_init(), must not race with other cache calls
+void cache_set_clock(time_t (*clock)(void));
+
+// Add an entry to the cache, or refresh it if the key is already present
+// key: the client address
 // value: pointer to the data to cache
-// value_size: size of the data
+// value_size: size of the data, at most CACHE_VALUE_SIZE
+// When the shard is full, an expired or least recently used entry is evicted
+// (approximated with the CLOCK algorithm)
 // Returns 0 on success, -1 on failure
-int cache_add(const char *key, void *value, size_t value_size);
+int cache_add(const struct ClientAddr *key, void *value, size_t value_size);
 
 // Get an entry from the cache
-// key: the cache key (string)
-// value_size: pointer to a size_t to store the size of the retrieved value
-// Returns a pointer to the cached value, or NULL if not found or expired
-void *cache_get(const char *key, size_t *value_size);
+// Lookups never wait for a lock, and the value is copied out so it stays
+// valid whatever other threads do to the cache
+// key: the client address
+// value: buffer receiving a copy of the cached data, or NULL
+// value_size: in: size of the value buffer, out: size of the cached value
+// (may be NULL if value is NULL); the copy is truncated to the buffer size
+// Returns 0 if the key was found, -1 if not found or expired
+int cache_get(const struct ClientAddr *key, void *value, size_t *value_size);
+
+// Remove expired entries, examining at most max_slots slots of the table
+// Meant to be called periodically so that expired clients don't have to wait
+// for an eviction to be dropped; each call resumes where the previous one
+// stopped
+// Returns the number of entries removed
+size_t cache_expire(size_t max_slots);
+
+// Copies the unexpired entries, for a process taking over from this one
+// Returns how many were copied into *entries (to be freed with free()), or
+// 0 with *entries NULL if there are none or memory ran out
+size_t cache_export(CacheEntry **entries);
+
+// Adds entries copied by cache_export(), possibly in another process,
+// keeping their expiry times; those that don't fit are dropped
+// Returns how many were kept
+size_t cache_import(const CacheEntry *entries, size_t count);
+
+// Number of live entries (approximate while other threads modify the cache)
+size_t cache_count(void);
+
+// Number of unexpired entries evicted since cache_init(), all shards
+size_t cache_evictions(void);
 
-// Destroy and clean up the cache
+// Destroy and clean up the cache; a cache file is saved with its checksum
 void cache_destroy();
 
-#endif // CACHE_H
\ No newline at end of file
+#endif // CACHE_H
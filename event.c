@@ -0,0 +1,261 @@
+#include "event.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __WIN32__
+    #define _WIN32_WINNT 0x0501
+    #include <winsock2.h>
+#else
+    #include <errno.h>
+    #include <unistd.h>
+    #ifdef ENABLE_EPOLL
+        #include <sys/epoll.h>
+    #else
+        #include <sys/select.h>
+    #endif
+#endif
+
+#ifdef ENABLE_EPOLL
+
+struct EventLoop {
+    int epfd;
+    struct epoll_event *buffer;
+    size_t buffer_size;
+};
+
+static unsigned int to_epoll(unsigned int events)
+{
+    unsigned int ev = EPOLLET | EPOLLRDHUP;
+    if(events & EV_READ)
+        ev |= EPOLLIN;
+    if(events & EV_WRITE)
+        ev |= EPOLLOUT;
+    return ev;
+}
+
+const char *event_loop_backend(void)
+{
+    return "epoll";
+}
+
+struct EventLoop *event_loop_new(size_t max_fds)
+{
+    struct EventLoop *loop = malloc(sizeof(struct EventLoop));
+    (void)max_fds; /* epoll has no fixed limit */
+    if(loop == NULL)
+        return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epfd == -1)
+    {
+        free(loop);
+        return NULL;
+    }
+    loop->buffer = NULL;
+    loop->buffer_size = 0;
+    return loop;
+}
+
+void event_loop_free(struct EventLoop *loop)
+{
+    if(loop == NULL)
+        return;
+    close(loop->epfd);
+    free(loop->buffer);
+    free(loop);
+}
+
+int event_add(struct EventLoop *loop, int fd, unsigned int events, void *data)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = to_epoll(events);
+    ev.data.ptr = data;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int event_mod(struct EventLoop *loop, int fd, unsigned int events, void *data)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = to_epoll(events);
+    ev.data.ptr = data;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int event_del(struct EventLoop *loop, int fd)
+{
+    struct epoll_event ev; /* ignored, but required before Linux 2.6.9 */
+    return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int event_wait(struct EventLoop *loop, struct Event *out, size_t max_events,
+               int timeout_ms)
+{
+    int n, i;
+
+    if(loop->buffer_size < max_events)
+    {
+        struct epoll_event *buffer = realloc(
+                loop->buffer, max_events * sizeof(struct epoll_event));
+        if(buffer == NULL)
+            return -1;
+        loop->buffer = buffer;
+        loop->buffer_size = max_events;
+    }
+
+    n = epoll_wait(loop->epfd, loop->buffer, (int)max_events, timeout_ms);
+    if(n == -1)
+        return (errno == EINTR)?0:-1;
+
+    for(i = 0; i < n; ++i)
+    {
+        unsigned int ev = loop->buffer[i].events;
+        out[i].data = loop->buffer[i].data.ptr;
+        out[i].events = 0;
+        if(ev & EPOLLIN)
+            out[i].events |= EV_READ;
+        if(ev & EPOLLOUT)
+            out[i].events |= EV_WRITE;
+        if(ev & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            out[i].events |= EV_ERROR | EV_READ;
+    }
+    return n;
+}
+
+#else /* select() fallback */
+
+struct Watch {
+    int fd;
+    unsigned int events;
+    void *data;
+};
+
+struct EventLoop {
+    struct Watch *watches;
+    size_t count;
+    size_t capacity;
+};
+
+const char *event_loop_backend(void)
+{
+    return "select";
+}
+
+struct EventLoop *event_loop_new(size_t max_fds)
+{
+    struct EventLoop *loop;
+    if(max_fds > FD_SETSIZE)
+        max_fds = FD_SETSIZE;
+    loop = malloc(sizeof(struct EventLoop));
+    if(loop == NULL)
+        return NULL;
+    loop->watches = calloc(max_fds, sizeof(struct Watch));
+    if(loop->watches == NULL)
+    {
+        free(loop);
+        return NULL;
+    }
+    loop->count = 0;
+    loop->capacity = max_fds;
+    return loop;
+}
+
+void event_loop_free(struct EventLoop *loop)
+{
+    if(loop == NULL)
+        return;
+    free(loop->watches);
+    free(loop);
+}
+
+static struct Watch *find_watch(struct EventLoop *loop, int fd)
+{
+    size_t i;
+    for(i = 0; i < loop->count; ++i)
+        if(loop->watches[i].fd == fd)
+            return &loop->watches[i];
+    return NULL;
+}
+
+int event_add(struct EventLoop *loop, int fd, unsigned int events, void *data)
+{
+    struct Watch *w;
+    if(loop->count == loop->capacity || find_watch(loop, fd) != NULL)
+        return -1;
+#ifndef __WIN32__
+    /* On Windows fd_set is a list of handles, not a bitmap */
+    if(fd >= FD_SETSIZE)
+        return -1;
+#endif
+    w = &loop->watches[loop->count++];
+    w->fd = fd;
+    w->events = events;
+    w->data = data;
+    return 0;
+}
+
+int event_mod(struct EventLoop *loop, int fd, unsigned int events, void *data)
+{
+    struct Watch *w = find_watch(loop, fd);
+    if(w == NULL)
+        return -1;
+    w->events = events;
+    w->data = data;
+    return 0;
+}
+
+int event_del(struct EventLoop *loop, int fd)
+{
+    struct Watch *w = find_watch(loop, fd);
+    if(w == NULL)
+        return -1;
+    *w = loop->watches[--loop->count];
+    return 0;
+}
+
+int event_wait(struct EventLoop *loop, struct Event *out, size_t max_events,
+               int timeout_ms)
+{
+    fd_set rfds, wfds;
+    struct timeval tv;
+    int greatest = -1;
+    size_t i, n = 0;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    for(i = 0; i < loop->count; ++i)
+    {
+        const struct Watch *w = &loop->watches[i];
+        if(w->events & EV_READ)
+            FD_SET((unsigned int)w->fd, &rfds);
+        if(w->events & EV_WRITE)
+            FD_SET((unsigned int)w->fd, &wfds);
+        if(w->fd > greatest)
+            greatest = w->fd;
+    }
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    if(select(greatest + 1, &rfds, &wfds, NULL,
+              (timeout_ms < 0)?NULL:&tv) <= 0)
+        return 0;
+
+    for(i = 0; i < loop->count && n < max_events; ++i)
+    {
+        const struct Watch *w = &loop->watches[i];
+        unsigned int ev = 0;
+        if(FD_ISSET(w->fd, &rfds))
+            ev |= EV_READ;
+        if(FD_ISSET(w->fd, &wfds))
+            ev |= EV_WRITE;
+        if(ev != 0)
+        {
+            out[n].events = ev;
+            out[n].data = w->data;
+            ++n;
+        }
+    }
+    return (int)n;
+}
+
+#endif
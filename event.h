@@ -0,0 +1,66 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+/* Small readiness-based event loop.
+ *
+ * On Linux this is backed by an edge-triggered epoll instance; elsewhere
+ * (i.e. the Win32 build) it falls back to select(). Callers must treat every
+ * notification as edge-triggered: when a socket is reported readable or
+ * writable, keep reading/writing until the operation would block. The
+ * select() backend reports readiness level-triggered, which is compatible
+ * with that contract. */
+
+#include <stddef.h>
+
+#ifndef __WIN32__
+    #ifndef ENABLE_EPOLL
+        #ifndef DISABLE_EPOLL
+            #ifdef __linux__
+                #define ENABLE_EPOLL
+            #endif
+        #endif
+    #endif
+#else
+    #ifdef ENABLE_EPOLL
+        #warning ENABLE_EPOLL is not available on Windows
+        #undef ENABLE_EPOLL
+    #endif
+#endif
+
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+#define EV_ERROR 0x4 /* error or hangup; always reported, never requested */
+
+struct Event {
+    unsigned int events; /* EV_* flags that are ready */
+    void *data;          /* pointer given to event_add() */
+};
+
+struct EventLoop;
+
+/* Creates a loop able to watch up to max_fds descriptors (only enforced by
+ * the select() backend, which is also bounded by FD_SETSIZE). Returns NULL on
+ * failure. */
+struct EventLoop *event_loop_new(size_t max_fds);
+void event_loop_free(struct EventLoop *loop);
+
+/* Name of the backend in use, for diagnostics */
+const char *event_loop_backend(void);
+
+/* Starts watching fd for the given EV_READ/EV_WRITE events. Returns 0 on
+ * success, -1 on failure (including when the loop is full). */
+int event_add(struct EventLoop *loop, int fd, unsigned int events, void *data);
+
+/* Changes the set of events watched for fd */
+int event_mod(struct EventLoop *loop, int fd, unsigned int events, void *data);
+
+/* Stops watching fd. Must be called before the descriptor is closed. */
+int event_del(struct EventLoop *loop, int fd);
+
+/* Waits up to timeout_ms milliseconds (-1: forever) for events and stores at
+ * most max_events of them in out. Returns the number of events, 0 on timeout
+ * or interruption by a signal, -1 on error. */
+int event_wait(struct EventLoop *loop, struct Event *out, size_t max_events,
+               int timeout_ms);
+
+#endif /* EVENT_H */
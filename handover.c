@@ -0,0 +1,520 @@
+#ifndef __WIN32__
+    #define _GNU_SOURCE /* struct ucred */
+#endif
+
+#include "handover.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef __WIN32__
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <pthread.h>
+    #include <stdint.h>
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+#endif
+
+#include "log.h"
+
+#ifndef __WIN32__
+
+#define HANDOVER_MAGIC 0x4f485248 /* "HRHO" in little-endian memory */
+#define HANDOVER_VERSION 1
+
+/* Most listening sockets passed at once (SCM_MAX_FD) */
+#define HANDOVER_MAX_SOCKETS 253
+
+/* ms the new server has to start accepting before the old one gives up on
+ * it and goes on */
+#define HANDOVER_WAIT 60000
+
+/* First descriptor passed by systemd */
+#define LISTEN_FDS_START 3
+
+/* Sent with the listening sockets, then followed by the cache entries */
+struct HandoverHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sockets;
+    uint32_t entry_size;    /* sizeof(CacheEntry) in the sending build */
+    uint64_t entries;
+};
+
+static int set_address(struct sockaddr_un *addr, const char *path)
+{
+    if(strlen(path) >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "Error: upgrade socket path %s is too long\n", path);
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Sends or receives exactly size bytes. Returns 0, or -1. */
+static int send_all(int sock, const void *data, size_t size)
+{
+    size_t done = 0;
+    while(done < size)
+    {
+        ssize_t n = send(sock, (const char*)data + done, size - done,
+                         MSG_NOSIGNAL);
+        if(n <= 0)
+        {
+            if(n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static int recv_all(int sock, void *data, size_t size)
+{
+    size_t done = 0;
+    while(done < size)
+    {
+        ssize_t n = recv(sock, (char*)data + done, size - done, 0);
+        if(n <= 0)
+        {
+            if(n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+int handover_inherit(int *socks, int max)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    long count, i;
+
+    if(pid == NULL || fds == NULL || strtol(pid, NULL, 10) != (long)getpid())
+        return 0;
+    count = strtol(fds, NULL, 10);
+    /* Not for the processes this one starts */
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    if(count <= 0)
+        return 0;
+    if(count > max)
+    {
+        fprintf(stderr, "Error: %ld sockets were passed, at most %d can be "
+                "used\n", count, max);
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i)
+    {
+        int fd = LISTEN_FDS_START + (int)i;
+        int listening = 0;
+        socklen_t size = sizeof(listening);
+        if(getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) == -1
+         || !listening)
+        {
+            fprintf(stderr, "Error: passed descriptor %d is not a listening "
+                    "socket\n", fd);
+            return -1;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        socks[i] = fd;
+    }
+    log_message(LOG_LEVEL_INFO, "Using %ld listening sockets passed by "
+                "systemd", count);
+    return (int)count;
+}
+
+/* Connection to the previous server, until handover_done() */
+static int previous = -1;
+
+int handover_receive(const char *path, int *socks, int max,
+                     CacheEntry **entries, size_t *entry_count)
+{
+    struct sockaddr_un addr;
+    struct HandoverHeader header;
+    struct timeval timeout;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_SOCKETS)];
+    } control;
+    int sock, count = 0, i;
+    ssize_t n;
+
+    *entries = NULL;
+    *entry_count = 0;
+    if(set_address(&addr, path) != 0)
+        return -1;
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1)
+    {
+        perror("Error: can't create the upgrade socket");
+        return -1;
+    }
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(sock);
+        /* No server to take over from */
+        if(errno == ENOENT || errno == ECONNREFUSED)
+            return 0;
+        fprintf(stderr, "Error: can't connect to %s: %s\n",
+                path, strerror(errno));
+        return -1;
+    }
+    /* Don't wait forever for a server that is stuck */
+    timeout.tv_sec = 10;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    do
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    while(n == -1 && errno == EINTR);
+    for(cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL;
+        cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int received = (int)((cmsg->cmsg_len - CMSG_LEN(0))
+                                 / sizeof(int));
+            for(i = 0; i < received; ++i)
+            {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if(count < max)
+                    socks[count++] = fd;
+                else
+                    close(fd);
+            }
+        }
+    }
+    /* The rest of the header, if it was split */
+    if(n <= 0 || (msg.msg_flags & MSG_CTRUNC)
+     || ((size_t)n < sizeof(header)
+         && recv_all(sock, (char*)&header + n, sizeof(header) - (size_t)n)
+            != 0)
+     || header.magic != HANDOVER_MAGIC || header.version != HANDOVER_VERSION
+     || header.sockets != (uint32_t)count || count == 0
+     || header.entry_size == 0
+     || header.entries > SIZE_MAX / 2 / header.entry_size)
+    {
+        fprintf(stderr, "Error: the server at %s didn't hand its sockets "
+                "over\n", path);
+        goto fail;
+    }
+
+    /* Entries of another build are read, but not used */
+    if(header.entries > 0)
+    {
+        size_t size = (size_t)header.entries * header.entry_size;
+        char *data = malloc(size);
+        if(data == NULL || recv_all(sock, data, size) != 0)
+        {
+            fprintf(stderr, "Error: can't receive the cache from %s\n", path);
+            free(data);
+            goto fail;
+        }
+        if(header.entry_size == sizeof(CacheEntry))
+        {
+            *entries = (CacheEntry*)data;
+            *entry_count = (size_t)header.entries;
+        }
+        else
+        {
+            log_message(LOG_LEVEL_WARNING, "The cache of the previous server "
+                        "can't be used by this one");
+            free(data);
+        }
+    }
+    previous = sock;
+    log_message(LOG_LEVEL_INFO, "Took over %d listening sockets and %lu "
+                "clients from the server at %s", count,
+                (unsigned long)*entry_count, path);
+    return count;
+
+fail:
+    for(i = 0; i < count; ++i)
+        close(socks[i]);
+    close(sock);
+    return -1;
+}
+
+void handover_done(void)
+{
+    if(previous == -1)
+        return;
+    if(send_all(previous, "1", 1) != 0)
+        log_message(LOG_LEVEL_WARNING, "The previous server is gone");
+    close(previous);
+    previous = -1;
+}
+
+static int socket_fd = -1;
+static char *socket_path = NULL;
+static struct stat socket_stat;     /* to recognize it when removing it */
+static pthread_t socket_thread;
+static int socket_started = 0;
+static int socket_running = 0;
+static int completed = 0;
+static const int *handed_socks;
+static int handed_count;
+
+int handover_open(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if(set_address(&addr, path) != 0)
+        return -1;
+    socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(socket_fd == -1)
+    {
+        perror("Error: can't create the upgrade socket");
+        return -1;
+    }
+    /* That of the previous server, or left over; anything else is not ours
+     * to remove */
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if(bind(socket_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+     || chmod(path, 0600) == -1 || lstat(path, &socket_stat) == -1
+     || listen(socket_fd, 4) == -1)
+    {
+        fprintf(stderr, "Error: can't listen on %s: %s\n",
+                path, strerror(errno));
+        close(socket_fd);
+        socket_fd = -1;
+        return -1;
+    }
+    socket_path = malloc(strlen(path) + 1);
+    if(socket_path != NULL)
+        strcpy(socket_path, path);
+    return 0;
+}
+
+/* Whether the peer runs as root or as this server's user */
+static int peer_allowed(int sock)
+{
+    struct ucred cred;
+    socklen_t size = sizeof(cred);
+    if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &size) == -1)
+        return 0;
+    return cred.uid == 0 || cred.uid == geteuid();
+}
+
+/* Sends the listening sockets and the cache, then waits for the new server
+ * to accept connections. Returns 1 once it does. */
+static int hand_over(int sock)
+{
+    struct HandoverHeader header;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_SOCKETS)];
+    } control;
+    struct pollfd pfd;
+    CacheEntry *entries;
+    size_t count = cache_export(&entries);
+    char ack;
+    ssize_t n;
+    int ret = 0;
+
+    header.magic = HANDOVER_MAGIC;
+    header.version = HANDOVER_VERSION;
+    header.sockets = (uint32_t)handed_count;
+    header.entry_size = sizeof(CacheEntry);
+    header.entries = count;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)handed_count);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)handed_count);
+    memcpy(CMSG_DATA(cmsg), handed_socks, sizeof(int) * (size_t)handed_count);
+
+    do
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    while(n == -1 && errno == EINTR);
+    if(n == (ssize_t)sizeof(header)
+     && send_all(sock, entries, count * sizeof(CacheEntry)) == 0)
+    {
+        log_message(LOG_LEVEL_INFO, "Handed %d listening sockets and %lu "
+                    "clients over to a new server", handed_count,
+                    (unsigned long)count);
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, HANDOVER_WAIT) == 1 && recv(sock, &ack, 1, 0) == 1)
+            ret = 1;
+        else
+            log_message(LOG_LEVEL_WARNING, "The new server didn't start, "
+                        "going on");
+    }
+    else
+        log_message(LOG_LEVEL_WARNING, "Can't hand over to the new server: "
+                    "%s", strerror(errno));
+    free(entries);
+    return ret;
+}
+
+static void *socket_main(void *arg)
+{
+    (void)arg;
+    while(__atomic_load_n(&socket_running, __ATOMIC_RELAXED))
+    {
+        struct pollfd pfd;
+        int sock;
+
+        /* Wakes up every second to notice handover_close() */
+        pfd.fd = socket_fd;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, 1000) != 1)
+            continue;
+        sock = accept4(socket_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(sock == -1)
+            continue;
+        if(!peer_allowed(sock))
+            log_message(LOG_LEVEL_WARNING, "Refused an upgrade from another "
+                        "user");
+        else if(hand_over(sock))
+        {
+            __atomic_store_n(&completed, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&socket_running, 0, __ATOMIC_RELAXED);
+        }
+        close(sock);
+    }
+    return NULL;
+}
+
+int handover_start(const int *socks, int count)
+{
+    if(socket_fd == -1)
+        return 0;
+    if(count > HANDOVER_MAX_SOCKETS)
+    {
+        fprintf(stderr, "Error: too many listening sockets to hand over\n");
+        return -1;
+    }
+    handed_socks = socks;
+    handed_count = count;
+    socket_running = 1;
+    if(pthread_create(&socket_thread, NULL, socket_main, NULL) != 0)
+    {
+        fprintf(stderr, "Error: can't start the upgrade socket thread\n");
+        socket_running = 0;
+        return -1;
+    }
+    socket_started = 1;
+    return 0;
+}
+
+void handover_close(void)
+{
+    struct stat st;
+
+    if(socket_started)
+    {
+        __atomic_store_n(&socket_running, 0, __ATOMIC_RELAXED);
+        pthread_join(socket_thread, NULL);
+        socket_started = 0;
+    }
+    if(socket_fd != -1)
+    {
+        close(socket_fd);
+        socket_fd = -1;
+    }
+    if(socket_path != NULL)
+    {
+        /* The new server's, if it replaced ours */
+        if(lstat(socket_path, &st) == 0 && st.st_ino == socket_stat.st_ino
+         && st.st_dev == socket_stat.st_dev)
+            unlink(socket_path);
+        free(socket_path);
+        socket_path = NULL;
+    }
+}
+
+int handover_completed(void)
+{
+    return __atomic_load_n(&completed, __ATOMIC_RELAXED);
+}
+
+#else
+
+int handover_inherit(int *socks, int max)
+{
+    (void)socks;
+    (void)max;
+    return 0;
+}
+
+int handover_receive(const char *path, int *socks, int max,
+                     CacheEntry **entries, size_t *entry_count)
+{
+    (void)path;
+    (void)socks;
+    (void)max;
+    *entries = NULL;
+    *entry_count = 0;
+    fprintf(stderr, "Error: the upgrade socket is not available on "
+            "Windows\n");
+    return -1;
+}
+
+void handover_done(void)
+{
+}
+
+int handover_open(const char *path)
+{
+    (void)path;
+    fprintf(stderr, "Error: the upgrade socket is not available on "
+            "Windows\n");
+    return -1;
+}
+
+int handover_start(const int *socks, int count)
+{
+    (void)socks;
+    (void)count;
+    return 0;
+}
+
+void handover_close(void)
+{
+}
+
+int handover_completed(void)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+/* Listening sockets that outlive the process.
+ *
+ * A server started with an upgrade socket (a Unix-domain socket at a path)
+ * first asks the server already listening there, if any, for its listening
+ * sockets (passed with SCM_RIGHTS) and the clients in its cache. Once it
+ * accepts connections on them, it says so and the old server stops
+ * accepting, finishes the connections it has and exits: no connection is
+ * refused during a binary upgrade. The new server then answers on the
+ * upgrade socket in turn.
+ *
+ * Listening sockets can also be inherited from systemd (socket activation,
+ * LISTEN_FDS). */
+
+#include <stddef.h>
+
+#include "cache.h"
+
+/* Takes the sockets passed by systemd, at most max of them. Returns their
+ * number, 0 if none were, or -1 after printing an error. */
+int handover_inherit(int *socks, int max);
+
+/* Asks the server listening at path for its listening sockets (at most max)
+ * and cache entries (*entries, to be freed, NULL if there are none). Returns
+ * the number of sockets received, 0 if no server is listening there, or -1
+ * after printing an error. */
+int handover_receive(const char *path, int *socks, int max,
+                     CacheEntry **entries, size_t *entry_count);
+
+/* Tells the previous server, if any, that this one accepts connections */
+void handover_done(void);
+
+/* Creates the upgrade socket at path, before dropping privileges; only
+ * connections from root or the server's own user are answered. Serving
+ * starts with handover_start(), from a thread of its own, until a new
+ * server took over. Returns 0, or -1 after printing an error. */
+int handover_open(const char *path);
+int handover_start(const int *socks, int count);
+/* Stops serving and removes the socket, unless another server replaced it */
+void handover_close(void);
+
+/* Whether a new server took over: this one should stop accepting and exit
+ * once its connections are done */
+int handover_completed(void);
+
+#endif /* HANDOVER_H */
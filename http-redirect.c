@@ -1,3 +1,7 @@
+#ifndef __WIN32__
+    #define _GNU_SOURCE /* accept4(), setresuid() */
+#endif
+
 /* Optionnal features */
 #ifndef __WIN32__
     #ifndef ENABLE_FORK
@@ -10,6 +14,11 @@
             #define ENABLE_CHGUSER
         #endif
     #endif
+    #ifndef ENABLE_WORKERS
+        #ifndef DISABLE_WORKERS
+            #define ENABLE_WORKERS
+        #endif
+    #endif
 #else
     #ifdef ENABLE_FORK
         #warning ENABLE_FORK is not available on Windows
@@ -19,15 +28,112 @@
         #warning ENABLE_CHGUSER is not available on Windows
         #undef ENABLE_CHGUSER
     #endif
+    #ifdef ENABLE_WORKERS
+        #warning ENABLE_WORKERS is not available on Windows
+        #undef ENABLE_WORKERS
+    #endif
 #endif
 
 /* Configuration */
 #ifndef MAX_PENDING_REQUESTS
-    #define MAX_PENDING_REQUESTS 64
+    #ifdef __WIN32__
+        #define MAX_PENDING_REQUESTS 64 /* select() is bounded by FD_SETSIZE */
+    #else
+        /* Memory for each is reserved up front, per worker */
+        #define MAX_PENDING_REQUESTS 4096
+    #endif
+#endif
+
+#ifndef MAX_WORKERS
+    #define MAX_WORKERS 256
+#endif
+
+#ifndef MAX_LISTEN_SOCKETS
+    #define MAX_LISTEN_SOCKETS 1024 /* over all listeners and workers */
+#endif
+
+#ifndef DEFAULT_CACHE_SIZE
+    #define DEFAULT_CACHE_SIZE 1024
+#endif
+
+#ifndef CACHE_TTL
+    #define CACHE_TTL 30
+#endif
+
+#ifndef GRANT_DELAY
+    #define GRANT_DELAY 2000 /* ms */
+#endif
+
+#ifndef GRANT_BUCKETS
+    #define GRANT_BUCKETS 256 /* per worker, of clients with a grant pending */
+#endif
+#if GRANT_BUCKETS & (GRANT_BUCKETS - 1)
+    #error GRANT_BUCKETS must be a power of two
+#endif
+
+#ifndef CACHE_EXPIRE_BUDGET
+    #define CACHE_EXPIRE_BUDGET 16384 /* cache slots swept per second */
+#endif
+
+#ifndef EVENT_BATCH_SIZE
+    #define EVENT_BATCH_SIZE 256
+#endif
+
+#ifndef ACCEPT_BATCH_SIZE
+    #define ACCEPT_BATCH_SIZE 64 /* connections accepted per wakeup */
+#endif
+
+#ifndef LISTEN_BACKLOG
+    #define LISTEN_BACKLOG 1024 /* capped by the system (somaxconn) */
+#endif
+
+#ifndef RATE_LIMIT_SLOTS
+    #define RATE_LIMIT_SLOTS 65536 /* clients tracked by --rate-limit */
+#endif
+
+#ifndef KEEPALIVE_TIMEOUT
+    #define KEEPALIVE_TIMEOUT 5000 /* ms an idle persistent connection is kept */
+#endif
+
+#ifndef HEADER_TIMEOUT
+    #define HEADER_TIMEOUT 10000 /* ms to send a request head */
+#endif
+
+#ifndef SIGNED_TOKEN_TTL
+    #define SIGNED_TOKEN_TTL 600 /* s a signed token is accepted back */
+#endif
+
+#ifndef MAX_KEEPALIVE_REQUESTS
+    #define MAX_KEEPALIVE_REQUESTS 100 /* per connection */
+#endif
+
+#ifndef PIPELINE_DEPTH
+    #define PIPELINE_DEPTH 8 /* pipelined responses sent in one system call */
 #endif
 
 #ifndef RECV_BUFFER_SIZE
-    #define RECV_BUFFER_SIZE 512
+    #define RECV_BUFFER_SIZE 1024 /* per connection; longest accepted head */
+#endif
+#if RECV_BUFFER_SIZE > 65535
+    #error RECV_BUFFER_SIZE must fit in the 16-bit spans of request.h
+#endif
+
+#ifndef RENDER_BUFFER_SIZE
+    /* per connection answered with a template echoing the request */
+    #define RENDER_BUFFER_SIZE (4 * RECV_BUFFER_SIZE)
+#endif
+
+#ifndef RENDER_BUFFERS
+    /* per worker: responses echoing the request being sent at once */
+    #define RENDER_BUFFERS 256
+#endif
+
+#ifndef URING_ENTRIES
+    #define URING_ENTRIES 1024 /* io_uring submission queue, per worker */
+#endif
+
+#ifndef URING_BUFFERS
+    #define URING_BUFFERS 1024 /* provided receive buffers, per worker */
 #endif
 
 #include <stdio.h>
@@ -35,8 +141,21 @@
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
-#include <stdlib.h> // For rand and srand
+#include "addr.h"
 #include "cache.h"
+#include "event.h"
+#include "handover.h"
+#include "listener.h"
+#include "log.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "request.h"
+#include "rules.h"
+#include "scan.h"
+#include "stats.h"
+#include "template.h"
+#include "token.h"
+#include "uring.h"
 #ifdef __WIN32__
     #define _WIN32_WINNT 0x0501 /* needed for getaddrinfo(); means WinXP */
     #include <winsock2.h>
@@ -52,20 +171,45 @@
     #include <signal.h>
     #include <netdb.h>
     #include <errno.h>
+    #include <fcntl.h>
     #include <unistd.h>
+    #include <sys/uio.h>
 
     typedef int SOCKET;
 #endif
+
+/* Scatter/gather buffer for send_segments() */
+#ifdef __WIN32__
+    typedef WSABUF Segment;
+    #define SEGMENT_BASE(seg) ((seg).buf)
+    #define SEGMENT_LEN(seg) ((seg).len)
+#else
+    typedef struct iovec Segment;
+    #define SEGMENT_BASE(seg) ((seg).iov_base)
+    #define SEGMENT_LEN(seg) ((seg).iov_len)
+#endif
+#ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0
+#endif
 #ifdef __WIN32__
-#include <windows.h&>
+#include <windows.h>
 #else
 #include <pthread.h>
-#include <unistd.h> // For sleep
 #endif
+#include "timer.h"
 
 volatile sig_atomic_t shutdown_flag = 0;
+volatile sig_atomic_t reload_flag = 0;
 
 void handle_signal(int signum) {
+#ifndef __WIN32__
+    if (signum == SIGHUP) {
+        reload_flag = 1; // Reload the configuration, keep serving
+        return;
+    }
+#else
+    (void)signum;
+#endif
     shutdown_flag = 1;
 }
 
@@ -73,47 +217,89 @@ void handle_signal(int signum) {
     #include <pwd.h>
 #endif
 
-int setup_server(int *serv_sock, const char *addr, const char *port);
-int serve(int serv_sock, const char *dest);
+/* Segments of a response: head, dynamic part (the token, or what was
+ * rendered), tail, Connection header, body. The Connection header is
+ * inserted before the empty line ending the headers. */
+#define RESPONSE_SEGMENTS 5
 
-// Thread function to add IP to cache after a delay
-#ifdef __WIN32__
-DWORD WINAPI add_to_cache(LPVOID lpParam)
-#else
-void *add_to_cache(void *arg)
-#endif
-{
-    char *ip = (char *)arg;
+/* Compiled templates, see template.h. They are never modified once built,
+ * so all workers share them. */
+struct Responses {
+    struct Template *rules;        /* by rule index; unused for RULE_SUCCESS */
+    size_t rule_count;
+    struct Template success;
+    struct Template bad_request;   /* malformed request head */
+    struct Template too_large;     /* head larger than RECV_BUFFER_SIZE */
+    struct Template too_many;      /* client over the rate limit */
+    struct Template unavailable;   /* no render buffer left */
+    bool rendered;                 /* some template echoes the request */
+};
 
-#ifdef __WIN32__
-    Sleep(3000); // Sleep for 3 seconds (milliseconds)
-#else
-    sleep(2); // Sleep for 3 seconds
-#endif
+/* What SIGHUP reloads: the rules (the destination's included), their
+ * pre-rendered responses and the token key. Workers move to a new one
+ * between two iterations of their loop, and let go of the previous one once
+ * none of their connections has a response from it queued. */
+struct Routing {
+    struct RuleTable *rules;
+    struct Responses responses;
+    struct TokenKey key;
+    bool signed_tokens;     /* key was loaded */
+    unsigned long generation;
+    int users;              /* workers using it, plus one while current */
+};
 
-    // Add the IP to the cache with a dummy value and size
-    // The cache_add function handles memory allocation for the key
-    if (cache_add(ip, (void *)"1", 1) == 0) {
-        fprintf(stderr, "Added %s to cache after delay\n", ip);
-    } else {
-        fprintf(stderr, "Failed to add %s to cache after delay\n", ip);
-    }
+/* Settings shared (read-only) by all workers */
+struct Config {
+    const char *dest;
+    const char *rules_file; /* read again on SIGHUP, like key_file */
+    const char *key_file;
+    const char *template_file; /* for redirects, instead of the built-in */
+    long cache_size;
+    long grant_delay;  /* ms before a captive-portal client is let through */
+    long keepalive_timeout; /* ms; 0 closes every connection after a response */
+    long header_timeout; /* ms to send a request head and read the response */
+    long max_requests; /* per connection */
+    long backlog;      /* listen() queue length, unless set per listener */
+    long max_connections; /* per worker */
+    long rate_limit;   /* new connections per second per client, 0 for none */
+    long rate_burst;   /* at once */
+    bool rate_drop;    /* close those over it rather than answer 429 */
+    const char *stats_path; /* serves the stats instead, if not NULL */
+    bool verbose;      /* log every request */
+    bool io_uring;     /* use io_uring when the kernel supports it */
+};
 
-#ifdef __WIN32__
-    return 0;
-#else
-    return NULL;
+/* One accept/read/respond loop, with its own listening sockets (one per
+ * address) and connections */
+struct Worker {
+    const struct Config *config;
+    int serv_socks[MAX_LISTENERS];
+    int listener_count;
+    int cpu;            /* pinned to it, if not -1 */
+    int index;
+    int ret;
+#ifdef ENABLE_WORKERS
+    pthread_t thread;
 #endif
-}
-void pack_array(void **array, size_t size)
+};
+
+int build_responses(struct Responses *r, const struct RuleTable *rules,
+                    const char *template_file);
+void free_responses(struct Responses *r);
+int load_routing(const struct Config *config, struct Routing **result);
+void publish_routing(struct Routing *routing);
+void release_routing(struct Routing *routing);
+void unload_routing(void);
+int serve(struct Worker *worker);
+
+#ifdef ENABLE_WORKERS
+void *worker_main(void *arg)
 {
-    size_t src, dest = 0;
-    for(src = 0; src < size; ++src)
-        if(array[src] != NULL)
-            array[dest++] = array[src];
-    for(; dest < size; ++dest)
-        array[dest] = NULL;
+    struct Worker *worker = arg;
+    worker->ret = serve(worker);
+    return NULL;
 }
+#endif
 
 void my_closesocket(int sock)
 {
@@ -145,7 +331,137 @@ void print_help(FILE *f)
 #ifdef ENABLE_CHGUSER
             "  -u, --user: change to user after binding the socket\n"
 #endif
-            "  -p, --port <port>: port on which to listen\n");
+            "  -b, --bind <address>: address on which to listen (default: "
+            "all, IPv4\n"
+            "      and IPv6)\n"
+            "  -p, --port <port>: port on which to listen (default: 80)\n"
+            "  --listen <[address:]port>[,<option>...]: listen there; may be "
+            "repeated,\n"
+            "      instead of --bind and --port. The address is * (default), "
+            "a name,\n"
+            "      an IPv4 address or [an IPv6 address]. Options:\n"
+            "        backlog=<n>: instead of --backlog\n"
+            "        defer-accept=<s>: wake up on the first bytes of a "
+            "connection rather\n"
+            "          than on its setup, waiting for them up to s seconds\n"
+            "        fastopen=<n>: accept TCP Fast Open connections, at most "
+            "n pending\n"
+            "        incoming-cpu: hand a connection to the worker running "
+            "on the CPU that\n"
+            "          received it, with workers pinned to a CPU each\n"
+            "  -q, --quiet: don't log every request (--log-level warning)\n"
+            "  --log-level <level>: error, warning, info (default) or "
+            "debug\n"
+            "  --access-log <file>: append the requests to file instead of "
+            "stderr\n"
+            "  --access-format <format>: text (default), compact (one "
+            "\"time ip method\n"
+            "      host path\" line per request) or binary (see log.h)\n"
+            "  -r, --rules <file>: Host/path routing rules, one per line:\n"
+            "      <host|*> </path/prefix> redirect|portal <destination> "
+            "[template]\n"
+            "      <host|*> </path/prefix> success\n"
+            "      Requests matching no rule are redirected to <destination>;\n"
+            "      captive.apple.com is a portal to apple.<destination>\n"
+            "  --template <file>: response to redirects, with slots such as "
+            "{token},\n"
+            "      {host}, {path} or {path_encoded} (see template.h); a rule "
+            "may name\n"
+            "      its own after its destination\n"
+            "  -s, --token-key <file>: sign the redirect tokens with the "
+            "first 16 bytes\n"
+            "      of file; a client coming back with the token of its "
+            "address gets\n"
+            "      200 Success, without waiting for the grant delay\n"
+            "  -c, --cache-size <n>: number of captive-portal clients "
+            "remembered\n"
+            "      (default: %d)\n"
+#ifndef __WIN32__
+            "  --cache-file <file>: keep the captive-portal clients in file, "
+            "so that\n"
+            "      they are still granted after a restart\n"
+#endif
+            "  -g, --grant-delay <ms>: delay before a captive-portal client "
+            "is let\n"
+            "      through (default: %d)\n"
+            "  -k, --keep-alive <ms>: how long an idle persistent connection "
+            "is kept;\n"
+            "      0 disables keep-alive (default: %d)\n"
+            "  -t, --header-timeout <ms>: time a client has to send a "
+            "request and read\n"
+            "      the response (default: %d)\n"
+            "  -m, --max-requests <n>: requests served on a persistent "
+            "connection\n"
+            "      (default: %d)\n"
+            "  -l, --backlog <n>: connections waiting to be accepted "
+            "(default: %d)\n"
+            "  -n, --max-connections <n>: open connections per worker, "
+            "more are refused\n"
+            "      (default: %d); the memory of each is reserved up front\n"
+            "  --rate-limit <n>: new connections per second from a client "
+            "address (an\n"
+            "      IPv6 /64); those over it are answered 429 (default: no "
+            "limit)\n"
+            "  --rate-burst <n>: connections a client may open at once "
+            "(default: the\n"
+            "      rate)\n"
+            "  --rate-action <reply|drop>: answer 429 (default), or close "
+            "the connection\n"
+            "      as soon as it is accepted\n"
+#ifdef ENABLE_WORKERS
+            "  -w, --workers <n>: number of worker threads, each with its own "
+            "listening\n"
+            "      sockets (SO_REUSEPORT) and connections (default: 1)\n"
+#endif
+#ifdef ENABLE_IO_URING
+            "  --no-io-uring: use the %s event loop even if io_uring is "
+            "available\n"
+#endif
+#ifndef __WIN32__
+            "  --upgrade-socket <file>: take the listening sockets and the "
+            "cache over\n"
+            "      from the server answering on file, if any, then answer "
+            "there so that\n"
+            "      a new server can take over in turn\n"
+#endif
+            "  --stats-path <path>: answer requests for path (e.g. /__stats) "
+            "with the\n"
+            "      server's counters; ?format=prometheus for Prometheus\n"
+#ifndef __WIN32__
+            "  --stats-socket <file>: serve the counters on a Unix-domain "
+            "socket too;\n"
+            "      send \"prometheus\" first for the Prometheus format\n"
+#endif
+            , DEFAULT_CACHE_SIZE, GRANT_DELAY, KEEPALIVE_TIMEOUT,
+            HEADER_TIMEOUT, MAX_KEEPALIVE_REQUESTS, LISTEN_BACKLOG,
+            MAX_PENDING_REQUESTS
+#ifdef ENABLE_IO_URING
+            , event_loop_backend()
+#endif
+            );
+}
+
+/* Parses the numeric argument of an option; prints an error on failure */
+int parse_number(const char *option, const char *arg,
+                 long min, long max, long *result)
+{
+    char *end;
+    long value;
+    if(arg == NULL)
+    {
+        fprintf(stderr, "Error: missing argument for %s\n", option);
+        return -1;
+    }
+    errno = 0;
+    value = strtol(arg, &end, 10);
+    if(errno != 0 || end == arg || *end != '\0' || value < min || value > max)
+    {
+        fprintf(stderr, "Error: %s expects a number between %ld and %ld\n",
+                option, min, max);
+        return -1;
+    }
+    *result = value;
+    return 0;
 }
 
 int main(int argc, char **argv)
@@ -153,12 +469,44 @@ int main(int argc, char **argv)
     const char *bind_addr = NULL;
     const char *port = NULL;
     const char *dest = NULL;
+    const char *rules_file = NULL;
+    const char *key_file = NULL;
+    const char *stats_socket = NULL;
+    const char *access_file = NULL;
+    const char *cache_file = NULL;
+    const char *upgrade_socket = NULL;
+    int log_level = LOG_LEVEL_INFO;
+    int access_format = LOG_ACCESS_TEXT;
+    struct Routing *routing;
+    struct Config config;
+    struct ListenerConfig listeners[MAX_LISTENERS];
+    int listener_count = 0;
+    int serv_socks[MAX_LISTEN_SOCKETS];
+    int sock_count = 0;
+    bool pin_workers = false;
+    CacheEntry *entries = NULL;
+    size_t entry_count = 0;
 #ifdef ENABLE_FORK
     int daemonize = 0;
 #endif
 #ifdef ENABLE_CHGUSER
     const char *user = NULL;
 #endif
+    long workers = 1;
+
+    config.cache_size = DEFAULT_CACHE_SIZE;
+    config.grant_delay = GRANT_DELAY;
+    config.keepalive_timeout = KEEPALIVE_TIMEOUT;
+    config.header_timeout = HEADER_TIMEOUT;
+    config.max_requests = MAX_KEEPALIVE_REQUESTS;
+    config.backlog = LISTEN_BACKLOG;
+    config.max_connections = MAX_PENDING_REQUESTS;
+    config.rate_limit = 0;
+    config.rate_burst = 0;
+    config.rate_drop = false;
+    config.stats_path = NULL;
+    config.template_file = NULL;
+    config.io_uring = true;
 
     (void)argc; /* unused */
     while(*(++argv) != NULL)
@@ -196,6 +544,273 @@ int main(int argc, char **argv)
             }
             port = *argv;
         }
+        else if(strcmp(*argv, "--listen") == 0)
+        {
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for --listen\n");
+                return 1;
+            }
+            if(listener_count == MAX_LISTENERS)
+            {
+                fprintf(stderr, "Error: --listen was passed more than %d "
+                        "times\n", MAX_LISTENERS);
+                return 1;
+            }
+            if(listener_parse(&listeners[listener_count], *argv) != 0)
+                return 1;
+            ++listener_count;
+        }
+        else if(strcmp(*argv, "-q") == 0 || strcmp(*argv, "--quiet") == 0)
+        {
+            log_level = LOG_LEVEL_WARNING;
+        }
+        else if(strcmp(*argv, "--log-level") == 0)
+        {
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for --log-level\n");
+                return 1;
+            }
+            log_level = log_level_parse(*argv);
+            if(log_level == -1)
+            {
+                fprintf(stderr, "Error: unknown log level %s\n", *argv);
+                return 1;
+            }
+        }
+        else if(strcmp(*argv, "--access-log") == 0)
+        {
+            if(access_file != NULL)
+            {
+                fprintf(stderr, "Error: --access-log was passed multiple "
+                        "times\n");
+                return 1;
+            }
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for --access-log\n");
+                return 1;
+            }
+            access_file = *argv;
+        }
+        else if(strcmp(*argv, "--access-format") == 0)
+        {
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for "
+                        "--access-format\n");
+                return 1;
+            }
+            access_format = log_access_format_parse(*argv);
+            if(access_format == -1)
+            {
+                fprintf(stderr, "Error: unknown access log format %s\n",
+                        *argv);
+                return 1;
+            }
+        }
+        else if(strcmp(*argv, "-r") == 0 || strcmp(*argv, "--rules") == 0)
+        {
+            if(rules_file != NULL)
+            {
+                fprintf(stderr, "Error: --rules was passed multiple times\n");
+                return 1;
+            }
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for --rules\n");
+                return 1;
+            }
+            rules_file = *argv;
+        }
+        else if(strcmp(*argv, "--template") == 0)
+        {
+            if(config.template_file != NULL)
+            {
+                fprintf(stderr, "Error: --template was passed multiple "
+                        "times\n");
+                return 1;
+            }
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for --template\n");
+                return 1;
+            }
+            config.template_file = *argv;
+        }
+        else if(strcmp(*argv, "-s") == 0
+             || strcmp(*argv, "--token-key") == 0)
+        {
+            if(key_file != NULL)
+            {
+                fprintf(stderr, "Error: --token-key was passed multiple "
+                        "times\n");
+                return 1;
+            }
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for --token-key\n");
+                return 1;
+            }
+            key_file = *argv;
+        }
+        else if(strcmp(*argv, "-c") == 0
+             || strcmp(*argv, "--cache-size") == 0)
+        {
+            if(parse_number("--cache-size", *(++argv), 1, 1L << 24,
+                            &config.cache_size) != 0)
+                return 1;
+        }
+        else if(strcmp(*argv, "--cache-file") == 0)
+        {
+            if(cache_file != NULL)
+            {
+                fprintf(stderr, "Error: --cache-file was passed multiple "
+                        "times\n");
+                return 1;
+            }
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for --cache-file\n");
+                return 1;
+            }
+            cache_file = *argv;
+        }
+        else if(strcmp(*argv, "-g") == 0
+             || strcmp(*argv, "--grant-delay") == 0)
+        {
+            if(parse_number("--grant-delay", *(++argv), 0, 3600000L,
+                            &config.grant_delay) != 0)
+                return 1;
+        }
+        else if(strcmp(*argv, "-k") == 0
+             || strcmp(*argv, "--keep-alive") == 0)
+        {
+            if(parse_number("--keep-alive", *(++argv), 0, 3600000L,
+                            &config.keepalive_timeout) != 0)
+                return 1;
+        }
+        else if(strcmp(*argv, "-t") == 0
+             || strcmp(*argv, "--header-timeout") == 0)
+        {
+            if(parse_number("--header-timeout", *(++argv), 1, 3600000L,
+                            &config.header_timeout) != 0)
+                return 1;
+        }
+        else if(strcmp(*argv, "-m") == 0
+             || strcmp(*argv, "--max-requests") == 0)
+        {
+            if(parse_number("--max-requests", *(++argv), 1, 1000000L,
+                            &config.max_requests) != 0)
+                return 1;
+        }
+        else if(strcmp(*argv, "-l") == 0 || strcmp(*argv, "--backlog") == 0)
+        {
+            if(parse_number("--backlog", *(++argv), 1, 65535,
+                            &config.backlog) != 0)
+                return 1;
+        }
+        else if(strcmp(*argv, "-n") == 0
+             || strcmp(*argv, "--max-connections") == 0)
+        {
+            if(parse_number("--max-connections", *(++argv), 1, 1L << 20,
+                            &config.max_connections) != 0)
+                return 1;
+        }
+        else if(strcmp(*argv, "--rate-limit") == 0)
+        {
+            if(parse_number("--rate-limit", *(++argv), 1, 1000000,
+                            &config.rate_limit) != 0)
+                return 1;
+        }
+        else if(strcmp(*argv, "--rate-burst") == 0)
+        {
+            if(parse_number("--rate-burst", *(++argv), 1, 1000000,
+                            &config.rate_burst) != 0)
+                return 1;
+        }
+        else if(strcmp(*argv, "--rate-action") == 0)
+        {
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for "
+                        "--rate-action\n");
+                return 1;
+            }
+            if(strcmp(*argv, "drop") == 0)
+                config.rate_drop = true;
+            else if(strcmp(*argv, "reply") == 0)
+                config.rate_drop = false;
+            else
+            {
+                fprintf(stderr, "Error: unknown rate action %s, expected "
+                        "reply or drop\n", *argv);
+                return 1;
+            }
+        }
+        else if(strcmp(*argv, "-w") == 0 || strcmp(*argv, "--workers") == 0)
+        {
+#ifdef ENABLE_WORKERS
+            if(parse_number("--workers", *(++argv), 1, MAX_WORKERS,
+                            &workers) != 0)
+                return 1;
+#else
+            fprintf(stderr, "Error: --workers is not available\n");
+            return 1;
+#endif
+        }
+        else if(strcmp(*argv, "--no-io-uring") == 0)
+        {
+            config.io_uring = false;
+        }
+        else if(strcmp(*argv, "--stats-path") == 0)
+        {
+            if(config.stats_path != NULL)
+            {
+                fprintf(stderr, "Error: --stats-path was passed multiple "
+                        "times\n");
+                return 1;
+            }
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for --stats-path\n");
+                return 1;
+            }
+            config.stats_path = *argv;
+        }
+        else if(strcmp(*argv, "--stats-socket") == 0)
+        {
+            if(stats_socket != NULL)
+            {
+                fprintf(stderr, "Error: --stats-socket was passed multiple "
+                        "times\n");
+                return 1;
+            }
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for "
+                        "--stats-socket\n");
+                return 1;
+            }
+            stats_socket = *argv;
+        }
+        else if(strcmp(*argv, "--upgrade-socket") == 0)
+        {
+            if(upgrade_socket != NULL)
+            {
+                fprintf(stderr, "Error: --upgrade-socket was passed multiple "
+                        "times\n");
+                return 1;
+            }
+            if(*(++argv) == NULL)
+            {
+                fprintf(stderr, "Error: missing argument for "
+                        "--upgrade-socket\n");
+                return 1;
+            }
+            upgrade_socket = *argv;
+        }
         else if(strcmp(*argv, "-d") == 0 || strcmp(*argv, "--daemon") == 0)
         {
 #ifdef ENABLE_FORK
@@ -235,19 +850,59 @@ int main(int argc, char **argv)
         }
     }
 
-    if(port == NULL)
-        port = "80";
-
-    if(dest == NULL)
+    if(listener_count == 0)
     {
-        fprintf(stderr, "Error: no destination specified\n");
+        memset(&listeners[0], 0, sizeof(listeners[0]));
+        listeners[0].addr = bind_addr;
+        listeners[0].port = (port != NULL)?port:"80";
+        listener_count = 1;
+    }
+    else if(bind_addr != NULL || port != NULL)
+    {
+        fprintf(stderr, "Error: --bind and --port can't be combined with "
+                "--listen\n");
         return 1;
     }
+    {
+        int i;
+        for(i = 0; i < listener_count; ++i)
+            if(listeners[i].backlog == 0)
+                listeners[i].backlog = config.backlog;
+    }
 
-#ifdef __WIN32__
+    if(config.rate_limit == 0 && config.rate_burst != 0)
     {
-        /* Initializes WINSOCK */
-        WSADATA wsa;
+        fprintf(stderr, "Error: --rate-burst needs --rate-limit\n");
+        return 1;
+    }
+    if(config.rate_burst == 0)
+        config.rate_burst = config.rate_limit;
+
+    if(dest == NULL)
+    {
+        fprintf(stderr, "Error: no destination specified\n");
+        return 1;
+    }
+    config.dest = dest;
+
+    /* Written directly until log_start() */
+    if(log_init(log_level, access_format, access_file) != 0)
+        return 1;
+    config.verbose = log_enabled(LOG_LEVEL_INFO);
+
+    config.rules_file = rules_file;
+    config.key_file = key_file;
+    {
+        int ret = load_routing(&config, &routing);
+        if(ret != 0)
+            return ret;
+        publish_routing(routing);
+    }
+
+#ifdef __WIN32__
+    {
+        /* Initializes WINSOCK */
+        WSADATA wsa;
         if(WSAStartup(MAKEWORD(1, 1), &wsa) != 0)
         {
             fprintf(stderr, "Error: can't initialize WINSOCK\n");
@@ -255,19 +910,113 @@ int main(int argc, char **argv)
         }
     }
 #endif
-// Initialize cache with capacity 100 and TTL 30 seconds
-    if (cache_init(100, 30) != 0) {
+
+    /* From a server being upgraded, or from systemd */
+    if(upgrade_socket != NULL)
+        sock_count = handover_receive(upgrade_socket, serv_socks,
+                                      MAX_LISTEN_SOCKETS, &entries,
+                                      &entry_count);
+    if(sock_count == 0)
+        sock_count = handover_inherit(serv_socks, MAX_LISTEN_SOCKETS);
+    if(sock_count == -1)
+        return 2;
+
+// Initialize cache with the configured capacity and TTL
+    if(cache_file != NULL)
+    {
+        if(cache_init_file((size_t)config.cache_size, CACHE_TTL,
+                           cache_file) != 0)
+            return 3;
+    }
+    else if (cache_init((size_t)config.cache_size, CACHE_TTL) != 0) {
         fprintf(stderr, "Failed to initialize cache.\n");
         // Decide how to handle failure - for now, just print error and continue
     }
+    cache_set_verbose(config.verbose);
+    if(config.rate_limit > 0
+     && ratelimit_init((unsigned long)config.rate_limit,
+                       (unsigned long)config.rate_burst,
+                       RATE_LIMIT_SLOTS) != 0)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        return 3;
+    }
+    if(entries != NULL)
+    {
+        log_message(LOG_LEVEL_INFO, "Kept %lu clients of the previous server",
+                    (unsigned long)cache_import(entries, entry_count));
+        free(entries);
+    }
+
+    /* Before any worker parses a request */
+    {
+        const char *kernels = scan_init();
+        log_message(LOG_LEVEL_INFO, "Using %s header scanning", kernels);
+    }
 
+    if(sock_count == 0)
+    {
+        int i;
+        for(i = 0; i < listener_count; ++i)
+        {
+            int ret = listener_open(&listeners[i], (int)workers, serv_socks,
+                                    &sock_count, MAX_LISTEN_SOCKETS);
+            if(ret != 0)
+            {
+                while(sock_count > 0)
+                    listener_close(serv_socks[--sock_count]);
+                return ret;
+            }
+        }
+    }
+    else if(listener_workers(serv_socks, sock_count) > workers)
     {
-        int serv_sock;
+        /* Each socket has its own queue of connections, which must be
+         * accepted */
+        workers = listener_workers(serv_socks, sock_count);
+        log_message(LOG_LEVEL_INFO, "Using %ld workers, one per listening "
+                    "socket of an address", workers);
+    }
+    {
+        /* Set on the sockets, so that inherited ones count too */
+        int i;
+        for(i = 0; i < sock_count; ++i)
+            if(listener_steered(serv_socks[i]))
+                pin_workers = true;
+    }
 
-        /* Poor man's exception handling... */
-        int ret = setup_server(&serv_sock, bind_addr, port);
-        if(ret != 0)
-            return ret;
+    if(stats_init((int)workers) != 0)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        return 3;
+    }
+
+    {
+        struct Worker worker_list[MAX_WORKERS];
+        long w, started = workers;
+        int ret;
+
+        for(w = 0; w < workers; ++w)
+        {
+            worker_list[w].config = &config;
+            /* Sockets passed by systemd may be fewer than workers */
+            worker_list[w].listener_count = listener_assign(
+                    serv_socks, sock_count, (int)w, worker_list[w].serv_socks);
+            if(worker_list[w].listener_count == -1)
+                return 2;
+            worker_list[w].cpu = pin_workers?listener_cpu((int)w):-1;
+            worker_list[w].index = (int)w;
+            worker_list[w].ret = 0;
+        }
+        if(pin_workers)
+            log_message(LOG_LEVEL_INFO, "Pinning each worker to a CPU, for "
+                        "incoming-cpu");
+
+        /* Like the listening sockets, before dropping privileges */
+        if(stats_socket != NULL && stats_socket_open(stats_socket) != 0)
+            return 2;
+        if(upgrade_socket != NULL && handover_open(upgrade_socket) != 0)
+            return 2;
 
 #ifdef ENABLE_CHGUSER
         if(user != NULL)
@@ -313,11 +1062,66 @@ int main(int argc, char **argv)
         signal(SIGTERM, handle_signal);
 #ifndef __WIN32__
         signal(SIGHUP, handle_signal); // Handle hangup signal on non-Windows
+        signal(SIGPIPE, SIG_IGN); // MSG_NOSIGNAL isn't available everywhere
+#endif
+
+        if(stats_socket_start() != 0
+         || handover_start(serv_socks, sock_count) != 0)
+        {
+            handover_close();
+            stats_socket_close();
+            return 3;
+        }
+        /* After fork(), which only keeps the calling thread */
+        log_start();
+
+#ifdef ENABLE_WORKERS
+        {
+            /* Signals are handled by the main thread (worker 0); the others
+             * notice shutdown_flag within a second */
+            sigset_t all, old;
+            sigfillset(&all);
+            pthread_sigmask(SIG_BLOCK, &all, &old);
+            for(w = 1; w < workers; ++w)
+            {
+                if(pthread_create(&worker_list[w].thread, NULL,
+                                  worker_main, &worker_list[w]) != 0)
+                {
+                    fprintf(stderr, "Error: can't start worker %ld\n", w);
+                    shutdown_flag = 1;
+                    started = w;
+                    break;
+                }
+            }
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+        }
 #endif
 
-        ret = serve(serv_sock, dest);
-        my_closesocket(serv_sock);
+        /* The previous server, if any, can stop accepting */
+        handover_done();
+
+        ret = serve(&worker_list[0]);
+
+#ifdef ENABLE_WORKERS
+        /* After a handover, the others finish their connections first */
+        if(!handover_completed())
+            shutdown_flag = 1;
+        for(w = 1; w < started; ++w)
+        {
+            pthread_join(worker_list[w].thread, NULL);
+            if(ret == 0)
+                ret = worker_list[w].ret;
+        }
+#endif
+        for(w = 0; w < sock_count; ++w)
+            listener_close(serv_socks[w]);
+        handover_close();
+        stats_socket_close();
+        stats_free();
         cache_destroy();
+        ratelimit_destroy();
+        unload_routing();
+        log_stop();
         return ret;
     }
 #ifdef __WIN32__
@@ -325,328 +1129,2023 @@ int main(int argc, char **argv)
 #endif
 }
 
-int setup_server(int *serv_sock, const char *addr, const char *port)
+static const char success_text[] =
+    "HTTP/1.1 200 OK\n"
+    "Content-Type: text/html; charset=utf-8\n"
+    "Server: httpredirect\n"
+    "\n"
+    "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>";
+
+static const char redirect_text[] =
+    "HTTP/1.1 307 Temporary Redirect\n"
+    "Location: http://{dest}/{token}\n"
+    "Server: httpredirect\n";
+
+static const char bad_request_text[] =
+    "HTTP/1.1 400 Bad Request\n"
+    "Server: httpredirect\n";
+
+static const char too_large_text[] =
+    "HTTP/1.1 431 Request Header Fields Too Large\n"
+    "Server: httpredirect\n";
+
+static const char too_many_text[] =
+    "HTTP/1.1 429 Too Many Requests\n"
+    "Retry-After: 1\n"
+    "Server: httpredirect\n";
+
+static const char unavailable_text[] =
+    "HTTP/1.1 503 Service Unavailable\n"
+    "Retry-After: 1\n"
+    "Server: httpredirect\n";
+
+void free_responses(struct Responses *r)
 {
-    int ret;
-    struct addrinfo hints, *results, *rp;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-    hints.ai_protocol = 0;
-    hints.ai_canonname = NULL;
-    hints.ai_addr = NULL;
-    hints.ai_next = NULL;
-    ret = getaddrinfo(addr, port, &hints, &results);
-    if(ret != 0)
+    size_t i;
+    for(i = 0; i < r->rule_count; ++i)
+        template_free(&r->rules[i]);
+    free(r->rules);
+    template_free(&r->success);
+    template_free(&r->bad_request);
+    template_free(&r->too_large);
+    template_free(&r->too_many);
+    template_free(&r->unavailable);
+}
+
+/* Compiles every response up front: the success page, the errors, and the
+ * redirect of each rule (from its template, template_file, or the built-in
+ * one). Returns 0, or -1 after printing an error. */
+int build_responses(struct Responses *r, const struct RuleTable *rules,
+                    const char *template_file)
+{
+    size_t i, fixed = 0, weight = 0;
+    int ret = 0;
+
+    memset(r, 0, sizeof(*r));
+    r->rules = calloc(rules_count(rules), sizeof(struct Template));
+    if(r->rules == NULL)
     {
-        fprintf(stderr, "Error: getaddrinfo failed: %s\n", gai_strerror(ret));
-        return 1;
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
     }
-
-    for(rp = results; rp != NULL; rp = rp->ai_next)
+    r->rule_count = rules_count(rules);
+    for(i = 0; i < r->rule_count && ret == 0; ++i)
     {
-        *serv_sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if(*serv_sock == -1)
+        const struct Rule *rule = rules_get(rules, i);
+        const char *file = (rule->template_file != NULL)?rule->template_file
+                                                        :template_file;
+        struct Template *t = &r->rules[i];
+        if(rule->action == RULE_SUCCESS)
             continue;
+        if(file != NULL)
+            ret = template_load(t, file, rule->dest);
+        else
+            ret = template_compile(t, redirect_text,
+                                   sizeof(redirect_text) - 1, rule->dest,
+                                   "built-in redirect");
+        if(ret == 0 && t->fixed_size > fixed)
+            fixed = t->fixed_size;
+        if(ret == 0 && t->weight > weight)
+            weight = t->weight;
+        if(ret == 0 && t->parts != NULL && !template_token_only(t))
+            r->rendered = true;
+    }
+    if(ret == 0)
+        ret = template_compile(&r->success, success_text,
+                               sizeof(success_text) - 1, NULL, "success");
+    if(ret == 0)
+        ret = template_compile(&r->bad_request, bad_request_text,
+                               sizeof(bad_request_text) - 1, NULL,
+                               "bad request");
+    if(ret == 0)
+        ret = template_compile(&r->too_large, too_large_text,
+                               sizeof(too_large_text) - 1, NULL, "too large");
+    if(ret == 0)
+        ret = template_compile(&r->too_many, too_many_text,
+                               sizeof(too_many_text) - 1, NULL, "too many");
+    if(ret == 0)
+        ret = template_compile(&r->unavailable, unavailable_text,
+                               sizeof(unavailable_text) - 1, NULL,
+                               "unavailable");
 
-        if(bind(*serv_sock, rp->ai_addr, rp->ai_addrlen) != -1)
-            break;
-
-        my_closesocket(*serv_sock);
+    /* The heads of a batch of pipelined requests are in the connection's
+     * buffer together: that bounds what their responses echo */
+    if(ret == 0 && PIPELINE_DEPTH * fixed + weight * RECV_BUFFER_SIZE
+                   > RENDER_BUFFER_SIZE)
+    {
+        fprintf(stderr, "Error: the templates may render more than %d bytes "
+                "per connection (RENDER_BUFFER_SIZE)\n", RENDER_BUFFER_SIZE);
+        ret = -1;
     }
+    if(ret != 0)
+    {
+        free_responses(r);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef ENABLE_WORKERS
+static pthread_mutex_t routing_lock = PTHREAD_MUTEX_INITIALIZER;
+    #define lock_routing() pthread_mutex_lock(&routing_lock)
+    #define unlock_routing() pthread_mutex_unlock(&routing_lock)
+#else
+    #define lock_routing()
+    #define unlock_routing()
+#endif
 
-    freeaddrinfo(results);
+static struct Routing *current_routing = NULL;
+static unsigned long routing_generation = 0; /* of current_routing */
 
-    if(rp == NULL)
+/* Loads the rules and the token key, and renders the responses. Returns 0,
+ * or the exit code after printing an error (1 for bad files, 3 when out of
+ * memory). */
+int load_routing(const struct Config *config, struct Routing **result)
+{
+    struct Routing *routing = calloc(1, sizeof(struct Routing));
+    struct RuleTable *rules;
+    char *apple_dest;
+
+    if(routing == NULL)
     {
-        fprintf(stderr, "Could not bind to %s:%s\n",
-                ((addr == NULL)?"*":addr), port);
-        *serv_sock = -1;
-        return 2;
+        fprintf(stderr, "Error: out of memory\n");
+        return 3;
+    }
+    if(config->key_file != NULL)
+    {
+        if(token_key_load(&routing->key, config->key_file) != 0)
+        {
+            free(routing);
+            return 1;
+        }
+        routing->signed_tokens = true;
     }
 
-    if(listen(*serv_sock, 5) == -1)
+    /* Built-in rules come after those of the file, which can override them */
+    rules = rules_new();
+    if(rules == NULL)
     {
-        perror("Error: can't listen for incoming connections");
-        return 2;
+        fprintf(stderr, "Error: out of memory\n");
+        free(routing);
+        return 3;
+    }
+    if(config->rules_file != NULL && rules_load(rules, config->rules_file) != 0)
+    {
+        rules_free(rules);
+        free(routing);
+        return 1;
+    }
+    apple_dest = malloc(strlen(config->dest) + 7);
+    if(apple_dest == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        rules_free(rules);
+        free(routing);
+        return 3;
+    }
+    sprintf(apple_dest, "apple.%s", config->dest);
+    if(rules_add(rules, "captive.apple.com", "/", RULE_PORTAL, apple_dest) != 0
+     || rules_add(rules, "*", "", RULE_REDIRECT, config->dest) != 0
+     || rules_compile(rules) != 0)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        free(apple_dest);
+        rules_free(rules);
+        free(routing);
+        return 3;
     }
+    free(apple_dest);
+    if(config->rules_file != NULL)
+        log_message(LOG_LEVEL_INFO, "Loaded %lu rules from %s",
+                    (unsigned long)rules_count(rules) - 2, config->rules_file);
 
+    if(build_responses(&routing->responses, rules,
+                       config->template_file) != 0)
+    {
+        rules_free(rules);
+        free(routing);
+        return 1;
+    }
+    routing->rules = rules;
+    *result = routing;
     return 0;
 }
 
-char *build_success(size_t *response_size)
+/* Makes routing the one workers move to */
+void publish_routing(struct Routing *routing)
 {
-    const char *header = "HTTP/1.1 200 OK\r\n"
-                         "Content-Type: text/html; charset=utf-8\r\n"
-                         "Content-Length: 68\r\n"
-                         "Server: httpredirect\r\n"
-                         "\r\n";
-    const char *body = "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>";
-    size_t header_len = strlen(header);
-    size_t body_len = strlen(body);
-    *response_size = header_len + body_len;
+    struct Routing *previous;
 
-    char *response = malloc(*response_size + 1);
-    if (response == NULL) {
-        *response_size = 0;
-        return NULL;
-    }
+    lock_routing();
+    previous = current_routing;
+    routing->users = 1;
+    routing->generation = (previous != NULL)?previous->generation + 1:1;
+    current_routing = routing;
+    __atomic_store_n(&routing_generation, routing->generation,
+                     __ATOMIC_RELEASE);
+    unlock_routing();
+    if(previous != NULL)
+        release_routing(previous);
+}
 
-    strcpy(response, header);
-    strcat(response, body);
+/* The current routing, kept until release_routing() */
+static struct Routing *acquire_routing(void)
+{
+    struct Routing *routing;
 
-    return response;
+    lock_routing();
+    routing = current_routing;
+    ++routing->users;
+    unlock_routing();
+    return routing;
 }
 
-char *build_appleredirect(const char *dest, size_t *response_size)
+void release_routing(struct Routing *routing)
 {
-    const char *pattern =
-                "HTTP/1.1 307 Temporary Redirect\r\n"
-                "Location: http://apple.%s/xxxxxx\r\n"
-                "Content-Length: 0\r\n"
-                "Server: httpredirect\r\n"
-                "\r\n";
-    char *response;
-    *response_size = strlen(pattern) - 2 + strlen(dest);
-    response = malloc(*response_size + 1);
-    snprintf(response, *response_size + 1, pattern, dest);
+    int users;
+
+    lock_routing();
+    users = --routing->users;
+    unlock_routing();
+    if(users > 0)
+        return;
+    free_responses(&routing->responses);
+    rules_free(routing->rules);
+    free(routing);
+}
 
-    return response;
+/* Once the workers are done */
+void unload_routing(void)
+{
+    release_routing(current_routing);
+    current_routing = NULL;
 }
 
-char *build_redirect(const char *dest, size_t *response_size)
+/* Loads the files again; the current routing stays if that fails */
+static void reload_routing(const struct Config *config)
 {
-    const char *pattern =
-                "HTTP/1.1 307 Temporary Redirect\r\n"
-                "Location: http://%s/xxxxxx\r\n"
-                "Content-Length: 0\r\n"
-                "Server: httpredirect\r\n"
-                "\r\n";
-    char *response;
-    *response_size = strlen(pattern) - 2 + strlen(dest);
-    response = malloc(*response_size + 1);
-    snprintf(response, *response_size + 1, pattern, dest);
+    struct Routing *routing;
 
-    return response;
+    if(load_routing(config, &routing) != 0)
+    {
+        log_message(LOG_LEVEL_ERROR, "Reloading failed, keeping the current "
+                    "configuration");
+        return;
+    }
+    publish_routing(routing);
+    log_message(LOG_LEVEL_INFO, "Configuration reloaded");
 }
 
+/* Received io_uring buffers a connection may hold while its responses are
+ * being sent */
+#define HELD_BUFFERS 4
+
 struct Client {
     int sock;
-    int state;
-    bool is_apple_captive_portal; // true if the request is from an Apple captive portal
+    struct Server *server;
+    struct ClientAddr addr; /* captured by accept(), see client_address() */
+    struct RequestParser parser; /* for the request at the start of buffer */
+    unsigned int events;    /* EV_READ or EV_WRITE, as registered */
+    bool closing;           /* close once the queued responses are sent */
+    bool limited;           /* over the rate limit: answered 429 */
+    long requests;          /* requests answered on this connection */
+    struct Timer deadline;  /* header or keep-alive timeout */
+    bool idle;              /* between requests, deadline is keep-alive's */
+    int queued;             /* responses in out */
+    int out_index;          /* first segment not completely sent */
+    int out_count;
+    Segment out[PIPELINE_DEPTH * RESPONSE_SEGMENTS];
+    char tokens[PIPELINE_DEPTH][TOKEN_MAX_SIZE]; /* end of redirect URLs */
+    char *render;           /* from the worker's pool, while needed */
+    size_t rendered;        /* bytes of render used by the queued responses */
+    char *page;             /* stats page, allocated on first request */
+    size_t page_size;
+    bool page_queued;       /* page is part of the queued responses */
+    const struct Routing *routing; /* that of the queued responses */
+    struct Client *prev, *next; /* in accept order, oldest first */
+#ifdef ENABLE_IO_URING
+    int fd;                 /* sock, kept once close_client() cleared it */
+    int inflight;           /* io_uring requests not completed yet */
+    bool receiving;         /* multishot recv armed */
+    bool sending;
+    struct msghdr msg;      /* of the send in flight */
+    int held_count;         /* provided buffers not copied to buffer yet */
+    size_t held_offset;     /* bytes of held[0] already copied */
+    unsigned int held[HELD_BUFFERS];
+    size_t held_len[HELD_BUFFERS];
+#endif
+    size_t buffer_len;      /* bytes received into buffer */
+    char buffer[RECV_BUFFER_SIZE]; /* requests not answered yet */
+};
+
+struct ClientList {
+    struct Client *oldest;
+    struct Client *newest;
+    size_t count;
+    struct Client *closed; /* freed once the current batch of events is done */
+#ifdef ENABLE_IO_URING
+    struct Client *zombies; /* closed, freed once their requests complete */
+#endif
+};
+
+/* One of the worker's listening sockets */
+struct Listener {
+    int sock;
+#ifdef ENABLE_IO_URING
+    bool accepting;         /* multishot accept armed */
+#endif
+    bool pending;           /* readable, or last accept batch was full */
+};
+
+/* State of one worker's serve() loop */
+struct Server {
+    const struct Config *config;
+    struct Listener listeners[MAX_LISTENERS];
+    int listener_count;
+    struct EventLoop *loop;
+#ifdef ENABLE_IO_URING
+    struct Uring *ring;     /* instead of loop, if not NULL */
+#endif
+    bool backlog_pending;   /* last accept batch of a listener was full */
+    bool draining;          /* a new server took over the listeners */
+    struct Stats *stats;    /* this worker's, see stats.h */
+    struct Pool clients;    /* of struct Client, max_connections of them */
+    struct Pool renders;    /* RENDER_BUFFER_SIZE bytes, once a template
+                             * needs them (slab NULL until then) */
+    struct Pool grants;     /* of struct Grant, malloc() past its capacity */
+    uint64_t grant_warned;  /* ms, when a grant last couldn't be allocated */
+    struct Grant *pending_grants[GRANT_BUCKETS]; /* by client address */
+    struct ClientList list;
+    struct Routing *routing; /* for new requests */
+    struct Routing *retired; /* the previous one, until no longer used */
+    uint64_t reload_retry;  /* ms, after a reload refused for lack of memory */
+    struct TimerWheel wheel;
+    struct Timer expire_timer;
+    struct Timer retired_timer;
+    struct TokenRng rng;    /* of this worker's thread */
 };
 
-int serve(int serv_sock, const char *dest)
+/* Pending admission of a captive-portal client into the cache */
+struct Grant {
+    struct Timer timer;     /* first: the timer's data is the server */
+    struct ClientAddr key;
+    struct Grant *next;     /* in its pending_grants bucket */
+    bool pooled;            /* from the grants pool, or malloc() */
+};
+
+/* Bucket of a client's pending grant (FNV-1a of its address) */
+static struct Grant **grant_bucket(struct Server *server,
+                                   const struct ClientAddr *addr)
 {
-    size_t response_size;
-    char *response_data = build_redirect(dest, &response_size);
-    size_t apple_response_size;
-    char *apple_response_data = build_appleredirect(dest, &apple_response_size);
-    size_t success_response_size;
-    char *success_response_data = build_success(&success_response_size);
-    const char *apple_domain = "captive.apple.com";
-    if(response_data == NULL || apple_response_data == NULL || success_response_data == NULL)
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for(i = 0; i < sizeof(addr->bytes); ++i)
     {
-        fprintf(stderr, "Error: failed to build response data\n");
-        return 3;
+        hash ^= addr->bytes[i];
+        hash *= 16777619u;
     }
-    /* find substr "xxxxxx" in response_data and apple_response_data, save position*/
-    char *url = strstr(response_data, "xxxxxx");
-    char *apple_url = strstr(apple_response_data, "xxxxxx");
-    if(url == NULL || apple_url == NULL)
-    {
-        fprintf(stderr, "Error: failed to find 'xxxxxx' in response data\n");
-        free(response_data);
-        free(apple_response_data);
-        free(success_response_data);
-        return 3;
+    return &server->pending_grants[hash & (GRANT_BUCKETS - 1)];
+}
+
+static void grant_expired(struct Timer *timer)
+{
+    struct Server *server = timer->data;
+    struct Grant *grant = (struct Grant*)timer;
+    struct Grant **link = grant_bucket(server, &grant->key);
+    char ip[CLIENT_ADDR_STRLEN];
+
+    // Add the IP to the cache with a dummy value and size
+    if (cache_add(&grant->key, (void *)"1", 1) == 0) {
+        if (log_enabled(LOG_LEVEL_INFO))
+            log_message(LOG_LEVEL_INFO, "Added %s to cache after delay",
+                        client_addr_format(&grant->key, ip, sizeof(ip)));
+    } else {
+        log_message(LOG_LEVEL_WARNING, "Failed to add %s to cache after delay",
+                    client_addr_format(&grant->key, ip, sizeof(ip)));
     }
-    /* replace "xxxxxx" with the 6 random characters */
-    char random_chars[7];
-    random_chars[6] = '\0'; // Null-terminate the string
-    
-    struct Client *connections[MAX_PENDING_REQUESTS];
-    size_t i;
-    for(i = 0; i < MAX_PENDING_REQUESTS; ++i)
-        connections[i] = NULL;
+    while(*link != grant)
+        link = &(*link)->next;
+    *link = grant->next;
+    if(grant->pooled)
+        pool_put(&server->grants, grant);
+    else
+        free(grant);
+}
 
-    while(!shutdown_flag) // Check shutdown_flag
-    {
-        int greatest;
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET((SOCKET)serv_sock, &fds);
-        greatest = serv_sock;
+/* A client probing again before its grant is due keeps the one it has */
+static void schedule_grant(struct Server *server, const struct ClientAddr *addr)
+{
+    struct Grant **bucket = grant_bucket(server, addr);
+    struct Grant *grant;
 
-        for(i = 0; i < MAX_PENDING_REQUESTS && connections[i] != NULL; ++i)
+    for(grant = *bucket; grant != NULL; grant = grant->next)
+        if(memcmp(&grant->key, addr, sizeof(struct ClientAddr)) == 0)
+            return;
+    /* Grants outlive their connections: a herd of new clients within the
+     * delay can outnumber the pool */
+    grant = pool_get(&server->grants);
+    if(grant != NULL)
+        grant->pooled = true;
+    else if((grant = malloc(sizeof(struct Grant))) != NULL)
+        grant->pooled = false;
+    else
+    {
+        uint64_t now = timer_now_ms();
+        if(now - server->grant_warned >= 1000)
         {
-            int s = connections[i]->sock;
-            FD_SET((SOCKET)s, &fds);
-            if(s > greatest)
-                greatest = s;
+            log_message(LOG_LEVEL_WARNING, "Failed to schedule cache grant");
+            server->grant_warned = now;
         }
+        return;
+    }
+    grant->key = *addr;
+    grant->next = *bucket;
+    *bucket = grant;
+    timer_init(&grant->timer, grant_expired, server);
+    timer_schedule(&server->wheel, &grant->timer, timer_now_ms(),
+                   (uint64_t)server->config->grant_delay);
+}
 
-        // Use select with a timeout or check shutdown_flag after select
-        struct timeval tv;
-        tv.tv_sec = 1; // Check flag every 1 second
-        tv.tv_usec = 0;
+/* Periodically drops expired clients from the cache */
+static void expire_cache(struct Timer *timer)
+{
+    struct Server *server = timer->data;
+    cache_expire(CACHE_EXPIRE_BUDGET);
+    timer_schedule(&server->wheel, timer, timer_now_ms(), 1000);
+}
 
-        select(greatest + 1, &fds, NULL, NULL, &tv);
+int set_nonblocking(int sock)
+{
+#ifdef __WIN32__
+    u_long mode = 1;
+    return (ioctlsocket(sock, FIONBIO, &mode) == 0)?0:-1;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    if(flags == -1)
+        return -1;
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
 
-        if (shutdown_flag) {
-            break; // Exit loop if shutdown_flag is set
-        }
+/* true if the last socket call failed only because it would have blocked */
+static bool would_block(void)
+{
+#ifdef __WIN32__
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
 
-        if(FD_ISSET(serv_sock, &fds))
-        {
-            /* If all connections are taken */
-            if(connections[MAX_PENDING_REQUESTS - 1] != NULL)
-            {
-                my_closesocket(connections[0]->sock);
-                free(connections[0]);
-                connections[0] = NULL;
-                pack_array((void**)connections, MAX_PENDING_REQUESTS);
-            }
-            /* Accept the new connection */
-            {
-                struct sockaddr_in clientsin;
-                socklen_t size = sizeof(clientsin);
-                int sock = accept(serv_sock,
-                                  (struct sockaddr*)&clientsin, &size);
-                if(sock != -1)
-                {
-                    for(i = 0; i < MAX_PENDING_REQUESTS; ++i)
-                        if(connections[i] == NULL)
-                            break;
-                    connections[i] = malloc(sizeof(struct Client));
-                    connections[i]->sock = sock;
-                    connections[i]->state = 0;
-                    connections[i]->is_apple_captive_portal = false; // Initialize to false
-                }
-            }
-        }
-        else for(i = 0; i < MAX_PENDING_REQUESTS && connections[i] != NULL; ++i)
-        {
-            int s = connections[i]->sock;
-            if(FD_ISSET(s, &fds))
-            {
-                int *const state = &connections[i]->state;
-                int j;
-
-                /* get remote ip addr*/
-                struct sockaddr_in clientsin;
-                socklen_t size = sizeof(clientsin);
-                getpeername(s, (struct sockaddr*)&clientsin, &size);
-                char ip[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &(clientsin.sin_addr), ip, INET_ADDRSTRLEN);
-                fprintf(stderr,"Client connected from %s\n", ip);
-
-                /* Read stuff */
-                static char buffer[RECV_BUFFER_SIZE];
-                int len = recv(s, buffer, RECV_BUFFER_SIZE, 0);
-
-                /* dump buffer*/
-/*
-                for(j = 0; j < len; ++j)
-                    fprintf(stdout, "%c", buffer[j]);
-                fprintf(stdout,"\n");
-*/
-                /* scan buffer to Check if the whole http request data includes header "Host", and it's value is Apple captive portal */
-                for(j = 0; j < len; ++j) {
-                    if (buffer[j] == 'H' && buffer[j + 1] == 'o' && buffer[j + 2] == 's' && buffer[j + 3] == 't' && buffer[j + 4] == ':') {
-                        j += 5; // Move past "Host: "
-                        while (j < len && buffer[j] == ' ') j++; // Skip spaces
-                        if (j < len) {
-                            // Check if the host matches the Apple captive portal domain
-                            if (strncmp(&buffer[j], apple_domain, strlen(apple_domain)) == 0) {
-                                fprintf(stderr, "Detected Apple captive portal for IP: %s\n", ip);
-                                connections[i]->is_apple_captive_portal = true;
-                            }
-                        }
-                        break; // No need to check further once we found the Host header
-                    }
-                }
+#ifdef ENABLE_IO_URING
+/* Operations, in the high bits of the user_data of io_uring requests; the
+ * rest is the pool handle of the Client, the index of the listener for
+ * OP_ACCEPT */
+enum {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_SEND,
+    OP_CLOSE,
+    OP_CANCEL
+};
+#define OP_SHIFT POOL_HANDLE_BITS
+#define HANDLE_MASK ((UINT64_C(1) << POOL_HANDLE_BITS) - 1)
 
-                for(j = 0; j < len; ++j)
-                {
-                    if(buffer[j] == '\r')
-                    {
-                        if(*state == 0 || *state == 2)
-                            ++*state;
-                        else
-                            *state = 1;
-                    }
-                    else if(buffer[j] == '\n')
-                    {
-                        if(*state < 2)
-                            *state = 2;
-                        else
-                        {
-                            *state = 4;
-                            break;
-                        }
-                    }
-                    else
-                        *state = 0;
-                }
-                if(*state == 4)
-                {
-                    /* 如果connections[i]->is_apple_captive_portal 为true，检查是否存在cache中key为ip地址*/
-                    if (connections[i]->is_apple_captive_portal) {
-                        size_t value_size;
-                        void *value = cache_get(ip, &value_size); // 尝试获取缓存中的值
-                        if (value != NULL) { // 如果缓存中存在值，直接返回缓存中的值
-                            send(s, success_response_data, success_response_size, 0); // 发送success内容
-                        } else {
-                            // 如果缓存中不存在值，添加并行任务，3秒后添加到缓存中
-                            pthread_t thread;
-                            pthread_create(&thread, NULL, add_to_cache, (void *)ip);
-                            // 设置线程为分离状态，这样线程结束后会自动释放资源
-                            pthread_detach(thread);
-                            srand(time(NULL)); // Seed the random number generator
-                            int i;
-                            for(i = 0; i < 6; ++i)
-                                random_chars[i] = 'a' + rand() % 26; // Generate a random lowercase letter
-                            memcpy(apple_url, random_chars, 6); // Replace "xxxxxx" with random characters
-                            send(s, apple_response_data, apple_response_size, 0);
-                        }
-                    }
-                    else {
-                        /* Print redirect */
-                        srand(time(NULL)); // Seed the random number generator
-                        int i;
-                        for(i = 0; i < 6; ++i)
-                            random_chars[i] = 'a' + rand() % 26; // Generate a random lowercase letter
-                        memcpy(url, random_chars, 6); // Replace "xxxxxx" with random characters
-                        send(s, response_data, response_size, 0);
-                    }
-                }
+/* The pool handle is checked on completion, a stale one would be ignored */
+static uint64_t uring_data(struct Server *server, struct Client *client,
+                           int op)
+{
+    uint64_t handle = (client != NULL)?pool_handle(&server->clients, client):0;
+    return (uint64_t)op << OP_SHIFT | handle;
+}
 
-                /* Client closed the connection OR request complete */
-                if(len <= 0 || *state == 4)
-                {
-                    my_closesocket(s);
-                    free(connections[i]);
-                    connections[i] = NULL;
-                    pack_array((void**)connections, MAX_PENDING_REQUESTS);
-                }
-            }
-        }
+static uint64_t accept_data(int index)
+{
+    return (uint64_t)OP_ACCEPT << OP_SHIFT | (uint64_t)index;
+}
+
+/* Submission entry for an operation of the client, counted as in flight
+ * until its last completion. NULL if the queue is full. */
+static struct io_uring_sqe *uring_request(struct Server *server,
+                                          struct Client *client, int op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(server->ring);
+    if(sqe == NULL)
+        return NULL;
+    sqe->user_data = uring_data(server, client, op);
+    if(client != NULL)
+        ++client->inflight;
+    return sqe;
+}
+
+/* Asynchronous counterpart of event_del() and my_closesocket(). The close
+ * comes first, so that it is linked to the last response if there is one;
+ * the pending recv keeps the socket open until it is cancelled. */
+static void uring_close(struct Server *server, struct Client *client)
+{
+    struct io_uring_sqe *sqe = uring_request(server, client, OP_CLOSE);
+    if(sqe != NULL)
+        uring_prep_close(sqe, client->fd);
+
+    if(client->receiving)
+    {
+        struct io_uring_sqe *cancel = uring_request(server, client, OP_CANCEL);
+        if(cancel != NULL)
+            uring_prep_cancel(cancel, uring_data(server, client, OP_RECV));
+        else
+            shutdown(client->fd, SHUT_RDWR); /* ends the recv */
     }
+    if(sqe == NULL)
+        close(client->fd);
 
-    // Cleanup connections before exiting
-    for(i = 0; i < MAX_PENDING_REQUESTS; ++i) {
-        if (connections[i] != NULL) {
-            my_closesocket(connections[i]->sock);
-            free(connections[i]);
-            connections[i] = NULL;
-        }
+    /* Whatever is still to be received is dropped */
+    while(client->held_count > 0)
+        uring_recycle_buffer(server->ring,
+                             client->held[--client->held_count]);
+}
+#endif
+
+static void close_client(struct Server *server, struct Client *client)
+{
+    struct ClientList *list = &server->list;
+
+#ifdef ENABLE_IO_URING
+    if(server->ring != NULL)
+        uring_close(server, client);
+    else
+#endif
+    {
+        event_del(server->loop, client->sock);
+        my_closesocket(client->sock);
+    }
+    client->sock = -1;
+    timer_cancel(&server->wheel, &client->deadline);
+
+    if(client->prev != NULL)
+        client->prev->next = client->next;
+    else
+        list->oldest = client->next;
+    if(client->next != NULL)
+        client->next->prev = client->prev;
+    else
+        list->newest = client->prev;
+    --list->count;
+
+#ifdef ENABLE_IO_URING
+    /* Completions still to come point to it */
+    if(client->inflight > 0)
+    {
+        client->prev = NULL;
+        client->next = list->zombies;
+        if(list->zombies != NULL)
+            list->zombies->prev = client;
+        list->zombies = client;
+        return;
+    }
+#endif
+
+    /* Other events of the current batch may still point to it */
+    client->next = list->closed;
+    list->closed = client;
+}
+
+/* Returns the slot of a connection that is closed, and that no io_uring
+ * request refers to anymore, to the pool */
+static void free_client(struct Server *server, struct Client *client)
+{
+    free(client->page);
+    if(client->render != NULL)
+        pool_put(&server->renders, client->render);
+    pool_put(&server->clients, client);
+}
+
+/* The queued responses were sent: their render buffer is free for another
+ * connection */
+static void release_render(struct Server *server, struct Client *client)
+{
+    if(client->render != NULL)
+        pool_put(&server->renders, client->render);
+    client->render = NULL;
+    client->rendered = 0;
+}
+
+/* Address of the client. io_uring multishot accepts don't report it, it is
+ * then only looked up when needed. */
+static const struct ClientAddr *client_address(struct Client *client)
+{
+#ifdef ENABLE_IO_URING
+    if(client->addr.family == 0 && client->sock != -1)
+    {
+        struct sockaddr_storage sin;
+        socklen_t size = sizeof(sin);
+        if(getpeername(client->sock, (struct sockaddr*)&sin, &size) == 0)
+            client_addr_from_sockaddr(&client->addr, &sin, size);
+    }
+#endif
+    return &client->addr;
+}
+
+/* Closes a connection that missed its deadline */
+static void deadline_expired(struct Timer *timer)
+{
+    struct Client *client = timer->data;
+    struct Server *server = client->server;
+    if(client->idle)
+        STATS_INC(server->stats, idle_timeouts);
+    else
+        STATS_INC(server->stats, header_timeouts);
+    if(log_enabled(LOG_LEVEL_DEBUG))
+    {
+        char ip[CLIENT_ADDR_STRLEN];
+        log_message(LOG_LEVEL_DEBUG, "Closing %s connection from %s",
+                    client->idle?"idle":"timed out",
+                    client_addr_format(client_address(client), ip,
+                                       sizeof(ip)));
+    }
+    close_client(server, client);
+}
+
+/* A request must be received and answered within header_timeout, however
+ * slowly its bytes trickle in; between requests, a persistent connection
+ * may stay idle for keepalive_timeout */
+static void set_deadline(struct Server *server, struct Client *client,
+                         bool idle)
+{
+    const struct Config *config = server->config;
+    client->idle = idle;
+    timer_schedule(&server->wheel, &client->deadline, timer_now_ms(),
+                   (uint64_t)(idle?config->keepalive_timeout
+                                  :config->header_timeout));
+}
+
+/* Takes a slot of the pool for a new connection, not added to the list yet.
+ * NULL if all are taken. */
+static struct Client *new_client(struct Server *server, int sock)
+{
+    struct Client *client = pool_get(&server->clients);
+    if(client == NULL)
+        return NULL;
+    memset(&client->addr, 0, sizeof(client->addr));
+    client->sock = sock;
+    client->server = server;
+    request_parser_init(&client->parser);
+    client->buffer_len = 0;
+    client->events = EV_READ;
+    client->closing = false;
+    client->limited = false;
+    client->requests = 0;
+    timer_init(&client->deadline, deadline_expired, client);
+    client->idle = false;
+    client->queued = client->out_index = client->out_count = 0;
+    client->page = NULL;
+    client->page_queued = false;
+    client->render = NULL;
+    client->rendered = 0;
+#ifdef ENABLE_IO_URING
+    client->fd = sock;
+    client->inflight = 0;
+    client->receiving = client->sending = false;
+    client->held_count = 0;
+    client->held_offset = 0;
+#endif
+    return client;
+}
+
+/* true if no more connections may be opened. They are refused rather than
+ * closing established ones: slots free up as deadlines expire. */
+static bool server_full(struct Server *server)
+{
+    /* Closed connections with io_uring requests in flight count too */
+    if(server->clients.count < server->clients.capacity)
+        return false;
+    STATS_INC(server->stats, refused);
+    return true;
+}
+
+/* Appends a new connection to the list and starts its header deadline */
+static void add_client(struct Server *server, struct Client *client)
+{
+    struct ClientList *list = &server->list;
+
+    set_deadline(server, client, false);
+    client->next = NULL;
+    client->prev = list->newest;
+    if(list->newest != NULL)
+        list->newest->next = client;
+    else
+        list->oldest = client;
+    list->newest = client;
+    ++list->count;
+}
+
+static void count_accepts(struct Stats *stats, unsigned long count)
+{
+    if(count == 0)
+        return;
+    STATS_INC(stats, wakeups);
+    STATS_ADD(stats, accepted, count);
+    STATS_MAX(stats, largest_batch, count);
+    if(count >= ACCEPT_BATCH_SIZE)
+        STATS_INC(stats, full_batches);
+}
+
+/* Counts a new connection against its client's rate limit. Returns -1 if it
+ * is to be closed at once, 1 if it is to be answered 429, 0 if it is
+ * served. */
+static int check_rate(struct Server *server, const struct ClientAddr *addr)
+{
+    int result = ratelimit_check(addr, timer_now_us());
+    if(result & RATELIMIT_ESTIMATED)
+        STATS_INC(server->stats, rate_estimated);
+    if(!(result & RATELIMIT_LIMITED))
+        return 0;
+    if(server->config->rate_drop)
+    {
+        STATS_INC(server->stats, rate_dropped);
+        return -1;
+    }
+    STATS_INC(server->stats, rate_limited);
+    return 1;
+}
+
+/* accept() returning a non-blocking socket, in a single system call where
+ * accept4() is available */
+static int accept_nonblocking(int serv_sock, struct sockaddr_storage *sin,
+                              socklen_t *size)
+{
+#ifdef SOCK_NONBLOCK
+    return accept4(serv_sock, (struct sockaddr*)sin, size,
+                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int sock = accept(serv_sock, (struct sockaddr*)sin, size);
+    if(sock != -1 && set_nonblocking(sock) == -1)
+    {
+        my_closesocket(sock);
+        return -1;
+    }
+    return sock;
+#endif
+}
+
+/* Accepts at most ACCEPT_BATCH_SIZE connections, so that a flood of new
+ * connections doesn't hold up established ones; the rest of the backlog is
+ * taken on the next iteration of the loop. Returns how many were. */
+static unsigned long accept_clients(struct Server *server,
+                                    struct Listener *listener)
+{
+    unsigned long accepted = 0;
+    int tries;
+
+    for(tries = 0; tries < ACCEPT_BATCH_SIZE; ++tries)
+    {
+        struct Client *client;
+        struct ClientAddr addr;
+        struct sockaddr_storage clientsin;
+        socklen_t size = sizeof(clientsin);
+        int limited = 0;
+        int sock = accept_nonblocking(listener->sock, &clientsin, &size);
+        if(sock == -1)
+        {
+#ifndef __WIN32__
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+#endif
+            if(!would_block())
+                log_message(LOG_LEVEL_ERROR, "Error: accept() failed: %s",
+                            strerror(errno));
+            break;
+        }
+
+        client_addr_from_sockaddr(&addr, &clientsin, size);
+        if(server->config->rate_limit > 0
+         && (limited = check_rate(server, &addr)) == -1)
+        {
+            my_closesocket(sock);
+            continue;
+        }
+        if(server_full(server))
+        {
+            my_closesocket(sock);
+            continue;
+        }
+        client = new_client(server, sock);
+        if(client == NULL
+         || event_add(server->loop, sock, EV_READ, client) == -1)
+        {
+            if(client != NULL)
+                pool_put(&server->clients, client);
+            my_closesocket(sock);
+            continue;
+        }
+        client->addr = addr;
+        client->limited = (limited == 1);
+        add_client(server, client);
+        ++accepted;
+    }
+
+    /* Edge-triggered: no new event comes for what is left */
+    listener->pending = (tries == ACCEPT_BATCH_SIZE);
+    if(listener->pending)
+        server->backlog_pending = true;
+    return accepted;
+}
+
+/* Sends a gathered list of segments in one system call, without raising
+ * SIGPIPE if the client is gone. Returns the number of bytes sent, or -1. */
+static long send_segments(int sock, Segment *segments, int count)
+{
+#ifdef __WIN32__
+    DWORD sent;
+    if(WSASend(sock, segments, (DWORD)count, &sent, 0, NULL, NULL) != 0)
+        return -1;
+    return (long)sent;
+#else
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = segments;
+    msg.msg_iovlen = count;
+    return (long)sendmsg(sock, &msg, MSG_NOSIGNAL);
+#endif
+}
+
+/* Sends what is left of the client's response. Returns 1 once everything is
+ * sent, 0 if the socket is full, -1 on error. */
+static int flush_client(struct Client *client)
+{
+    while(client->out_index < client->out_count)
+    {
+        long n = send_segments(client->sock, &client->out[client->out_index],
+                               client->out_count - client->out_index);
+        if(n < 0)
+        {
+            if(would_block())
+                return 0;
+#ifndef __WIN32__
+            if(errno == EINTR)
+                continue;
+#endif
+            return -1;
+        }
+        STATS_ADD(client->server->stats, bytes_out, (unsigned long)n);
+
+        /* Skip what was sent, possibly stopping in the middle of a segment */
+        while(n > 0 && client->out_index < client->out_count)
+        {
+            Segment *seg = &client->out[client->out_index];
+            if((size_t)n >= SEGMENT_LEN(*seg))
+            {
+                n -= (long)SEGMENT_LEN(*seg);
+                ++client->out_index;
+            }
+            else
+            {
+                SEGMENT_BASE(*seg) = (char*)SEGMENT_BASE(*seg) + n;
+                SEGMENT_LEN(*seg) -= n;
+                n = 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void add_segment(struct Client *client, const char *data, size_t size)
+{
+    if(size == 0)
+        return;
+    SEGMENT_BASE(client->out[client->out_count]) = (char*)data;
+    SEGMENT_LEN(client->out[client->out_count]) = size;
+    ++client->out_count;
+}
+
+/* Ends the headers of a response, depending on what happens next */
+static const char connection_close[] = "Connection: close\r\n\r\n";
+static const char connection_keep_alive[] = "Connection: keep-alive\r\n\r\n";
+static const char end_of_headers[] = "\r\n";
+
+/* Ends the headers of a response, depending on what happens next. HTTP/1.0
+ * clients are told explicitly that the connection stays open. */
+static void end_headers(struct Client *client, int version)
+{
+    if(client->closing)
+        add_segment(client, connection_close, sizeof(connection_close) - 1);
+    else if(version == 10)
+        add_segment(client, connection_keep_alive,
+                    sizeof(connection_keep_alive) - 1);
+    else
+        add_segment(client, end_of_headers, sizeof(end_of_headers) - 1);
+}
+
+/* Whether a template is rendered into a render buffer */
+static bool needs_render(const struct Template *response)
+{
+    return response->parts != NULL && !template_token_only(response);
+}
+
+/* Takes the buffer a response is rendered into, if it needs one and the
+ * client has none yet: it is held from the first response that needs one
+ * until the queue is sent. Returns false if they are all taken. */
+static bool take_render(struct Server *server, struct Client *client,
+                        const struct Template *response)
+{
+    if(!needs_render(response) || client->render != NULL)
+        return true;
+    if(server->renders.slab == NULL)
+        return false;
+    client->render = pool_get(&server->renders);
+    return client->render != NULL;
+}
+
+/* Renders the dynamic part of a template after that of the responses
+ * already queued, into the buffer route_request() took. build_responses()
+ * made sure a batch of them fits. */
+static void queue_rendered(struct Client *client,
+                           const struct Template *response,
+                           struct TemplateValue *values)
+{
+    const struct Request *req = &client->parser.request;
+    char address[CLIENT_ADDR_STRLEN];
+    char *out;
+    size_t size;
+
+    values[TEMPLATE_HOST].data = client->buffer + req->host.offset;
+    values[TEMPLATE_HOST].size = req->host.length;
+    values[TEMPLATE_PATH].data = client->buffer + req->target.offset;
+    values[TEMPLATE_PATH].size = req->target.length;
+    if(response->uses & (1u << TEMPLATE_CLIENT))
+    {
+        client_addr_format(client_address(client), address, sizeof(address));
+        values[TEMPLATE_CLIENT].data = address;
+        values[TEMPLATE_CLIENT].size = strlen(address);
+    }
+
+    out = client->render + client->rendered;
+    size = template_render(response, values, out);
+    client->rendered += size;
+    add_segment(client, out, size);
+}
+
+/* Queues a shared response after those already queued, with its own token
+ * and what it echoes of the request */
+static void queue_response(struct Server *server, struct Client *client,
+                           const struct Template *response,
+                           int version, bool with_body)
+{
+    char *token = client->tokens[client->queued++];
+    const struct TokenKey *key =
+        server->routing->signed_tokens?&server->routing->key:NULL;
+    struct TemplateValue values[TEMPLATE_VALUES];
+
+    /* The queue is empty while requests are answered: all of it comes from
+     * the same routing */
+    client->routing = server->routing;
+    add_segment(client, response->head, response->head_size);
+    if(response->uses & (1u << TEMPLATE_TOKEN))
+    {
+        if(key != NULL)
+        {
+            token_sign(key, client_address(client), time(NULL), token);
+            values[TEMPLATE_TOKEN].size = TOKEN_SIGNED_SIZE;
+        }
+        else
+        {
+            token_random(&server->rng, token);
+            values[TEMPLATE_TOKEN].size = TOKEN_RANDOM_SIZE;
+        }
+        values[TEMPLATE_TOKEN].data = token;
+    }
+    /* The built-in redirect: nothing to copy */
+    if(template_token_only(response))
+        add_segment(client, token, values[TEMPLATE_TOKEN].size);
+    else if(response->parts != NULL)
+        queue_rendered(client, response, values);
+    add_segment(client, response->tail, response->tail_size);
+    end_headers(client, version);
+    if(with_body)
+        add_segment(client, response->body, response->body_size);
+}
+
+static const char stats_head[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Cache-Control: no-store\r\n"
+    "Content-Length: ";
+
+/* Queues the stats page, rendered now unless an earlier response of the
+ * same batch already did. The token slot holds the Content-Length. */
+static void queue_stats(struct Client *client, int format,
+                        int version, bool with_body)
+{
+    char *length = client->tokens[client->queued++];
+
+    if(client->page == NULL)
+        client->page = malloc(STATS_BUFFER_SIZE);
+    if(client->page == NULL)
+        client->page_size = 0;
+    else if(!client->page_queued)
+    {
+        client->page_size = stats_format(client->page, STATS_BUFFER_SIZE,
+                                         format);
+        if(client->page_size >= STATS_BUFFER_SIZE)
+            client->page_size = STATS_BUFFER_SIZE - 1;
+        client->page_queued = true;
+    }
+
+    add_segment(client, stats_head, sizeof(stats_head) - 1);
+    add_segment(client, length,
+                (size_t)sprintf(length, "%lu\r\n",
+                                (unsigned long)client->page_size));
+    end_headers(client, version);
+    if(with_body)
+        add_segment(client, client->page, client->page_size);
+}
+
+/* true if the connection may stay open after this request: HTTP/1.1 unless
+ * the client sent "Connection: close", HTTP/1.0 only if it asked for it */
+static bool wants_keep_alive(const char *buffer, const struct Request *req)
+{
+    const char *p = buffer + req->connection.offset;
+    const char *end = p + req->connection.length;
+    bool keep_alive = req->version >= 11;
+
+    /* Connection is a comma-separated list of options */
+    while(p < end)
+    {
+        const char *comma = scan_find_byte(p, (size_t)(end - p), ',');
+        const char *option_end = (comma != NULL)?comma:end;
+        const char *next = (comma != NULL)?comma + 1:end;
+        size_t length;
+
+        while(p < option_end && (*p == ' ' || *p == '\t'))
+            ++p;
+        while(option_end > p && (option_end[-1] == ' ' || option_end[-1] == '\t'))
+            --option_end;
+        length = (size_t)(option_end - p);
+        if(length == 5 && scan_equals_lower(p, "close", 5))
+            return false;
+        if(length == 10 && scan_equals_lower(p, "keep-alive", 10))
+            keep_alive = true;
+        p = next;
+    }
+    return keep_alive;
+}
+
+/* Copies the request into the access log, which formats it in the
+ * background */
+static void log_request(struct Client *client, int status)
+{
+    const struct Request *req = &client->parser.request;
+    const char *buffer = client->buffer;
+
+    if(status == REQUEST_COMPLETE)
+        log_access(client_address(client), LOG_REQUEST_OK,
+                   buffer + req->method.offset, req->method.length,
+                   buffer + req->host.offset, req->host.length,
+                   buffer + req->path.offset, req->path.length);
+    else
+        log_access(client_address(client),
+                   (status == REQUEST_TOO_LARGE)?LOG_REQUEST_OVERSIZED
+                                                :LOG_REQUEST_MALFORMED,
+                   NULL, 0, NULL, 0, NULL, 0);
+}
+
+/* Whether the last segment of the request's path is a token signed for the
+ * client's address, recently enough */
+static bool has_signed_token(struct Server *server, struct Client *client)
+{
+    const struct Request *req = &client->parser.request;
+    const char *path = client->buffer + req->path.offset;
+    const char *end = path + req->path.length;
+    const char *token;
+
+    for(token = end; token > path && token[-1] != '/'; --token)
+        ;
+    return token_verify(&server->routing->key, client_address(client),
+                        token, (size_t)(end - token), time(NULL),
+                        SIGNED_TOKEN_TTL);
+}
+
+/* Picks the response to the request at the start of the client's buffer,
+ * given its REQUEST_* status */
+static const struct Template *route_request(struct Server *server,
+                                            struct Client *client,
+                                            int status)
+{
+    const struct Responses *r = &server->routing->responses;
+    const struct Request *req = &client->parser.request;
+    const struct Rule *rule;
+
+    if(status != REQUEST_COMPLETE)
+    {
+        STATS_INC(server->stats, errors);
+        return (status == REQUEST_BAD)?&r->bad_request:&r->too_large;
+    }
+    if(server->routing->signed_tokens && has_signed_token(server, client))
+    {
+        STATS_INC(server->stats, successes);
+        return &r->success;
+    }
+
+    rule = rules_lookup(server->routing->rules,
+                        client->buffer + req->host.offset, req->host.length,
+                        client->buffer + req->path.offset, req->path.length);
+    if(rule == NULL || rule->action == RULE_SUCCESS)
+    {
+        STATS_INC(server->stats, successes);
+        return &r->success;
+    }
+
+    /* 如果是 captive portal 的请求，检查是否存在cache中key为ip地址*/
+    if (rule->action == RULE_PORTAL
+     && cache_get(client_address(client), NULL, NULL) == 0) { // 如果缓存中存在值，直接返回缓存中的值
+        STATS_INC(server->stats, cache_hits);
+        STATS_INC(server->stats, successes);
+        return &r->success; // 发送success内容
+    }
+
+    /* Only rules' templates echo the request. Without a buffer for it the
+     * client retries later, before it was counted or granted anything. */
+    if(!take_render(server, client, &r->rules[rule->index]))
+    {
+        STATS_INC(server->stats, unavailable);
+        client->closing = true;
+        return &r->unavailable;
+    }
+
+    if (rule->action == RULE_PORTAL) {
+        STATS_INC(server->stats, cache_misses);
+        STATS_INC(server->stats, portal_redirects);
+        // 如果缓存中不存在值，定时在 grant_delay 后添加到缓存中
+        schedule_grant(server, client_address(client));
+    }
+    else
+        STATS_INC(server->stats, redirects);
+    return &r->rules[rule->index];
+}
+
+/* Whether a complete request is for the stats page */
+static bool is_stats_request(const struct Config *config,
+                             const struct Client *client)
+{
+    const struct Span path = client->parser.request.path;
+    return config->stats_path != NULL
+        && strlen(config->stats_path) == path.length
+        && memcmp(config->stats_path, client->buffer + path.offset,
+                  path.length) == 0;
+}
+
+/* Queues the responses to the complete requests at the start of the
+ * client's buffer, in order, and drops those requests from the buffer.
+ * Stops after PIPELINE_DEPTH responses, or after the last one that will be
+ * sent on this connection. */
+static void answer_requests(struct Server *server, struct Client *client)
+{
+    const struct Config *config = server->config;
+    const struct Request *req = &client->parser.request;
+
+    while(client->queued < PIPELINE_DEPTH && !client->closing)
+    {
+        int status = request_parse(&client->parser, client->buffer,
+                                   client->buffer_len, RECV_BUFFER_SIZE);
+        bool complete = (status == REQUEST_COMPLETE);
+        bool is_head;
+
+        if(status == REQUEST_INCOMPLETE)
+            return;
+        if(config->verbose)
+            log_request(client, status);
+
+        /* Request bodies are not read: only GET and HEAD leave the
+         * connection in a known state */
+        is_head = complete && span_equals(client->buffer, req->method, "head");
+        ++client->requests;
+        STATS_INC(server->stats, requests);
+        if(!complete || client->limited || config->keepalive_timeout == 0
+         || server->draining
+         || client->requests >= config->max_requests
+         || !(is_head || span_equals(client->buffer, req->method, "get"))
+         || !wants_keep_alive(client->buffer, req))
+            client->closing = true;
+
+        /* Neither routed nor looked up in the cache */
+        if(client->limited)
+            queue_response(server, client,
+                           &server->routing->responses.too_many,
+                           complete?req->version:11, !is_head);
+        else if(complete && is_stats_request(config, client))
+            queue_stats(client,
+                        span_equals(client->buffer, req->query,
+                                    "format=prometheus")
+                        ?STATS_PROMETHEUS:STATS_TEXT,
+                        req->version, !is_head);
+        else
+            queue_response(server, client,
+                           route_request(server, client, status),
+                           complete?req->version:11, !is_head);
+
+        if(complete)
+        {
+            /* The next request, if any, follows this one's head */
+            client->buffer_len -= req->head_size;
+            memmove(client->buffer, client->buffer + req->head_size,
+                    client->buffer_len);
+            request_parser_init(&client->parser);
+        }
+    }
+}
+
+/* Appends what the client sent to its buffer. Returns 1 if something was
+ * read, 0 if nothing is available yet, -1 if the client went away. */
+static int read_client(struct Client *client)
+{
+    for(;;)
+    {
+        int len = recv(client->sock, client->buffer + client->buffer_len,
+                       RECV_BUFFER_SIZE - client->buffer_len, 0);
+        if(len < 0 && would_block())
+            return 0;
+#ifndef __WIN32__
+        if(len < 0 && errno == EINTR)
+            continue;
+#endif
+        if(len <= 0)
+            return -1;
+        client->buffer_len += (size_t)len;
+        return 1;
+    }
+}
+
+/* Waits for the socket to become readable or writable (EV_READ or
+ * EV_WRITE) */
+static void wait_for(struct Server *server, struct Client *client,
+                     unsigned int events)
+{
+    if(client->events == events)
+        return;
+    client->events = events;
+    if(event_mod(server->loop, client->sock, events, client) == -1)
+        close_client(server, client);
+}
+
+static void handle_client(struct Server *server, struct Client *client)
+{
+    for(;;)
+    {
+        /* Send what is queued first, all of it in one system call */
+        if(client->out_count > 0)
+        {
+            switch(flush_client(client))
+            {
+            case 0:
+                /* Resume when the socket becomes writable again */
+                wait_for(server, client, EV_WRITE);
+                return;
+            case -1:
+                close_client(server, client);
+                return;
+            }
+            client->queued = client->out_index = client->out_count = 0;
+            client->page_queued = false;
+            release_render(server, client);
+            set_deadline(server, client, client->buffer_len == 0);
+        }
+        if(client->closing)
+        {
+            close_client(server, client);
+            return;
+        }
+
+        /* Pipelined requests that were already received */
+        answer_requests(server, client);
+        if(client->out_count > 0)
+            continue;
+
+        /* Edge-triggered: read until the socket would block */
+        switch(read_client(client))
+        {
+        case 1:
+            /* The start of the next request */
+            if(client->idle)
+                set_deadline(server, client, false);
+            break;
+        case 0:
+            wait_for(server, client, EV_READ);
+            return;
+        case -1:
+            close_client(server, client);
+            return;
+        }
+    }
+}
+
+#ifdef ENABLE_IO_URING
+/* Completion-based variant of the loop above: the listener and every
+ * connection have a multishot request armed (accept, recv into a provided
+ * buffer), responses are sent with one sendmsg request per batch. */
+
+static void arm_accept(struct Server *server, int index)
+{
+    struct io_uring_sqe *sqe = uring_request(server, NULL, OP_ACCEPT);
+    if(sqe == NULL)
+        return; /* retried on the next iteration */
+    sqe->user_data = accept_data(index);
+    uring_prep_accept_multishot(sqe, server->listeners[index].sock);
+    server->listeners[index].accepting = true;
+}
+
+static int arm_recv(struct Server *server, struct Client *client)
+{
+    struct io_uring_sqe *sqe = uring_request(server, client, OP_RECV);
+    if(sqe == NULL)
+        return -1;
+    uring_prep_recv_multishot(sqe, client->fd);
+    client->receiving = true;
+    return 0;
+}
+
+/* Copies held data into the client's buffer, as much as fits, and gives
+ * back the provided buffers that are done with. Returns the bytes copied. */
+static size_t take_held(struct Server *server, struct Client *client)
+{
+    size_t len = client->held_len[0] - client->held_offset;
+    size_t space = RECV_BUFFER_SIZE - client->buffer_len;
+    int i;
+
+    if(len > space)
+        len = space;
+    memcpy(client->buffer + client->buffer_len,
+           uring_buffer(server->ring, client->held[0]) + client->held_offset,
+           len);
+    client->buffer_len += len;
+    client->held_offset += len;
+    if(client->held_offset == client->held_len[0])
+    {
+        uring_recycle_buffer(server->ring, client->held[0]);
+        --client->held_count;
+        for(i = 0; i < client->held_count; ++i)
+        {
+            client->held[i] = client->held[i + 1];
+            client->held_len[i] = client->held_len[i + 1];
+        }
+        client->held_offset = 0;
+    }
+    return len;
+}
+
+static void send_queued(struct Server *server, struct Client *client)
+{
+    struct io_uring_sqe *sqe = uring_request(server, client, OP_SEND);
+    if(sqe == NULL)
+    {
+        close_client(server, client);
+        return;
+    }
+    memset(&client->msg, 0, sizeof(client->msg));
+    client->msg.msg_iov = client->out;
+    client->msg.msg_iovlen = client->out_count;
+    /* MSG_WAITALL: the kernel retries short sends itself */
+    uring_prep_sendmsg(sqe, client->fd, &client->msg,
+                       MSG_NOSIGNAL | MSG_WAITALL);
+    client->sending = true;
+    if(client->closing)
+    {
+        /* Closed once sent, or once the send failed */
+        sqe->flags |= IOSQE_IO_HARDLINK;
+        close_client(server, client);
+    }
+}
+
+/* Answers what was received, one batch of responses in flight at a time */
+static void uring_process(struct Server *server, struct Client *client)
+{
+    if(client->sending || client->sock == -1)
+        return;
+
+    for(;;)
+    {
+        answer_requests(server, client);
+        if(client->out_count > 0)
+        {
+            send_queued(server, client);
+            return;
+        }
+        if(client->held_count == 0 || take_held(server, client) == 0)
+            break;
+    }
+}
+
+static void uring_accepted(struct Server *server,
+                           const struct io_uring_cqe *cqe)
+{
+    struct Listener *listener =
+            &server->listeners[cqe->user_data & HANDLE_MASK];
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+        listener->accepting = false;
+
+    if(cqe->res >= 0)
+    {
+        struct Client *client;
+        struct ClientAddr addr;
+        int limited = 0;
+        if(server->config->rate_limit > 0 && !shutdown_flag)
+        {
+            /* Multishot accept doesn't return the address */
+            struct sockaddr_storage sin;
+            socklen_t size = sizeof(sin);
+            memset(&addr, 0, sizeof(addr));
+            if(getpeername(cqe->res, (struct sockaddr*)&sin, &size) == 0)
+                client_addr_from_sockaddr(&addr, &sin, size);
+            limited = check_rate(server, &addr);
+        }
+        if(shutdown_flag || limited == -1 || server_full(server))
+        {
+            close(cqe->res);
+            return;
+        }
+        client = new_client(server, cqe->res);
+        if(client == NULL)
+        {
+            close(cqe->res);
+            return;
+        }
+        if(server->config->rate_limit > 0)
+        {
+            client->addr = addr;
+            client->limited = (limited == 1);
+        }
+        add_client(server, client);
+        if(arm_recv(server, client) == -1)
+            close_client(server, client);
+    }
+    else if(cqe->res != -ECONNABORTED && cqe->res != -EINTR
+          && cqe->res != -ECANCELED)
+    {
+        log_message(LOG_LEVEL_ERROR, "Error: accept() failed: %s",
+                    strerror(-cqe->res));
+    }
+}
+
+static void uring_received(struct Server *server, struct Client *client,
+                           const struct io_uring_cqe *cqe)
+{
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+        client->receiving = false;
+
+    if(cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if(cqe->res <= 0 || client->sock == -1)
+        {
+            uring_recycle_buffer(server->ring, bid);
+        }
+        else if(client->held_count == HELD_BUFFERS)
+        {
+            /* Sends requests much faster than it reads the responses */
+            uring_recycle_buffer(server->ring, bid);
+            close_client(server, client);
+            return;
+        }
+        else
+        {
+            client->held[client->held_count] = bid;
+            client->held_len[client->held_count] = (size_t)cqe->res;
+            ++client->held_count;
+            if(client->idle)
+                set_deadline(server, client, false);
+            uring_process(server, client);
+        }
+    }
+
+    if(client->sock == -1)
+        return;
+    if(cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS))
+        close_client(server, client);
+    /* Out of provided buffers, or the kernel ended the multishot recv */
+    else if(!client->receiving && arm_recv(server, client) == -1)
+        close_client(server, client);
+}
+
+static void uring_sent(struct Server *server, struct Client *client,
+                       const struct io_uring_cqe *cqe)
+{
+    size_t total = 0;
+    int i;
+
+    client->sending = false;
+    /* Including the last responses of a connection closed meanwhile */
+    if(cqe->res > 0)
+        STATS_ADD(server->stats, bytes_out, (unsigned long)cqe->res);
+    if(client->sock == -1)
+        return;
+    for(i = 0; i < client->out_count; ++i)
+        total += SEGMENT_LEN(client->out[i]);
+    if(cqe->res < 0 || (size_t)cqe->res != total)
+    {
+        close_client(server, client);
+        return;
+    }
+    client->queued = client->out_index = client->out_count = 0;
+    client->page_queued = false;
+    release_render(server, client);
+    set_deadline(server, client,
+                 client->buffer_len == 0 && client->held_count == 0);
+    uring_process(server, client);
+}
+
+static void uring_completed(struct Server *server,
+                            const struct io_uring_cqe *cqe)
+{
+    int op = (int)(cqe->user_data >> OP_SHIFT);
+    struct Client *client;
+    struct ClientList *list = &server->list;
+
+    if(op == OP_ACCEPT)
+    {
+        uring_accepted(server, cqe);
+        return;
+    }
+    client = pool_resolve(&server->clients, cqe->user_data & HANDLE_MASK);
+    if(client == NULL)
+    {
+        /* Can't happen: slots are only released once nothing is in flight */
+        if(cqe->flags & IORING_CQE_F_BUFFER)
+            uring_recycle_buffer(server->ring,
+                                 cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        return;
+    }
+
+    switch(op)
+    {
+    case OP_RECV:
+        uring_received(server, client, cqe);
+        break;
+    case OP_SEND:
+        uring_sent(server, client, cqe);
+        break;
+    }
+
+    /* Multishot requests go on after a completion flagged F_MORE */
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+        --client->inflight;
+    if(client->sock != -1 || client->inflight > 0)
+        return;
+
+    if(client->prev != NULL)
+        client->prev->next = client->next;
+    else
+        list->zombies = client->next;
+    if(client->next != NULL)
+        client->next->prev = client->prev;
+    free_client(server, client);
+}
+
+/* Submits what was queued, waits for completions and handles them.
+ * Returns -1 on failure. */
+static int handle_completions(struct Server *server, int timeout)
+{
+    struct io_uring_cqe *cqe;
+    unsigned long accepted = 0;
+    int l;
+
+    for(l = 0; l < server->listener_count; ++l)
+        if(!server->listeners[l].accepting && !shutdown_flag
+         && !server->draining)
+            arm_accept(server, l);
+    if(uring_submit_and_wait(server->ring, timeout) == -1)
+    {
+        log_message(LOG_LEVEL_ERROR, "Error: waiting for completions failed: "
+                    "%s", strerror(errno));
+        return -1;
+    }
+    while((cqe = uring_peek_cqe(server->ring)) != NULL)
+    {
+        /* Handling it may submit requests, and complete others */
+        struct io_uring_cqe copy = *cqe;
+        uring_cqe_seen(server->ring);
+        if((copy.user_data >> OP_SHIFT) == OP_ACCEPT && copy.res >= 0)
+            ++accepted;
+        uring_completed(server, &copy);
+    }
+    count_accepts(server->stats, accepted);
+    return 0;
+}
+
+/* Sets up io_uring for a worker; NULL if unavailable */
+static struct Uring *start_uring(const struct Worker *worker)
+{
+    struct Uring *ring = malloc(sizeof(struct Uring));
+    if(ring != NULL
+     && uring_init(ring, URING_ENTRIES, URING_BUFFERS, RECV_BUFFER_SIZE) == 0)
+    {
+        if(worker->index == 0)
+            log_message(LOG_LEVEL_INFO, "Using io_uring");
+        return ring;
+    }
+    if(worker->index == 0)
+        log_message(LOG_LEVEL_INFO, "io_uring is unavailable (%s), using %s",
+                    strerror((ring != NULL)?errno:ENOMEM),
+                    event_loop_backend());
+    free(ring);
+    return NULL;
+}
+
+/* Once every connection is closed: lets the closes complete, briefly, then
+ * tears the ring down (which cancels what is left) */
+static void stop_uring(struct Server *server)
+{
+    struct ClientList *list = &server->list;
+    int i;
+
+    for(i = 0; i < 10 && list->zombies != NULL; ++i)
+        if(handle_completions(server, 100) == -1)
+            break;
+    uring_free(server->ring);
+    free(server->ring);
+    server->ring = NULL;
+    while(list->zombies != NULL)
+    {
+        struct Client *next = list->zombies->next;
+        free_client(server, list->zombies);
+        list->zombies = next;
+    }
+}
+#endif
+
+/* Whether a queued response of the worker's connections points into
+ * routing */
+static bool routing_in_use(const struct Server *server,
+                           const struct Routing *routing)
+{
+    const struct Client *client;
+
+    for(client = server->list.oldest; client != NULL; client = client->next)
+        if(client->out_count > 0 && client->routing == routing)
+            return true;
+#ifdef ENABLE_IO_URING
+    /* Closed with a send possibly in flight */
+    for(client = server->list.zombies; client != NULL; client = client->next)
+        if(client->out_count > 0 && client->routing == routing)
+            return true;
+#endif
+    return false;
+}
+
+/* Lets go of the previous routing once nothing points into it anymore */
+static void check_retired(struct Timer *timer)
+{
+    struct Server *server = timer->data;
+
+    if(routing_in_use(server, server->retired))
+    {
+        timer_schedule(&server->wheel, timer, timer_now_ms(), 100);
+        return;
+    }
+    release_routing(server->retired);
+    server->retired = NULL;
+}
+
+/* Allocates the render buffers once a template of routing needs them.
+ * Returns 0, or -1 if out of memory. */
+static int prepare_renders(struct Server *server,
+                           const struct Routing *routing)
+{
+    uint32_t count = RENDER_BUFFERS;
+    if(server->renders.slab != NULL || !routing->responses.rendered)
+        return 0;
+    if((long)count > server->config->max_connections)
+        count = (uint32_t)server->config->max_connections;
+    return pool_init(&server->renders, RENDER_BUFFER_SIZE, count);
+}
+
+/* Moves to a reloaded routing, once done with the one before the current.
+ * One that needs render buffers there's no memory for is refused, and
+ * tried again a second later. */
+static void update_routing(struct Server *server)
+{
+    struct Routing *routing;
+    uint64_t now;
+
+    if(__atomic_load_n(&routing_generation, __ATOMIC_ACQUIRE)
+       == server->routing->generation || server->retired != NULL)
+        return;
+    now = timer_now_ms();
+    if(now < server->reload_retry)
+        return;
+    routing = acquire_routing();
+    if(prepare_renders(server, routing) != 0)
+    {
+        if(server->reload_retry == 0)
+            log_message(LOG_LEVEL_WARNING, "Out of memory for render "
+                        "buffers, keeping the previous rules until there "
+                        "is enough");
+        server->reload_retry = now + 1000;
+        release_routing(routing);
+        return;
+    }
+    server->reload_retry = 0;
+    server->retired = server->routing;
+    server->routing = routing;
+    timer_schedule(&server->wheel, &server->retired_timer, now, 0);
+}
+
+/* A new server took over the listening sockets: stops accepting, closes the
+ * idle connections and answers the others one last time */
+static void start_draining(struct Server *server)
+{
+    struct Client *client, *next;
+    int l;
+
+    server->draining = true;
+    server->backlog_pending = false;
+    for(l = 0; l < server->listener_count; ++l)
+    {
+        struct Listener *listener = &server->listeners[l];
+        listener->pending = false;
+#ifdef ENABLE_IO_URING
+        if(server->ring != NULL)
+        {
+            struct io_uring_sqe *sqe;
+            if(listener->accepting
+             && (sqe = uring_request(server, NULL, OP_CANCEL)) != NULL)
+                uring_prep_cancel(sqe, accept_data(l));
+        }
+        else
+#endif
+        event_del(server->loop, listener->sock);
+    }
+
+    for(client = server->list.oldest; client != NULL; client = next)
+    {
+        next = client->next;
+        if(client->idle && client->out_count == 0)
+            close_client(server, client);
+    }
+    if(server->list.count > 0)
+        log_message(LOG_LEVEL_INFO, "Finishing %lu connections",
+                    (unsigned long)server->list.count);
+}
+
+/* Whether draining is over: no connection left, none being accepted */
+static bool drained(const struct Server *server)
+{
+    int l;
+
+    if(!server->draining || server->list.count > 0)
+        return false;
+#ifdef ENABLE_IO_URING
+    /* Connections accepted before the cancellation are still answered */
+    for(l = 0; l < server->listener_count; ++l)
+        if(server->ring != NULL && server->listeners[l].accepting)
+            return false;
+#else
+    (void)l;
+#endif
+    return true;
+}
+
+/* The listener an event is for, NULL if it is for a connection */
+static struct Listener *event_listener(struct Server *server, void *data)
+{
+    uintptr_t p = (uintptr_t)data;
+    if(p < (uintptr_t)server->listeners
+     || p >= (uintptr_t)(server->listeners + server->listener_count))
+        return NULL;
+    return data;
+}
+
+/* Waits for socket events and handles them. Returns -1 on failure. */
+static int handle_events(struct Server *server, struct Event *events,
+                         int timeout)
+{
+    unsigned long accepted = 0;
+    int n, i;
+
+    n = event_wait(server->loop, events, EVENT_BATCH_SIZE, timeout);
+    if(n == -1)
+    {
+        log_message(LOG_LEVEL_ERROR, "Error: waiting for events failed: %s",
+                    strerror(errno));
+        return -1;
+    }
+
+    if (shutdown_flag) {
+        return 0; // Exit loop if shutdown_flag is set
+    }
+
+    /* Connections already established first, then new ones */
+    for(i = 0; i < n; ++i)
+    {
+        struct Listener *listener = event_listener(server, events[i].data);
+        struct Client *client = events[i].data;
+        if(listener != NULL)
+            listener->pending = true;
+        else if(client->sock != -1)
+            handle_client(server, client);
+    }
+    server->backlog_pending = false;
+    for(i = 0; i < server->listener_count; ++i)
+        if(server->listeners[i].pending)
+            accepted += accept_clients(server, &server->listeners[i]);
+    count_accepts(server->stats, accepted);
+    return 0;
+}
+
+int serve(struct Worker *worker)
+{
+    struct Server *server;
+    struct Timer *timer;
+    struct Event events[EVENT_BATCH_SIZE];
+    int i;
+
+    /* Too big for some thread stacks because of the timer wheel */
+    server = malloc(sizeof(struct Server));
+    if(server == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        return 3;
+    }
+    if(worker->cpu != -1 && listener_pin(worker->cpu) != 0)
+        log_message(LOG_LEVEL_WARNING, "Can't pin worker %d to CPU %d",
+                    worker->index, worker->cpu);
+    server->config = worker->config;
+    server->listener_count = worker->listener_count;
+    for(i = 0; i < server->listener_count; ++i)
+    {
+        server->listeners[i].sock = worker->serv_socks[i];
+#ifdef ENABLE_IO_URING
+        server->listeners[i].accepting = false;
+#endif
+        server->listeners[i].pending = false;
+    }
+    server->list.oldest = server->list.newest = server->list.closed = NULL;
+    server->list.count = 0;
+    server->routing = acquire_routing();
+    server->retired = NULL;
+    server->reload_retry = 0;
+    server->loop = NULL;
+    server->backlog_pending = false;
+    server->draining = false;
+    server->stats = stats_worker(worker->index);
+    /* Without an entropy source, tokens are still different per thread */
+    token_rng_seed(&server->rng);
+    /* Every connection's state, buffers included, in one allocation */
+    if(pool_init(&server->clients, sizeof(struct Client),
+                 (uint32_t)server->config->max_connections) != 0)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        release_routing(server->routing);
+        free(server);
+        return 3;
+    }
+    /* Only if a template echoes the request */
+    memset(&server->renders, 0, sizeof(server->renders));
+    if(prepare_renders(server, server->routing) != 0)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        pool_destroy(&server->clients);
+        release_routing(server->routing);
+        free(server);
+        return 3;
+    }
+    /* At most one pending grant per client; enough for the clients of the
+     * connections without calling malloc(), those beyond take longer */
+    memset(server->pending_grants, 0, sizeof(server->pending_grants));
+    server->grant_warned = 0;
+    if(pool_init(&server->grants, sizeof(struct Grant),
+                 (uint32_t)server->config->max_connections) != 0)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        pool_destroy(&server->renders);
+        pool_destroy(&server->clients);
+        release_routing(server->routing);
+        free(server);
+        return 3;
+    }
+
+#ifdef ENABLE_IO_URING
+    server->list.zombies = NULL;
+    server->ring = worker->config->io_uring?start_uring(worker):NULL;
+    if(server->ring == NULL)
+#endif
+    {
+        server->loop = event_loop_new((size_t)server->config->max_connections
+                                      + (size_t)server->listener_count);
+        for(i = 0; server->loop != NULL && i < server->listener_count; ++i)
+        {
+            struct Listener *listener = &server->listeners[i];
+            if(set_nonblocking(listener->sock) == -1
+             || event_add(server->loop, listener->sock, EV_READ,
+                          listener) == -1)
+                break;
+        }
+        if(server->loop == NULL || i < server->listener_count)
+        {
+            perror("Error: can't set up the event loop");
+            event_loop_free(server->loop);
+            pool_destroy(&server->grants);
+            pool_destroy(&server->renders);
+            pool_destroy(&server->clients);
+            release_routing(server->routing);
+            free(server);
+            return 3;
+        }
+    }
+
+    timer_wheel_init(&server->wheel, timer_now_ms());
+    /* The cache is shared: one worker sweeping it is enough */
+    timer_init(&server->expire_timer, expire_cache, server);
+    if(worker->index == 0)
+        timer_schedule(&server->wheel, &server->expire_timer,
+                       timer_now_ms(), 1000);
+    timer_init(&server->retired_timer, check_retired, server);
+
+    while(!shutdown_flag) // Check shutdown_flag
+    {
+        /* Signals are handled by worker 0, the main thread */
+        if(worker->index == 0 && reload_flag)
+        {
+            reload_flag = 0;
+            reload_routing(server->config);
+        }
+        update_routing(server);
+        if(handover_completed() && !server->draining)
+            start_draining(server);
+        if(drained(server))
+            break;
+
+        // Wake up for the next timer, and at least every second to check
+        // shutdown_flag
+        int timeout = timer_wheel_timeout(&server->wheel, timer_now_ms(),
+                                          1000);
+
+#ifdef ENABLE_IO_URING
+        if(server->ring != NULL)
+        {
+            if(handle_completions(server, timeout) == -1)
+                break;
+        }
+        else
+#endif
+        if(handle_events(server, events,
+                         server->backlog_pending?0:timeout) == -1)
+            break;
+
+        timer_wheel_advance(&server->wheel, timer_now_ms());
+
+        /* Including those closed by timers, so that their slots are free
+         * for the next batch of connections */
+        while(server->list.closed != NULL)
+        {
+            struct Client *next = server->list.closed->next;
+            free_client(server, server->list.closed);
+            server->list.closed = next;
+        }
+    }
+
+    // Cleanup connections before exiting
+    while(server->list.oldest != NULL)
+        close_client(server, server->list.oldest);
+#ifdef ENABLE_IO_URING
+    if(server->ring != NULL)
+        stop_uring(server);
+#endif
+    while(server->list.closed != NULL)
+    {
+        struct Client *next = server->list.closed->next;
+        free_client(server, server->list.closed);
+        server->list.closed = next;
+    }
+    /* Pending grants are dropped, those of the pool freed with it */
+    while((timer = timer_wheel_pop(&server->wheel)) != NULL)
+        if(timer->callback == grant_expired && !((struct Grant*)timer)->pooled)
+            free(timer);
+    if(server->retired != NULL)
+        release_routing(server->retired);
+    release_routing(server->routing);
+    if(server->loop != NULL)
+    {
+        for(i = 0; i < server->listener_count; ++i)
+            event_del(server->loop, server->listeners[i].sock);
+        event_loop_free(server->loop);
     }
 
-    free(response_data);
-    free(success_response_data);
-    free(apple_response_data); // Free apple_response_data
-    fprintf(stderr, "Exiting serve loop\n");
+    if(server->stats->wakeups > 0)
+        log_message(LOG_LEVEL_INFO, "Worker %d accepted %lu connections in "
+                    "%lu wakeups (%.1f per wakeup, at most %lu, %lu full "
+                    "batches)", worker->index,
+                    (unsigned long)server->stats->accepted,
+                    (unsigned long)server->stats->wakeups,
+                    (double)server->stats->accepted / server->stats->wakeups,
+                    (unsigned long)server->stats->largest_batch,
+                    (unsigned long)server->stats->full_batches);
+    log_message(LOG_LEVEL_INFO, "Worker %d closed %lu connections on header "
+                "timeout and %lu idle ones, refused %lu", worker->index,
+                (unsigned long)server->stats->header_timeouts,
+                (unsigned long)server->stats->idle_timeouts,
+                (unsigned long)server->stats->refused);
+    pool_destroy(&server->grants);
+    pool_destroy(&server->renders);
+    pool_destroy(&server->clients);
+    free(server);
+    log_message(LOG_LEVEL_INFO, "Exiting serve loop");
     return 0;
 }
@@ -0,0 +1,493 @@
+#ifndef __WIN32__
+    #define _GNU_SOURCE /* CPU_SET(), pthread_setaffinity_np() */
+#endif
+
+#include "listener.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __WIN32__
+    #define _WIN32_WINNT 0x0501 /* needed for getaddrinfo(); means WinXP */
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+
+    typedef int socklen_t;
+#else
+    #include <fcntl.h>
+    #include <netdb.h>
+    #include <unistd.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <sys/socket.h>
+    #include <sys/types.h>
+#endif
+#ifdef __linux__
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+#include "log.h"
+
+/* Parses "<name>=<n>" in [min, max] */
+static int parse_option(const char *option, const char *name, long min,
+                        long max, long *result)
+{
+    size_t length = strlen(name);
+    char *end;
+    long value;
+
+    if(strncmp(option, name, length) != 0 || option[length] != '=')
+        return -1;
+    errno = 0;
+    value = strtol(option + length + 1, &end, 10);
+    if(errno != 0 || end == option + length + 1 || *end != '\0'
+     || value < min || value > max)
+    {
+        fprintf(stderr, "Error: --listen: %s expects a number between %ld "
+                "and %ld\n", name, min, max);
+        return -2;
+    }
+    *result = value;
+    return 0;
+}
+
+int listener_parse(struct ListenerConfig *config, char *spec)
+{
+    char *options = strchr(spec, ',');
+    char *colon;
+    bool available = true;
+
+    memset(config, 0, sizeof(*config));
+    if(options != NULL)
+        *options++ = '\0';
+
+    /* [v6 address]:port, address:port or port */
+    if(spec[0] == '[')
+    {
+        char *end = strchr(spec, ']');
+        if(end == NULL || end[1] != ':')
+        {
+            fprintf(stderr, "Error: --listen: expected [address]:port\n");
+            return -1;
+        }
+        *end = '\0';
+        config->addr = spec + 1;
+        config->port = end + 2;
+    }
+    else if((colon = strrchr(spec, ':')) != NULL)
+    {
+        if(strchr(spec, ':') != colon)
+        {
+            fprintf(stderr, "Error: --listen: IPv6 addresses are written "
+                    "[address]:port\n");
+            return -1;
+        }
+        *colon = '\0';
+        config->addr = (strcmp(spec, "*") == 0)?NULL:spec;
+        config->port = colon + 1;
+    }
+    else
+        config->port = spec;
+    if(config->port[0] == '\0' || (config->addr != NULL
+                                   && config->addr[0] == '\0'))
+    {
+        fprintf(stderr, "Error: --listen: expected [address:]port\n");
+        return -1;
+    }
+
+    while(options != NULL)
+    {
+        char *option = options;
+        int ret;
+
+        options = strchr(option, ',');
+        if(options != NULL)
+            *options++ = '\0';
+
+        if(strcmp(option, "incoming-cpu") == 0)
+        {
+            config->incoming_cpu = true;
+#if !defined(SO_INCOMING_CPU) || !defined(__linux__)
+            available = false;
+#endif
+        }
+        else if((ret = parse_option(option, "backlog", 1, 65535,
+                                    &config->backlog)) != -1)
+        {
+            if(ret != 0)
+                return -1;
+        }
+        else if((ret = parse_option(option, "defer-accept", 1, 3600,
+                                    &config->defer_accept)) != -1)
+        {
+            if(ret != 0)
+                return -1;
+#ifndef TCP_DEFER_ACCEPT
+            available = false;
+#endif
+        }
+        else if((ret = parse_option(option, "fastopen", 1, 65535,
+                                    &config->fastopen)) != -1)
+        {
+            if(ret != 0)
+                return -1;
+#ifndef TCP_FASTOPEN
+            available = false;
+#endif
+        }
+        else
+        {
+            fprintf(stderr, "Error: --listen: unknown option %s, expected "
+                    "backlog=<n>, defer-accept=<s>, fastopen=<n> or "
+                    "incoming-cpu\n", option);
+            return -1;
+        }
+        if(!available)
+        {
+            fprintf(stderr, "Error: --listen: %s is not available on this "
+                    "system\n", option);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Applies the listener's options to a socket, before bind() */
+static int tune_socket(const struct ListenerConfig *config, int sock,
+                       int family, bool v6only, bool shared, int index)
+{
+    int on = 1;
+
+#ifndef __WIN32__
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+#endif
+#ifdef SO_REUSEPORT
+    if(shared && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                            &on, sizeof(on)) == -1)
+        return -1;
+#else
+    (void)shared;
+#endif
+#ifdef IPV6_V6ONLY
+    /* The IPv4 address has a socket of its own */
+    if(family == AF_INET6 && v6only
+     && setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY,
+                   (const char*)&on, sizeof(on)) == -1)
+        return -1;
+#else
+    (void)family;
+    (void)v6only;
+#endif
+#ifdef TCP_DEFER_ACCEPT
+    if(config->defer_accept > 0)
+    {
+        int seconds = (int)config->defer_accept;
+        if(setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                      &seconds, sizeof(seconds)) == -1)
+            return -1;
+    }
+#endif
+#ifdef TCP_FASTOPEN
+    if(config->fastopen > 0)
+    {
+        int queue = (int)config->fastopen;
+        if(setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+                      (const char*)&queue, sizeof(queue)) == -1)
+            return -1;
+    }
+#endif
+#if defined(SO_INCOMING_CPU) && defined(__linux__)
+    if(config->incoming_cpu)
+    {
+        int cpu = listener_cpu(index);
+        if(setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU,
+                      &cpu, sizeof(cpu)) == -1)
+            return -1;
+    }
+#else
+    (void)index;
+#endif
+    (void)on;
+    return 0;
+}
+
+/* Errors that only rule one of the addresses out: IPv6 missing or disabled
+ * (socket() or bind() to ::), or an option its protocol lacks */
+static bool unusable(int error)
+{
+#ifdef __WIN32__
+    (void)error;
+    return false;
+#else
+    return error == EADDRNOTAVAIL || error == EAFNOSUPPORT
+        || error == ENOPROTOOPT;
+#endif
+}
+
+/* Closes the sockets of socks from index first on */
+static void close_from(int *socks, int *count, int first)
+{
+    while(*count > first)
+        listener_close(socks[--*count]);
+}
+
+int listener_open(const struct ListenerConfig *config, int workers,
+                  int *socks, int *count, int max)
+{
+    int ret, start = *count, opened = 0;
+    bool has_v4 = false;
+    struct addrinfo hints, *results, *rp;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    ret = getaddrinfo(config->addr, config->port, &hints, &results);
+    if(ret != 0)
+    {
+        fprintf(stderr, "Error: can't resolve %s:%s: %s\n",
+                (config->addr == NULL)?"*":config->addr, config->port,
+                gai_strerror(ret));
+        return 1;
+    }
+
+#ifndef SO_REUSEPORT
+    if(workers > 1)
+    {
+        fprintf(stderr, "Error: SO_REUSEPORT is not available\n");
+        freeaddrinfo(results);
+        return 2;
+    }
+#endif
+
+    /* Both IPv4 and IPv6 (all addresses, or a name with both): each gets its
+     * own sockets, rather than relying on IPv4-mapped addresses */
+    for(rp = results; rp != NULL; rp = rp->ai_next)
+        if(rp->ai_family == AF_INET)
+            has_v4 = true;
+
+    for(rp = results; rp != NULL; rp = rp->ai_next)
+    {
+        int first = *count, i;
+        for(i = 0; i < workers; ++i)
+        {
+            int sock, error;
+            if(*count == max)
+            {
+                fprintf(stderr, "Error: more than %d listening sockets\n",
+                        max);
+                close_from(socks, count, start);
+                freeaddrinfo(results);
+                return 2;
+            }
+            sock = (int)socket(rp->ai_family, rp->ai_socktype,
+                               rp->ai_protocol);
+            if(sock != -1
+             && tune_socket(config, sock, rp->ai_family, has_v4, workers > 1,
+                            i) == 0
+             && bind(sock, rp->ai_addr, rp->ai_addrlen) == 0
+             && listen(sock, (int)config->backlog) == 0)
+            {
+                socks[(*count)++] = sock;
+                continue;
+            }
+
+            error = errno;
+            if(sock != -1)
+                listener_close(sock);
+            if(unusable(error))
+            {
+                /* The other addresses may do */
+                log_message(LOG_LEVEL_WARNING, "Not listening on %s:%s over "
+                            "IPv%d: %s",
+                            (config->addr == NULL)?"*":config->addr,
+                            config->port, (rp->ai_family == AF_INET6)?6:4,
+                            strerror(error));
+                close_from(socks, count, first);
+                break;
+            }
+            fprintf(stderr, "Error: can't listen on %s:%s: %s\n",
+                    (config->addr == NULL)?"*":config->addr, config->port,
+                    strerror(error));
+            close_from(socks, count, start);
+            freeaddrinfo(results);
+            return 2;
+        }
+        opened += *count - first;
+    }
+    freeaddrinfo(results);
+
+    if(opened == 0)
+    {
+        fprintf(stderr, "Error: no address to listen on for %s:%s\n",
+                (config->addr == NULL)?"*":config->addr, config->port);
+        return 2;
+    }
+    return 0;
+}
+
+/* Groups sockets by local address: group[i] is the index of the first
+ * socket with the address of socket i. NULL if out of memory. */
+static int *group_sockets(const int *socks, int count)
+{
+    struct sockaddr_storage *names;
+    socklen_t *sizes;
+    int *group;
+    int i, j;
+
+    names = malloc(sizeof(*names) * (size_t)(count + 1));
+    sizes = malloc(sizeof(*sizes) * (size_t)(count + 1));
+    group = malloc(sizeof(*group) * (size_t)(count + 1));
+    if(names == NULL || sizes == NULL || group == NULL)
+    {
+        free(names);
+        free(sizes);
+        free(group);
+        return NULL;
+    }
+    for(i = 0; i < count; ++i)
+    {
+        sizes[i] = sizeof(names[i]);
+        if(getsockname(socks[i], (struct sockaddr*)&names[i], &sizes[i]) == -1)
+            sizes[i] = 0;
+        /* An unknown address is a group of its own */
+        for(j = 0; j < i; ++j)
+            if(sizes[i] != 0 && sizes[j] == sizes[i]
+             && memcmp(&names[j], &names[i], (size_t)sizes[i]) == 0)
+                break;
+        group[i] = (j < i)?group[j]:i;
+    }
+    free(names);
+    free(sizes);
+    return group;
+}
+
+int listener_assign(const int *socks, int count, int worker, int *out)
+{
+    int *group = group_sockets(socks, count);
+    int stored = 0, i, j;
+
+    if(group == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+    for(i = 0; i < count; ++i)
+    {
+        int size = 0, skip;
+        if(group[i] != i)
+            continue;
+        if(stored == MAX_LISTENERS)
+        {
+            fprintf(stderr, "Error: listening on more than %d addresses\n",
+                    MAX_LISTENERS);
+            free(group);
+            return -1;
+        }
+        for(j = i; j < count; ++j)
+            if(group[j] == i)
+                ++size;
+        /* The worker-th socket of the group, modulo its size */
+        skip = worker % size;
+        for(j = i; j < count; ++j)
+            if(group[j] == i && skip-- == 0)
+                break;
+        out[stored++] = socks[j];
+    }
+    free(group);
+    return stored;
+}
+
+int listener_workers(const int *socks, int count)
+{
+    int *group = group_sockets(socks, count);
+    int largest = 1, i, j;
+
+    if(group == NULL)
+        return 1;
+    for(i = 0; i < count; ++i)
+    {
+        int size = 0;
+        if(group[i] != i)
+            continue;
+        for(j = i; j < count; ++j)
+            if(group[j] == i)
+                ++size;
+        if(size > largest)
+            largest = size;
+    }
+    free(group);
+    return largest;
+}
+
+#ifdef __linux__
+
+int listener_cpu(int worker)
+{
+    cpu_set_t set;
+    int cpus, cpu, n;
+
+    /* The CPUs the process may run on, in order */
+    if(sched_getaffinity(0, sizeof(set), &set) == -1
+     || (cpus = CPU_COUNT(&set)) == 0)
+        return worker;
+    n = worker % cpus;
+    for(cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if(CPU_ISSET(cpu, &set) && n-- == 0)
+            return cpu;
+    return worker;
+}
+
+bool listener_steered(int sock)
+{
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t size = sizeof(cpu);
+    return getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &size) == 0
+        && cpu >= 0;
+#else
+    (void)sock;
+    return false;
+#endif
+}
+
+int listener_pin(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+           ?0:-1;
+}
+
+#else
+
+int listener_cpu(int worker)
+{
+    return worker;
+}
+
+bool listener_steered(int sock)
+{
+    (void)sock;
+    return false;
+}
+
+int listener_pin(int cpu)
+{
+    (void)cpu;
+    return -1;
+}
+
+#endif
+
+void listener_close(int sock)
+{
+#ifdef __WIN32__
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+}
@@ -0,0 +1,71 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+/* Listening sockets.
+ *
+ * A listener is given as "[address:]port" followed by comma-separated
+ * options; without an address it listens on every IPv4 and IPv6 address.
+ * Each address it resolves to gets one socket per worker, sharing the port
+ * with SO_REUSEPORT: the kernel spreads connections between the workers,
+ * each of which accepts on one socket of every address. Options tune how
+ * connections are set up, per listener:
+ *     backlog=<n>       connections waiting to be accepted
+ *     defer-accept=<s>  don't report a connection until its first bytes
+ *                       arrive, for up to s seconds (TCP_DEFER_ACCEPT)
+ *     fastopen=<n>      accept data in the SYN (TCP Fast Open), with at
+ *                       most n such connections pending
+ *     incoming-cpu      hand a connection to the worker running on the CPU
+ *                       that received it (SO_INCOMING_CPU); workers are then
+ *                       pinned to a CPU each
+ * Options not supported by the system are refused. */
+
+#include <stdbool.h>
+
+#define MAX_LISTENERS 16
+
+struct ListenerConfig {
+    const char *addr;   /* NULL for every address */
+    const char *port;
+    long backlog;       /* 0 for the default */
+    long defer_accept;  /* s, 0 for none */
+    long fastopen;      /* queue length, 0 for none */
+    bool incoming_cpu;
+};
+
+/* Parses spec into config. The strings of config point into spec, which is
+ * modified. Returns 0, or -1 after printing an error. */
+int listener_parse(struct ListenerConfig *config, char *spec);
+
+/* Opens the sockets of a listener for workers workers, appended to socks
+ * (*count of them, at most max). An address the system can't listen on (IPv6
+ * disabled, an option its protocol lacks) is skipped with a warning. Returns
+ * 0, or the exit code after printing an error and closing the sockets it
+ * opened: 1 for a bad address, 2 if none can be used. */
+int listener_open(const struct ListenerConfig *config, int workers,
+                  int *socks, int *count, int max);
+
+/* Listening sockets of a worker: one per local address among socks, the
+ * worker-th of those sharing it (modulo their number). Returns how many
+ * were stored in out (at most MAX_LISTENERS), or -1 after printing an
+ * error. */
+int listener_assign(const int *socks, int count, int worker, int *out);
+
+/* The most sockets sharing a local address: with fewer workers, some
+ * sockets would have no one to accept their connections */
+int listener_workers(const int *socks, int count);
+
+/* CPU of a worker, when listeners use incoming-cpu */
+int listener_cpu(int worker);
+
+/* Whether a socket has a CPU set with incoming-cpu (by this server, or the
+ * one it took over from) */
+bool listener_steered(int sock);
+
+/* Pins the calling thread to a CPU. Returns 0, or -1. */
+int listener_pin(int cpu);
+
+/* A listening socket may be shared with another process (systemd, or a
+ * server taking over from this one): it is closed, never shut down */
+void listener_close(int sock);
+
+#endif /* LISTENER_H */
@@ -0,0 +1,491 @@
+#include "log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef __WIN32__
+    #include <pthread.h>
+#endif
+
+/* Records are fixed-size slots; longer messages are truncated */
+#define LOG_RECORD_SIZE 256
+#define LOG_RING_RECORDS 4096   /* per thread (1 MB), a power of two */
+
+/* s the idle writer waits at most, in case a wakeup was missed */
+#define LOG_IDLE_WAIT 1
+
+/* Record kinds other than message levels */
+#define LOG_KIND_ACCESS 0xff
+
+struct LogRecord {
+    uint16_t kind;          /* LOG_LEVEL_* of a message, or LOG_KIND_ACCESS */
+    uint16_t length;        /* of data */
+    char data[LOG_RECORD_SIZE - 4];
+};
+
+static int log_level = LOG_LEVEL_INFO;
+static int access_format = LOG_ACCESS_TEXT;
+static FILE *access_out = NULL;     /* NULL: stderr */
+
+/* Writes a record out; only called by the writer thread once it runs */
+static void write_record(const struct LogRecord *record)
+{
+    struct LogAccessHeader h;
+    FILE *out = (access_out != NULL)?access_out:stderr;
+    struct ClientAddr addr;
+    char ip[CLIENT_ADDR_STRLEN];
+    const char *method, *host, *path;
+
+    if(record->kind != LOG_KIND_ACCESS)
+    {
+        fwrite(record->data, 1, record->length, stderr);
+        fputc('\n', stderr);
+        return;
+    }
+    if(access_format == LOG_ACCESS_BINARY)
+    {
+        fwrite(record->data, 1, record->length, out);
+        return;
+    }
+
+    /* record->data is only 2-byte aligned, the header has an int64_t */
+    memcpy(&h, record->data, sizeof(h));
+    memcpy(addr.bytes, h.addr, sizeof(addr.bytes));
+    addr.family = h.family;
+    client_addr_format(&addr, ip, sizeof(ip));
+    method = record->data + sizeof(h);
+    host = method + h.method_len;
+    path = host + h.host_len;
+    if(access_format == LOG_ACCESS_COMPACT)
+    {
+        if(h.status == LOG_REQUEST_OK)
+            fprintf(out, "%lld %s %.*s %.*s %.*s\n", (long long)h.time, ip,
+                    (int)h.method_len, method,
+                    (h.host_len != 0)?(int)h.host_len:1,
+                    (h.host_len != 0)?host:"-",
+                    (int)h.path_len, path);
+        else
+            fprintf(out, "%lld %s - - - %s\n", (long long)h.time, ip,
+                    (h.status == LOG_REQUEST_OVERSIZED)
+                    ?"oversized":"malformed");
+    }
+    else if(h.status == LOG_REQUEST_OK)
+        fprintf(out, "Request from %s: %.*s %.*s%s%.*s\n", ip,
+                (int)h.method_len, method,
+                (int)h.host_len, host,
+                (h.host_len != 0)?"":"(no host) ",
+                (int)h.path_len, path);
+    else
+        fprintf(out, "Rejected %s request from %s\n",
+                (h.status == LOG_REQUEST_OVERSIZED)?"oversized":"malformed",
+                ip);
+}
+
+#ifndef __WIN32__
+
+/* One thread's records. head and tail are on cache lines of their own:
+ * the writer only writes head, the owner only tail and dropped. */
+struct LogRing {
+    uint32_t head;          /* next record to write out */
+    char padding1[64 - sizeof(uint32_t)];
+    uint32_t tail;          /* next record to fill */
+    unsigned long dropped;  /* word-sized: no 64-bit atomics on MIPS */
+    struct LogRing *next;   /* all rings, newest first */
+    char padding2[64 - sizeof(uint32_t) - sizeof(unsigned long)
+                  - sizeof(struct LogRing*)];
+    struct LogRecord records[LOG_RING_RECORDS];
+};
+
+static _Thread_local struct LogRing *thread_ring = NULL;
+static _Thread_local int thread_ring_failed = 0;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct LogRing *rings = NULL;    /* protected by rings_lock */
+static uint64_t dropped_before = 0;     /* by rings freed by log_stop() */
+
+static pthread_t writer_thread;
+static int running = 0;     /* the writer drains the rings */
+static int stopping = 0;    /* the writer should exit once they're empty */
+
+/* The writer sleeps on wake_cond while every ring is empty */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static int idle = 0;        /* set by the writer under wake_lock */
+
+/* The calling thread's ring, allocated on first use; NULL if out of
+ * memory */
+static struct LogRing *get_ring(void)
+{
+    struct LogRing *ring = thread_ring;
+    if(ring != NULL || thread_ring_failed)
+        return ring;
+    ring = malloc(sizeof(struct LogRing));
+    if(ring == NULL)
+    {
+        thread_ring_failed = 1;
+        return NULL;
+    }
+    ring->head = ring->tail = 0;
+    ring->dropped = 0;
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+    thread_ring = ring;
+    return ring;
+}
+
+/* A slot to fill, or NULL if the record should be written directly; then
+ * *dropped is set if the ring was full */
+static struct LogRecord *reserve(struct LogRing **ring_out, int *dropped)
+{
+    struct LogRing *ring;
+    uint32_t head;
+
+    *dropped = 0;
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+        return NULL;
+    ring = get_ring();
+    if(ring == NULL)
+        return NULL;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if(ring->tail - head >= LOG_RING_RECORDS)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        *dropped = 1;
+        return NULL;
+    }
+    *ring_out = ring;
+    return &ring->records[ring->tail & (LOG_RING_RECORDS - 1)];
+}
+
+/* Hands a filled slot over to the writer, waking it up if it was waiting
+ * for one */
+static void commit(struct LogRing *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    /* Pairs with the writer's fence: either it sees this record before
+     * going to sleep, or this sees it asleep */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&idle, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+    }
+}
+
+/* Whether a ring holds records the writer hasn't written out */
+static int pending(void)
+{
+    struct LogRing *ring;
+
+    pthread_mutex_lock(&rings_lock);
+    ring = rings;
+    pthread_mutex_unlock(&rings_lock);
+    for(; ring != NULL; ring = ring->next)
+        if(ring->head != __atomic_load_n(&ring->tail, __ATOMIC_RELAXED))
+            return 1;
+    return 0;
+}
+
+/* Waits until a ring gets a record, or log_stop() is called */
+static void wait_idle(void)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += LOG_IDLE_WAIT;
+    pthread_mutex_lock(&wake_lock);
+    __atomic_store_n(&idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    /* log_stop() sets stopping before signaling under wake_lock */
+    if(!pending() && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+        pthread_cond_timedwait(&wake_cond, &wake_lock, &deadline);
+    __atomic_store_n(&idle, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&wake_lock);
+}
+
+/* Writes out what the rings hold; returns the number of records */
+static size_t drain(void)
+{
+    struct LogRing *ring;
+    size_t count = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    ring = rings;
+    pthread_mutex_unlock(&rings_lock);
+    /* Rings are only added at the front, and only freed by log_stop() */
+    for(; ring != NULL; ring = ring->next)
+    {
+        uint32_t head = ring->head;
+        uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; ++head, ++count)
+            write_record(&ring->records[head & (LOG_RING_RECORDS - 1)]);
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    if(count > 0)
+    {
+        fflush(stderr);
+        if(access_out != NULL)
+            fflush(access_out);
+    }
+    return count;
+}
+
+static void *writer_main(void *arg)
+{
+    uint64_t reported = 0;
+    (void)arg;
+
+    for(;;)
+    {
+        uint64_t dropped;
+        if(drain() == 0)
+        {
+            if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+                break;
+            wait_idle();
+        }
+        dropped = log_dropped();
+        if(dropped != reported)
+        {
+            fprintf(stderr, "Dropped %llu log records, the log can't keep "
+                    "up\n", (unsigned long long)(dropped - reported));
+            reported = dropped;
+        }
+    }
+    return NULL;
+}
+
+int log_start(void)
+{
+    stopping = 0;
+    if(pthread_create(&writer_thread, NULL, writer_main, NULL) != 0)
+    {
+        fprintf(stderr, "Error: can't start the log thread, logging "
+                "synchronously\n");
+        return -1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_stop(void)
+{
+    if(__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        /* Loggers now write directly; the writer empties the rings */
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+        pthread_join(writer_thread, NULL);
+        drain();
+    }
+    /* Every other thread has exited by now */
+    pthread_mutex_lock(&rings_lock);
+    while(rings != NULL)
+    {
+        struct LogRing *next = rings->next;
+        dropped_before += rings->dropped;
+        free(rings);
+        rings = next;
+    }
+    pthread_mutex_unlock(&rings_lock);
+    thread_ring = NULL;
+    if(access_out != NULL)
+    {
+        fclose(access_out);
+        access_out = NULL;
+    }
+}
+
+uint64_t log_dropped(void)
+{
+    struct LogRing *ring;
+    uint64_t dropped = dropped_before;
+
+    pthread_mutex_lock(&rings_lock);
+    for(ring = rings; ring != NULL; ring = ring->next)
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rings_lock);
+    return dropped;
+}
+
+#else
+
+struct LogRing;
+
+static struct LogRecord *reserve(struct LogRing **ring_out, int *dropped)
+{
+    (void)ring_out;
+    *dropped = 0;
+    return NULL;
+}
+
+static void commit(struct LogRing *ring)
+{
+    (void)ring;
+}
+
+int log_start(void)
+{
+    return 0;
+}
+
+void log_stop(void)
+{
+    if(access_out != NULL)
+    {
+        fclose(access_out);
+        access_out = NULL;
+    }
+}
+
+uint64_t log_dropped(void)
+{
+    return 0;
+}
+
+#endif
+
+int log_level_parse(const char *name)
+{
+    static const char *const names[] = {"error", "warning", "info", "debug"};
+    int i;
+    for(i = 0; i < 4; ++i)
+        if(strcmp(name, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+int log_access_format_parse(const char *name)
+{
+    static const char *const names[] = {"text", "compact", "binary"};
+    int i;
+    for(i = 0; i < 3; ++i)
+        if(strcmp(name, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+int log_init(int level, int format, const char *access_file)
+{
+    log_level = level;
+    access_format = format;
+    if(access_file != NULL)
+    {
+        access_out = fopen(access_file,
+                           (format == LOG_ACCESS_BINARY)?"ab":"a");
+        if(access_out == NULL)
+        {
+            perror(access_file);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int log_enabled(int level)
+{
+    return level <= log_level;
+}
+
+void log_message(int level, const char *format, ...)
+{
+    struct LogRecord local, *record;
+    struct LogRing *ring = NULL;
+    va_list ap;
+    int dropped, n;
+
+    if(level > log_level)
+        return;
+    record = reserve(&ring, &dropped);
+    if(dropped)
+        return;
+    if(record == NULL)
+        record = &local;
+
+    va_start(ap, format);
+    n = vsnprintf(record->data, sizeof(record->data), format, ap);
+    va_end(ap);
+    if(n < 0)
+        n = 0;
+    record->kind = (uint16_t)level;
+    record->length = (n < (int)sizeof(record->data))
+                   ?(uint16_t)n:(uint16_t)(sizeof(record->data) - 1);
+
+    if(record == &local)
+    {
+        write_record(record);
+        fflush(stderr);
+    }
+    else
+        commit(ring);
+}
+
+/* Copies at most *avail bytes of a string after the others */
+static uint16_t append_string(char **p, size_t *avail,
+                              const char *str, size_t len)
+{
+    if(len > *avail)
+        len = *avail;
+    if(len == 0)
+        return 0; /* str may be NULL, which memcpy() doesn't allow */
+    memcpy(*p, str, len);
+    *p += len;
+    *avail -= len;
+    return (uint16_t)len;
+}
+
+void log_access(const struct ClientAddr *addr, int status,
+                const char *method, size_t method_len,
+                const char *host, size_t host_len,
+                const char *path, size_t path_len)
+{
+    struct LogRecord local, *record;
+    struct LogRing *ring = NULL;
+    struct LogAccessHeader h;
+    char *p;
+    size_t avail;
+    int dropped;
+
+    if(LOG_LEVEL_INFO > log_level)
+        return;
+    record = reserve(&ring, &dropped);
+    if(dropped)
+        return;
+    if(record == NULL)
+        record = &local;
+
+    /* The path is the most useful part: it gets what the others leave */
+    p = record->data + sizeof(h);
+    avail = sizeof(record->data) - sizeof(h);
+    h.magic = LOG_ACCESS_MAGIC;
+    h.status = (uint8_t)status;
+    h.family = addr->family;
+    h.time = (int64_t)time(NULL);
+    memcpy(h.addr, addr->bytes, sizeof(h.addr));
+    h.method_len = append_string(&p, &avail, method,
+                                 (method_len < 16)?method_len:16);
+    h.host_len = append_string(&p, &avail, host,
+                               (host_len < 64)?host_len:64);
+    h.path_len = append_string(&p, &avail, path, path_len);
+    h.reserved = 0;
+    h.size = (uint16_t)(p - record->data);
+    memcpy(record->data, &h, sizeof(h));
+    record->kind = LOG_KIND_ACCESS;
+    record->length = h.size;
+
+    if(record == &local)
+    {
+        write_record(record);
+        fflush((access_out != NULL)?access_out:stderr);
+    }
+    else
+        commit(ring);
+}
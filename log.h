@@ -0,0 +1,99 @@
+#ifndef LOG_H
+#define LOG_H
+
+/* Logging that never blocks the thread that logs.
+ *
+ * Every thread writes its records into a ring buffer of its own (single
+ * producer, single consumer: no lock, one release store per record), and a
+ * background thread drains all of them into the outputs, in batches. While
+ * they are all empty the writer sleeps on a condition variable, signaled by
+ * the next record. When a ring is full the record is dropped and counted
+ * rather than waited for; log_dropped() reports how many.
+ *
+ * Messages are formatted by the caller, levels above the configured one
+ * cost a comparison. Access-log records are only copied by the caller and
+ * rendered by the writer thread, in the configured format.
+ *
+ * Before log_start() and after log_stop(), records are written directly. On
+ * Windows, where there are no worker threads, they always are. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "addr.h"
+
+enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,     /* default: access log and notable events */
+    LOG_LEVEL_DEBUG
+};
+
+enum {
+    LOG_ACCESS_TEXT,    /* "Request from <ip>: <method> <host><path>" */
+    LOG_ACCESS_COMPACT, /* "<time> <ip> <method> <host> <path>" */
+    LOG_ACCESS_BINARY   /* struct LogAccessHeader, then the strings */
+};
+
+/* What became of a logged request */
+enum {
+    LOG_REQUEST_OK,
+    LOG_REQUEST_MALFORMED,
+    LOG_REQUEST_OVERSIZED
+};
+
+/* A binary access-log record, in host byte order: this header, then
+ * method_len + host_len + path_len bytes (not NUL-terminated) */
+struct LogAccessHeader {
+    uint32_t magic;         /* LOG_ACCESS_MAGIC, to resynchronize */
+    uint16_t size;          /* of the whole record */
+    uint8_t status;         /* LOG_REQUEST_* */
+    uint8_t family;         /* 4 or 6, as in struct ClientAddr */
+    int64_t time;           /* s since the Epoch */
+    uint8_t addr[16];       /* as in struct ClientAddr */
+    uint16_t method_len;
+    uint16_t host_len;
+    uint16_t path_len;
+    uint16_t reserved;
+};
+
+#define LOG_ACCESS_MAGIC 0x48524c41 /* "ALRH" in little-endian memory */
+
+/* Parses a level or access format name; -1 if unknown */
+int log_level_parse(const char *name);
+int log_access_format_parse(const char *name);
+
+/* Sets the level and where access records go: a file opened for appending,
+ * or stderr with the messages if filename is NULL. Returns 0, or -1 after
+ * printing an error. */
+int log_init(int level, int access_format, const char *access_file);
+
+/* Whether messages of a level are kept; worth checking before doing work
+ * to build one */
+int log_enabled(int level);
+
+/* Starts the writer thread. Returns 0, or -1 after printing an error (then
+ * records keep being written directly). */
+int log_start(void);
+
+/* Writes what is left, stops the writer thread and closes the access log */
+void log_stop(void);
+
+/* Logs a line (without its final newline) */
+void log_message(int level, const char *format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+
+/* Logs a request, at LOG_LEVEL_INFO. The strings are truncated to fit in
+ * a record. */
+void log_access(const struct ClientAddr *addr, int status,
+                const char *method, size_t method_len,
+                const char *host, size_t host_len,
+                const char *path, size_t path_len);
+
+/* Records dropped because a ring was full, since log_init() */
+uint64_t log_dropped(void);
+
+#endif /* LOG_H */
@@ -0,0 +1,82 @@
+#include "pool.h"
+
+#include <stdlib.h>
+
+#define GENERATION_MASK ((UINT32_C(1) << POOL_GENERATION_BITS) - 1)
+
+int pool_init(struct Pool *pool, size_t object_size, uint32_t capacity)
+{
+    pool->object_size = (object_size + POOL_ALIGN - 1)
+                      & ~(size_t)(POOL_ALIGN - 1);
+    pool->capacity = capacity;
+    pool->used = pool->count = 0;
+    pool->free_head = POOL_NONE;
+    pool->slab = NULL;
+    pool->next_free = malloc(capacity * sizeof(uint32_t));
+    /* Zeroed by calloc() without touching the pages */
+    pool->generations = calloc(capacity, sizeof(uint32_t));
+    if(pool->next_free != NULL && pool->generations != NULL
+     && capacity <= SIZE_MAX / pool->object_size)
+        pool->slab = malloc(capacity * pool->object_size);
+    if(pool->slab == NULL)
+    {
+        pool_destroy(pool);
+        return -1;
+    }
+    return 0;
+}
+
+void pool_destroy(struct Pool *pool)
+{
+    free(pool->slab);
+    free(pool->next_free);
+    free(pool->generations);
+    pool->slab = NULL;
+    pool->next_free = pool->generations = NULL;
+    pool->capacity = pool->used = pool->count = 0;
+}
+
+void *pool_get(struct Pool *pool)
+{
+    uint32_t index;
+    if(pool->free_head != POOL_NONE)
+    {
+        index = pool->free_head;
+        pool->free_head = pool->next_free[index];
+    }
+    else if(pool->used < pool->capacity)
+        index = pool->used++;
+    else
+        return NULL;
+    ++pool->count;
+    return pool->slab + (size_t)index * pool->object_size;
+}
+
+void pool_put(struct Pool *pool, void *object)
+{
+    uint32_t index = pool_index(pool, object);
+    pool->generations[index] = (pool->generations[index] + 1) & GENERATION_MASK;
+    pool->next_free[index] = pool->free_head;
+    pool->free_head = index;
+    --pool->count;
+}
+
+uint32_t pool_index(const struct Pool *pool, const void *object)
+{
+    return (uint32_t)(((const char*)object - pool->slab) / pool->object_size);
+}
+
+uint64_t pool_handle(const struct Pool *pool, const void *object)
+{
+    uint32_t index = pool_index(pool, object);
+    return (uint64_t)pool->generations[index] << 32 | index;
+}
+
+void *pool_resolve(const struct Pool *pool, uint64_t handle)
+{
+    uint32_t index = (uint32_t)handle;
+    if(index >= pool->used
+     || pool->generations[index] != (uint32_t)(handle >> 32))
+        return NULL;
+    return pool->slab + (size_t)index * pool->object_size;
+}
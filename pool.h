@@ -0,0 +1,53 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Fixed-capacity pool of same-size objects.
+ *
+ * The objects are slots of one slab allocated up front, each rounded up to a
+ * cache line; taking and releasing one is O(1) and never calls malloc(). Free
+ * slots are chained by index, and slots never used yet are handed out from a
+ * high-water mark, so that the slab's pages are only touched as the number
+ * of objects in use grows.
+ *
+ * Every slot has a generation, bumped when it is released. A handle (index
+ * and generation) stored somewhere that may outlive the object, such as the
+ * user data of an asynchronous request, resolves to NULL once the slot was
+ * released, even if it has been reused since.
+ *
+ * A pool is not thread-safe; each worker owns its own. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_ALIGN 64
+#define POOL_NONE UINT32_MAX
+
+/* Handles only use the low POOL_HANDLE_BITS bits; callers may tag the rest */
+#define POOL_GENERATION_BITS 29
+#define POOL_HANDLE_BITS (32 + POOL_GENERATION_BITS)
+
+struct Pool {
+    char *slab;
+    size_t object_size;     /* rounded up to POOL_ALIGN */
+    uint32_t capacity;
+    uint32_t used;          /* slots handed out at least once */
+    uint32_t count;         /* slots in use */
+    uint32_t free_head;     /* released slot to reuse first, or POOL_NONE */
+    uint32_t *next_free;
+    uint32_t *generations;
+};
+
+/* Returns 0, or -1 if out of memory */
+int pool_init(struct Pool *pool, size_t object_size, uint32_t capacity);
+void pool_destroy(struct Pool *pool);
+
+/* An unused object (not zeroed), or NULL if all are in use */
+void *pool_get(struct Pool *pool);
+void pool_put(struct Pool *pool, void *object);
+
+uint32_t pool_index(const struct Pool *pool, const void *object);
+uint64_t pool_handle(const struct Pool *pool, const void *object);
+/* The object of a handle, or NULL if it was released since */
+void *pool_resolve(const struct Pool *pool, uint64_t handle);
+
+#endif /* POOL_H */
@@ -0,0 +1,218 @@
+#include "ratelimit.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Slots of a group, on one cache line */
+#define GROUP_SIZE 8
+#define ALIGNMENT 64
+
+/* Times are counted in units of 2^shift us, modulo 2^32, with the window
+ * below WINDOW_MAX units: a time more than a window (and LAG_US) ahead has
+ * passed. One left alone for 2^32 units (71 minutes at least) may look
+ * ahead again. */
+#define WINDOW_MAX (UINT32_C(1) << 28)
+
+/* How late a worker's clock may be: it read the time, then was preempted
+ * while another worker counted connections from a later one */
+#define LAG_US 1000000
+
+/* Rows of the sketch, each indexed by its own hash of the address */
+#define SKETCH_ROWS 4
+
+/* A slot is a tag of the address and the time at which its bucket is full
+ * again, each a 32-bit word of its own: 32-bit targets such as MIPS have
+ * no 64-bit compare-and-swap */
+struct Group {
+    uint32_t tags[GROUP_SIZE];      /* 0 if free */
+    uint32_t times[GROUP_SIZE];
+};
+
+static struct {
+    void *alloc;
+    struct Group *groups;
+    size_t group_mask;      /* number of groups minus one */
+    uint32_t *sketch;       /* SKETCH_ROWS rows of sketch_mask + 1 times */
+    size_t sketch_mask;
+    unsigned int shift;     /* of us into time units */
+    uint32_t interval;      /* units for a token to come back */
+    uint32_t window;        /* burst * interval */
+    uint32_t lag;           /* LAG_US in units */
+    uint64_t seed;
+} limiter;
+
+/* splitmix64's finalizer */
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= UINT64_C(0xbf58476d1ce4e5b9);
+    x ^= x >> 27;
+    x *= UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+static uint64_t hash_addr(const struct ClientAddr *addr)
+{
+    uint64_t high, low = 0;
+    memcpy(&high, addr->bytes, sizeof(high));
+    /* The rest of an IPv6 address is the host's to choose */
+    if(addr->family != 6)
+        memcpy(&low, addr->bytes + 8, sizeof(low));
+    return mix(high ^ mix(low ^ limiter.seed ^ addr->family));
+}
+
+int ratelimit_init(unsigned long rate, unsigned long burst, size_t slots)
+{
+    size_t groups = 1, size;
+    uint64_t interval, window;
+    uintptr_t aligned;
+
+    while(groups * GROUP_SIZE < slots)
+        groups *= 2;
+    size = groups * sizeof(struct Group)
+         + SKETCH_ROWS * groups * sizeof(uint32_t);
+    limiter.alloc = calloc(1, size + ALIGNMENT);
+    if(limiter.alloc == NULL)
+        return -1;
+    aligned = ((uintptr_t)limiter.alloc + ALIGNMENT - 1)
+            & ~(uintptr_t)(ALIGNMENT - 1);
+    limiter.groups = (struct Group*)aligned;
+    limiter.group_mask = groups - 1;
+    limiter.sketch = (uint32_t*)(limiter.groups + groups);
+    limiter.sketch_mask = groups - 1;
+
+    /* In us, then in the coarsest units that keep the window below
+     * WINDOW_MAX (1 us unless it is over 4 minutes) */
+    if(rate == 0)
+        rate = 1;
+    if(burst == 0)
+        burst = 1;
+    interval = 1000000 / rate;
+    window = interval * burst;
+    limiter.shift = 0;
+    while((window >> limiter.shift) >= WINDOW_MAX)
+        ++limiter.shift;
+    limiter.interval = (uint32_t)(interval >> limiter.shift);
+    if(limiter.interval == 0)
+        limiter.interval = 1;
+    limiter.window = limiter.interval * (uint32_t)burst;
+    limiter.lag = (uint32_t)(LAG_US >> limiter.shift);
+    /* Addresses colliding in one process don't in the next */
+    limiter.seed = mix((uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&limiter);
+    return 0;
+}
+
+void ratelimit_destroy(void)
+{
+    free(limiter.alloc);
+    memset(&limiter, 0, sizeof(limiter));
+}
+
+/* How far ahead of now time is, 0 if it passed (the bucket is full). Up
+ * to the lag beyond the window, now is late rather than time in the past:
+ * the bucket is empty, not full (which would let the client through and
+ * set its time back). */
+static uint32_t ahead_of(uint32_t time, uint32_t now)
+{
+    uint32_t ahead = time - now;
+    if(ahead <= limiter.window)
+        return ahead;
+    return (ahead - limiter.window <= limiter.lag)?limiter.window:0;
+}
+
+static int sketch_check(uint64_t hash, uint32_t now)
+{
+    uint32_t *cells[SKETCH_ROWS];
+    uint32_t ahead = UINT32_MAX, time;
+    int row;
+
+    /* The least loaded of the address' cells: the others count clients
+     * sharing them too */
+    for(row = 0; row < SKETCH_ROWS; ++row)
+    {
+        uint32_t cell;
+        cells[row] = &limiter.sketch[(size_t)row * (limiter.sketch_mask + 1)
+                                     + (mix(hash + (uint64_t)row)
+                                        & limiter.sketch_mask)];
+        cell = ahead_of(__atomic_load_n(cells[row], __ATOMIC_RELAXED), now);
+        if(cell < ahead)
+            ahead = cell;
+    }
+    if(ahead + limiter.interval > limiter.window)
+        return RATELIMIT_LIMITED;
+    ahead += limiter.interval;
+    time = now + ahead;
+
+    /* Conservative update: cells already past it stay where they are */
+    for(row = 0; row < SKETCH_ROWS; ++row)
+    {
+        uint32_t cell = __atomic_load_n(cells[row], __ATOMIC_RELAXED);
+        while(ahead_of(cell, now) < ahead
+              && !__atomic_compare_exchange_n(cells[row], &cell, time, true,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED))
+            ;
+    }
+    return RATELIMIT_ALLOWED;
+}
+
+int ratelimit_check(const struct ClientAddr *addr, uint64_t now_us)
+{
+    uint64_t hash = hash_addr(addr);
+    uint32_t tag = (uint32_t)(hash >> 32);
+    uint32_t now = (uint32_t)(now_us >> limiter.shift);
+    struct Group *group = &limiter.groups[hash & limiter.group_mask];
+
+    if(tag == 0)
+        tag = 1; /* 0 is a free slot */
+    for(;;)
+    {
+        uint32_t free_tag = 0, free_time = 0, time = 0, ahead = 0;
+        int i, free_slot = -1;
+
+        for(i = 0; i < GROUP_SIZE; ++i)
+        {
+            uint32_t slot_tag = __atomic_load_n(&group->tags[i],
+                                                __ATOMIC_RELAXED);
+            time = __atomic_load_n(&group->times[i], __ATOMIC_RELAXED);
+            ahead = ahead_of(time, now);
+            if(slot_tag == tag)
+                break;
+            if((slot_tag == 0 || ahead == 0) && free_slot == -1)
+            {
+                free_slot = i;
+                free_tag = slot_tag;
+                free_time = time;
+            }
+        }
+
+        if(i < GROUP_SIZE)
+        {
+            /* Taking a token puts off the time the bucket is full again;
+             * a refused connection takes none */
+            if(ahead + limiter.interval > limiter.window)
+                return RATELIMIT_LIMITED;
+            if(__atomic_compare_exchange_n(
+                    &group->times[i], &time, now + ahead + limiter.interval,
+                    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                return RATELIMIT_ALLOWED;
+            continue; /* another worker got there first */
+        }
+        if(free_slot == -1)
+            return sketch_check(hash, now) | RATELIMIT_ESTIMATED;
+        /* The tag first, then the time. A worker seeing the new tag in
+         * between finds the previous owner's time, which has passed, and
+         * takes the first token itself: this one then takes another. Two
+         * workers may each claim a slot for the same new address: it then
+         * has twice the burst, until one of them is reused. */
+        if(__atomic_compare_exchange_n(
+                &group->tags[free_slot], &free_tag, tag,
+                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+         && __atomic_compare_exchange_n(
+                &group->times[free_slot], &free_time, now + limiter.interval,
+                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return RATELIMIT_ALLOWED;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/* Per-client rate limiting of new connections.
+ *
+ * Each client address (IPv6 ones by /64, which a single host can rotate
+ * through) has a token bucket of burst connections, refilled at rate per
+ * second. A bucket is kept in the equivalent GCRA form, as the single time
+ * at which it would be full again: that and a tag of the address are two
+ * 32-bit words, updated with compare-and-swap by whichever worker accepted
+ * the connection (no 64-bit atomics, which 32-bit targets lack). Slots are
+ * grouped by eight on a cache line; a bucket that is full again is free for
+ * another address.
+ *
+ * The table has a fixed size. When the eight words where an address belongs
+ * are all held by busier clients, it falls back to a count-min sketch of the
+ * same times (conservative update): a client may then be limited because of
+ * others sharing its counters, never let through more than it should. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "addr.h"
+
+/* Result of ratelimit_check(), RATELIMIT_ESTIMATED or'ed with either */
+enum {
+    RATELIMIT_ALLOWED = 0,
+    RATELIMIT_LIMITED = 1,
+    RATELIMIT_ESTIMATED = 2    /* decided by the sketch */
+};
+
+/* Limits clients to rate connections per second, burst at once, keeping
+ * track of up to slots clients (rounded up to a power of two). Returns 0, or
+ * -1 if out of memory. Must not race with other calls. */
+int ratelimit_init(unsigned long rate, unsigned long burst, size_t slots);
+void ratelimit_destroy(void);
+
+/* Counts a connection from addr at now_us (timer_now_us()). Thread-safe. */
+int ratelimit_check(const struct ClientAddr *addr, uint64_t now_us);
+
+#endif /* RATELIMIT_H */
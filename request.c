@@ -0,0 +1,195 @@
+#include "request.h"
+#include "scan.h"
+
+#include <string.h>
+
+enum {
+    STATE_REQUEST_LINE = 0,
+    STATE_HEADERS,
+    STATE_DONE
+};
+
+void request_parser_init(struct RequestParser *parser)
+{
+    memset(parser, 0, sizeof(struct RequestParser));
+}
+
+static struct Span make_span(size_t start, size_t end)
+{
+    struct Span span;
+    span.offset = (uint16_t)start;
+    span.length = (uint16_t)(end - start);
+    return span;
+}
+
+static char lower(char c)
+{
+    return (c >= 'A' && c <= 'Z')?(char)(c - 'A' + 'a'):c;
+}
+
+int span_equals(const char *buffer, struct Span span, const char *str)
+{
+    return strlen(str) == span.length
+        && scan_equals_lower(buffer + span.offset, str, span.length);
+}
+
+/* RFC 9110 token characters */
+static int is_tchar(unsigned char c)
+{
+    if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+     || (c >= '0' && c <= '9'))
+        return 1;
+    return c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+/* METHOD SP request-target SP HTTP/1.x */
+static int parse_request_line(const char *buffer, size_t start, size_t end,
+                              struct Request *request)
+{
+    size_t i = start, target_start, q;
+
+    while(i < end && is_tchar((unsigned char)buffer[i]))
+        ++i;
+    if(i == start || i == end || buffer[i] != ' ')
+        return REQUEST_BAD;
+    request->method = make_span(start, i);
+
+    target_start = ++i;
+    while(i < end && (unsigned char)buffer[i] > ' ')
+        ++i;
+    if(i == target_start || i == end || buffer[i] != ' ')
+        return REQUEST_BAD;
+    request->target = make_span(target_start, i);
+
+    for(q = target_start; q < i && buffer[q] != '?'; ++q)
+        ;
+    request->path = make_span(target_start, q);
+    request->query = make_span((q < i)?q + 1:i, i);
+
+    ++i;
+    if(end - i != 8 || memcmp(buffer + i, "HTTP/1.", 7) != 0
+     || buffer[i + 7] < '0' || buffer[i + 7] > '9')
+        return REQUEST_BAD;
+    request->version = (buffer[i + 7] == '0')?10:11;
+    return REQUEST_INCOMPLETE;
+}
+
+/* Host value without the port; handles IPv6 literals ("[::1]:80") */
+static struct Span host_without_port(const char *buffer, size_t start,
+                                     size_t end)
+{
+    size_t i;
+    if(start < end && buffer[start] == '[')
+    {
+        for(i = start; i < end && buffer[i] != ']'; ++i)
+            ;
+        return make_span(start, (i < end)?i + 1:end);
+    }
+    for(i = start; i < end && buffer[i] != ':'; ++i)
+        ;
+    return make_span(start, i);
+}
+
+/* name ":" OWS value OWS */
+static int parse_header(const char *buffer, size_t start, size_t end,
+                        struct Request *request)
+{
+    size_t colon, value_start, value_end;
+    struct Span name;
+
+    /* obsolete line folding: continuation of the previous value, ignored */
+    if(buffer[start] == ' ' || buffer[start] == '\t')
+        return REQUEST_INCOMPLETE;
+
+    for(colon = start; colon < end && buffer[colon] != ':'; ++colon)
+        if(!is_tchar((unsigned char)buffer[colon]))
+            return REQUEST_BAD;
+    if(colon == start || colon == end)
+        return REQUEST_BAD;
+    name = make_span(start, colon);
+
+    value_start = colon + 1;
+    while(value_start < end
+       && (buffer[value_start] == ' ' || buffer[value_start] == '\t'))
+        ++value_start;
+    value_end = end;
+    while(value_end > value_start
+       && (buffer[value_end - 1] == ' ' || buffer[value_end - 1] == '\t'))
+        --value_end;
+
+    switch(lower(buffer[start]))
+    {
+    case 'h':
+        if(request->host.length == 0 && span_equals(buffer, name, "host"))
+            request->host = host_without_port(buffer, value_start, value_end);
+        break;
+    case 'u':
+        if(span_equals(buffer, name, "user-agent"))
+            request->user_agent = make_span(value_start, value_end);
+        break;
+    case 'c':
+        if(span_equals(buffer, name, "connection"))
+            request->connection = make_span(value_start, value_end);
+        break;
+    }
+    return REQUEST_INCOMPLETE;
+}
+
+int request_parse(struct RequestParser *parser, const char *buffer,
+                  size_t length, size_t capacity)
+{
+    struct Request *request = &parser->request;
+
+    if(parser->state == STATE_DONE)
+        return REQUEST_COMPLETE;
+    if(length > capacity)
+        length = capacity;
+
+    for(;;)
+    {
+        size_t end, line_end;
+        const char *nl = scan_find_byte(buffer + parser->scanned,
+                                        length - parser->scanned, '\n');
+        int ret;
+
+        if(nl == NULL)
+        {
+            parser->scanned = length;
+            return (length >= capacity)?REQUEST_TOO_LARGE:REQUEST_INCOMPLETE;
+        }
+
+        end = (size_t)(nl - buffer);
+        line_end = end;
+        if(line_end > parser->line_start && buffer[line_end - 1] == '\r')
+            --line_end;
+
+        if(parser->state == STATE_REQUEST_LINE)
+        {
+            /* Empty lines before the request line are tolerated */
+            if(line_end > parser->line_start)
+            {
+                ret = parse_request_line(buffer, parser->line_start,
+                                         line_end, request);
+                if(ret != REQUEST_INCOMPLETE)
+                    return ret;
+                parser->state = STATE_HEADERS;
+            }
+        }
+        else if(line_end == parser->line_start)
+        {
+            /* Empty line: end of the head */
+            request->head_size = end + 1;
+            parser->state = STATE_DONE;
+            parser->line_start = parser->scanned = end + 1;
+            return REQUEST_COMPLETE;
+        }
+        else
+        {
+            ret = parse_header(buffer, parser->line_start, line_end, request);
+            if(ret != REQUEST_INCOMPLETE)
+                return ret;
+        }
+
+        parser->line_start = parser->scanned = end + 1;
+    }
+}
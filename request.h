@@ -0,0 +1,61 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+/* Incremental HTTP/1.x request-head parser.
+ *
+ * The caller appends received bytes to a per-connection buffer and calls
+ * request_parse() on the whole buffer each time; the parser remembers where
+ * it stopped, so every byte is only examined once however the head is split
+ * across recv() calls. Results are spans (offset, length) into that buffer:
+ * nothing is copied. Both CRLF and bare LF line endings are accepted. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A piece of the connection's buffer; length 0 if absent */
+struct Span {
+    uint16_t offset;
+    uint16_t length;
+};
+
+enum {
+    REQUEST_INCOMPLETE = 0, /* need more bytes */
+    REQUEST_COMPLETE,       /* the whole head was parsed */
+    REQUEST_BAD,            /* malformed request line or header */
+    REQUEST_TOO_LARGE       /* head doesn't fit in the buffer */
+};
+
+struct Request {
+    struct Span method;
+    struct Span target;     /* request-target, path and query */
+    struct Span path;       /* target without the query */
+    struct Span query;      /* after '?', without it */
+    struct Span host;       /* Host header, without the port */
+    struct Span user_agent;
+    struct Span connection;
+    int version;            /* 10 for HTTP/1.0, 11 for HTTP/1.1 */
+    size_t head_size;       /* bytes up to and including the empty line */
+};
+
+struct RequestParser {
+    int state;
+    size_t line_start;  /* start of the line being parsed */
+    size_t scanned;     /* bytes already searched for a line end */
+    struct Request request;
+};
+
+void request_parser_init(struct RequestParser *parser);
+
+/* Parses buffer[0..length), of which a previous call may already have seen
+ * a prefix. capacity is the size of the buffer: a head that doesn't end
+ * within it is REQUEST_TOO_LARGE. Once REQUEST_COMPLETE is returned,
+ * parser->request is filled and bytes after head_size belong to the next
+ * request (if any). capacity must not exceed 65535. */
+int request_parse(struct RequestParser *parser, const char *buffer,
+                  size_t length, size_t capacity);
+
+/* Case-insensitive comparison of a span with a NUL-terminated string, which
+ * must be lowercase */
+int span_equals(const char *buffer, struct Span span, const char *str);
+
+#endif /* REQUEST_H */
@@ -0,0 +1,395 @@
+#include "rules.h"
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define MAX_LINE 1024
+
+/* Byte trie of path prefixes; children of a node are a linked list */
+struct TrieNode {
+    int32_t child;      /* first child, -1 if none */
+    int32_t sibling;    /* next child of the same parent, -1 if none */
+    int32_t rule;       /* rule ending at this node, -1 if none */
+    unsigned char byte; /* label of the edge leading here */
+};
+
+#define INLINE_HOST 40
+
+/* Slot of the Host hash table (open addressing, linear probing), one cache
+ * line: short hosts are compared without following the pointer */
+struct HostSlot {
+    uint32_t hash;
+    int32_t root;       /* trie of this Host's paths */
+    size_t length;
+    const char *host;   /* NULL if the slot is free */
+    char inline_host[INLINE_HOST]; /* copy of host if it fits */
+};
+
+struct RuleTable {
+    struct Rule *rules;
+    size_t count;
+    size_t allocated;
+
+    /* Built by rules_compile() */
+    struct HostSlot *hosts;
+    size_t mask;            /* number of slots minus one */
+    struct TrieNode *nodes;
+    size_t node_count;
+    size_t node_allocated;
+    int32_t any_root;       /* trie of the "*" rules, -1 if none */
+};
+
+static char *copy_string(const char *str)
+{
+    size_t size = strlen(str) + 1;
+    char *copy = malloc(size);
+    if(copy != NULL)
+        memcpy(copy, str, size);
+    return copy;
+}
+
+static char lower(char c)
+{
+    return (c >= 'A' && c <= 'Z')?(char)(c - 'A' + 'a'):c;
+}
+
+/* FNV-1a over the lowercase Host */
+static uint32_t hash_host(const char *host, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for(i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char)lower(host[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+struct RuleTable *rules_new(void)
+{
+    struct RuleTable *table = calloc(1, sizeof(struct RuleTable));
+    if(table != NULL)
+        table->any_root = -1;
+    return table;
+}
+
+static void free_compiled(struct RuleTable *table)
+{
+    free(table->hosts);
+    free(table->nodes);
+    table->hosts = NULL;
+    table->nodes = NULL;
+    table->mask = table->node_count = table->node_allocated = 0;
+    table->any_root = -1;
+}
+
+void rules_free(struct RuleTable *table)
+{
+    size_t i;
+    if(table == NULL)
+        return;
+    for(i = 0; i < table->count; ++i)
+    {
+        free(table->rules[i].host);
+        free(table->rules[i].path);
+        free(table->rules[i].dest);
+        free(table->rules[i].template_file);
+    }
+    free(table->rules);
+    free_compiled(table);
+    free(table);
+}
+
+int rules_add(struct RuleTable *table, const char *host, const char *path,
+              int action, const char *dest)
+{
+    struct Rule *rule;
+    size_t i;
+
+    if(table->count == table->allocated)
+    {
+        size_t allocated = table->allocated?table->allocated * 2:16;
+        struct Rule *rules = realloc(table->rules,
+                                     allocated * sizeof(struct Rule));
+        if(rules == NULL)
+            return -1;
+        table->rules = rules;
+        table->allocated = allocated;
+    }
+
+    rule = &table->rules[table->count];
+    rule->host = copy_string(host);
+    rule->path = copy_string(path);
+    rule->dest = (dest != NULL)?copy_string(dest):NULL;
+    rule->template_file = NULL;
+    rule->action = action;
+    rule->index = table->count;
+    if(rule->host == NULL || rule->path == NULL
+     || (dest != NULL && rule->dest == NULL))
+    {
+        free(rule->host);
+        free(rule->path);
+        free(rule->dest);
+        return -1;
+    }
+    for(i = 0; rule->host[i] != '\0'; ++i)
+        rule->host[i] = lower(rule->host[i]);
+    ++table->count;
+    return 0;
+}
+
+static int parse_action(const char *word)
+{
+    if(strcmp(word, "redirect") == 0)
+        return RULE_REDIRECT;
+    if(strcmp(word, "portal") == 0)
+        return RULE_PORTAL;
+    if(strcmp(word, "success") == 0)
+        return RULE_SUCCESS;
+    return -1;
+}
+
+int rules_load(struct RuleTable *table, const char *filename)
+{
+    char line[MAX_LINE];
+    unsigned int lineno = 0;
+    int ret = 0;
+    FILE *file = fopen(filename, "r");
+
+    if(file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    while(ret == 0 && fgets(line, sizeof(line), file) != NULL)
+    {
+        char *fields[6];
+        char *comment = strchr(line, '#');
+        int count = 0, action;
+
+        ++lineno;
+        if(strchr(line, '\n') == NULL && !feof(file))
+        {
+            fprintf(stderr, "Error: %s:%u: line too long\n", filename, lineno);
+            ret = -1;
+            break;
+        }
+        if(comment != NULL)
+            *comment = '\0';
+
+        fields[0] = strtok(line, " \t\r\n");
+        while(fields[count] != NULL && count < 5)
+            fields[++count] = strtok(NULL, " \t\r\n");
+        if(count == 0)
+            continue;
+
+        action = (count >= 3)?parse_action(fields[2]):-1;
+        if(count < 3 || fields[count] != NULL || action == -1
+         || fields[1][0] != '/'
+         || (action == RULE_SUCCESS) != (count == 3))
+        {
+            fprintf(stderr, "Error: %s:%u: expected \"<host> </path> "
+                    "redirect|portal <destination> [template]\" or \"<host> "
+                    "</path> success\"\n", filename, lineno);
+            ret = -1;
+        }
+        else if(rules_add(table, fields[0], fields[1], action,
+                          (count >= 4)?fields[3]:NULL) != 0
+             || (count == 5
+              && (table->rules[table->count - 1].template_file =
+                  copy_string(fields[4])) == NULL))
+        {
+            fprintf(stderr, "Error: out of memory\n");
+            ret = -1;
+        }
+    }
+
+    if(ret == 0 && ferror(file))
+    {
+        perror(filename);
+        ret = -1;
+    }
+    fclose(file);
+    return ret;
+}
+
+static int32_t new_node(struct RuleTable *table, unsigned char byte)
+{
+    struct TrieNode *node;
+    if(table->node_count == table->node_allocated)
+    {
+        size_t allocated = table->node_allocated * 2;
+        struct TrieNode *nodes;
+        if(allocated > INT32_MAX)
+            return -1;
+        nodes = realloc(table->nodes, allocated * sizeof(struct TrieNode));
+        if(nodes == NULL)
+            return -1;
+        table->nodes = nodes;
+        table->node_allocated = allocated;
+    }
+    node = &table->nodes[table->node_count];
+    node->child = node->sibling = node->rule = -1;
+    node->byte = byte;
+    return (int32_t)table->node_count++;
+}
+
+static int32_t find_child(const struct TrieNode *nodes, int32_t node,
+                          unsigned char byte)
+{
+    int32_t child;
+    for(child = nodes[node].child; child != -1; child = nodes[child].sibling)
+        if(nodes[child].byte == byte)
+            return child;
+    return -1;
+}
+
+/* Adds a rule's path below root. Returns 0, or -1 if out of memory. */
+static int insert_path(struct RuleTable *table, int32_t root,
+                       const struct Rule *rule)
+{
+    int32_t node = root;
+    const unsigned char *p;
+
+    for(p = (const unsigned char*)rule->path; *p != '\0'; ++p)
+    {
+        int32_t child = find_child(table->nodes, node, *p);
+        if(child == -1)
+        {
+            child = new_node(table, *p);
+            if(child == -1)
+                return -1;
+            table->nodes[child].sibling = table->nodes[node].child;
+            table->nodes[node].child = child;
+        }
+        node = child;
+    }
+
+    /* The first rule for a given host and path wins */
+    if(table->nodes[node].rule == -1)
+        table->nodes[node].rule = (int32_t)rule->index;
+    return 0;
+}
+
+static struct HostSlot *find_host(const struct RuleTable *table,
+                                  const char *host, size_t length,
+                                  uint32_t hash)
+{
+    size_t i = hash & table->mask;
+    while(table->hosts[i].host != NULL)
+    {
+        struct HostSlot *slot = &table->hosts[i];
+        if(slot->hash == hash && slot->length == length
+         && scan_equals_lower(host, (length <= INLINE_HOST)
+                                    ?slot->inline_host:slot->host, length))
+            return slot;
+        i = (i + 1) & table->mask;
+    }
+    return &table->hosts[i];
+}
+
+int rules_compile(struct RuleTable *table)
+{
+    size_t i, slots = 16;
+
+    free_compiled(table);
+
+    /* At most half full */
+    while(slots < table->count * 2)
+        slots *= 2;
+    table->hosts = calloc(slots, sizeof(struct HostSlot));
+    table->mask = slots - 1;
+    table->node_allocated = 64;
+    table->nodes = malloc(table->node_allocated * sizeof(struct TrieNode));
+    if(table->hosts == NULL || table->nodes == NULL)
+    {
+        free_compiled(table);
+        return -1;
+    }
+
+    for(i = 0; i < table->count; ++i)
+    {
+        const struct Rule *rule = &table->rules[i];
+        int32_t *root;
+
+        if(strcmp(rule->host, "*") == 0)
+            root = &table->any_root;
+        else
+        {
+            size_t length = strlen(rule->host);
+            uint32_t hash = hash_host(rule->host, length);
+            struct HostSlot *slot = find_host(table, rule->host, length, hash);
+            if(slot->host == NULL)
+            {
+                slot->host = rule->host;
+                slot->length = length;
+                if(length <= INLINE_HOST)
+                    memcpy(slot->inline_host, rule->host, length);
+                slot->hash = hash;
+                slot->root = -1;
+            }
+            root = &slot->root;
+        }
+
+        if(*root == -1)
+            *root = new_node(table, 0);
+        if(*root == -1 || insert_path(table, *root, rule) != 0)
+        {
+            free_compiled(table);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Rule of the longest prefix of path in the trie, or -1 */
+static int32_t match_path(const struct TrieNode *nodes, int32_t root,
+                          const char *path, size_t path_len)
+{
+    int32_t node = root, best = nodes[root].rule;
+    size_t i;
+    for(i = 0; i < path_len; ++i)
+    {
+        node = find_child(nodes, node, (unsigned char)path[i]);
+        if(node == -1)
+            break;
+        if(nodes[node].rule != -1)
+            best = nodes[node].rule;
+    }
+    return best;
+}
+
+const struct Rule *rules_lookup(const struct RuleTable *table,
+                                const char *host, size_t host_len,
+                                const char *path, size_t path_len)
+{
+    int32_t rule = -1;
+
+    if(table->hosts == NULL)
+        return NULL;
+    if(host_len != 0)
+    {
+        const struct HostSlot *slot = find_host(
+                table, host, host_len, hash_host(host, host_len));
+        if(slot->host != NULL)
+            rule = match_path(table->nodes, slot->root, path, path_len);
+    }
+    if(rule == -1 && table->any_root != -1)
+        rule = match_path(table->nodes, table->any_root, path, path_len);
+    return (rule != -1)?&table->rules[rule]:NULL;
+}
+
+size_t rules_count(const struct RuleTable *table)
+{
+    return table->count;
+}
+
+const struct Rule *rules_get(const struct RuleTable *table, size_t index)
+{
+    return (index < table->count)?&table->rules[index]:NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef RULES_H
+#define RULES_H
+
+/* Host/path routing table.
+ *
+ * Rules map a Host and a path prefix to an action. They are added (or
+ * loaded from a file) at startup, then rules_compile() builds the lookup
+ * structure: a hash table on the Host, each entry holding a byte trie of
+ * the path prefixes for that Host. A lookup is one hash probe plus a walk
+ * down the path, whatever the number of rules. The compiled table is never
+ * modified, so all workers share it.
+ *
+ * Rules file format, one rule per line, '#' starting a comment:
+ *     <host> <path prefix> <action> [destination [template]]
+ * host is matched case-insensitively, without port; "*" matches any Host
+ * (and requests without one). Actions:
+ *     redirect <dest>  307 to http://<dest>/<token>, or the response of the
+ *                      template file if one is named (see template.h)
+ *     portal <dest>    captive-portal probe: redirect to dest until the
+ *                      client has been granted access, then 200 Success
+ *     success          200 Success
+ * The longest matching prefix wins, a rule for the request's Host being
+ * preferred over a "*" rule; between identical host and path, the first
+ * rule wins. Rules added with rules_add() may use an empty path, which
+ * matches every request including those whose target isn't a path. */
+
+#include <stddef.h>
+
+enum {
+    RULE_REDIRECT = 0,
+    RULE_PORTAL,
+    RULE_SUCCESS
+};
+
+struct Rule {
+    char *host;     /* lowercase, "*" for any */
+    char *path;     /* prefix, starts with '/' in rules files */
+    int action;     /* RULE_* */
+    char *dest;     /* NULL for RULE_SUCCESS */
+    char *template_file; /* of the redirect, NULL for the default one */
+    size_t index;   /* position in the table, for per-rule data */
+};
+
+struct RuleTable;
+
+struct RuleTable *rules_new(void);
+void rules_free(struct RuleTable *table);
+
+/* Appends a rule; strings are copied. Returns 0, or -1 if out of memory. */
+int rules_add(struct RuleTable *table, const char *host, const char *path,
+              int action, const char *dest);
+
+/* Appends the rules of a file. Prints an error and returns -1 if the file
+ * can't be read or a line is invalid. */
+int rules_load(struct RuleTable *table, const char *filename);
+
+/* Builds the lookup structure once every rule is added. Returns 0, or -1 if
+ * out of memory. */
+int rules_compile(struct RuleTable *table);
+
+/* Rule for a request, or NULL if none matches. host need not be lowercase;
+ * pass a zero length for requests without one. */
+const struct Rule *rules_lookup(const struct RuleTable *table,
+                                const char *host, size_t host_len,
+                                const char *path, size_t path_len);
+
+size_t rules_count(const struct RuleTable *table);
+const struct Rule *rules_get(const struct RuleTable *table, size_t index);
+
+#endif /* RULES_H */
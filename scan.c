@@ -0,0 +1,207 @@
+#include "scan.h"
+
+#ifdef ENABLE_SIMD
+    #include <immintrin.h>
+    #define TARGET(isa) __attribute__((target(isa)))
+    #define FIRST_SET(mask) ((size_t)__builtin_ctz(mask))
+#endif
+
+static char lower(char c)
+{
+    return (c >= 'A' && c <= 'Z')?(char)(c - 'A' + 'a'):c;
+}
+
+/* Scalar kernels; also finish the tail of the vector ones */
+
+static const char *find_byte_scalar(const char *p, size_t len, char c)
+{
+    size_t i;
+    for(i = 0; i < len; ++i)
+        if(p[i] == c)
+            return p + i;
+    return NULL;
+}
+
+static const char *find_head_end_scalar(const char *p, size_t len)
+{
+    size_t i;
+    for(i = 0; i + 4 <= len; ++i)
+        if(p[i] == '\r' && p[i + 1] == '\n'
+         && p[i + 2] == '\r' && p[i + 3] == '\n')
+            return p + i;
+    return NULL;
+}
+
+static int equals_lower_scalar(const char *p, const char *lower_str,
+                               size_t len)
+{
+    size_t i;
+    for(i = 0; i < len; ++i)
+        if(lower(p[i]) != lower_str[i])
+            return 0;
+    return 1;
+}
+
+#ifdef ENABLE_SIMD
+
+/* SSE2: 16 bytes at a time */
+
+TARGET("sse2")
+static const char *find_byte_sse2(const char *p, size_t len, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if(mask != 0)
+            return p + i + FIRST_SET(mask);
+    }
+    return find_byte_scalar(p + i, len - i, c);
+}
+
+TARGET("sse2")
+static const char *find_head_end_sse2(const char *p, size_t len)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    /* A match at i needs bytes i..i+3: compare four shifted loads */
+    for(; i + 16 + 3 <= len; i += 16)
+    {
+        __m128i m = _mm_and_si128(
+                _mm_and_si128(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), cr),
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 1)), lf)),
+                _mm_and_si128(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 2)), cr),
+                    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 3)), lf)));
+        int mask = _mm_movemask_epi8(m);
+        if(mask != 0)
+            return p + i + FIRST_SET(mask);
+    }
+    return find_head_end_scalar(p + i, len - i);
+}
+
+TARGET("sse2")
+static int equals_lower_sse2(const char *p, const char *lower_str, size_t len)
+{
+    const __m128i before_a = _mm_set1_epi8('A' - 1);
+    const __m128i after_z = _mm_set1_epi8('Z' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a),
+                                      _mm_cmpgt_epi8(after_z, v));
+        v = _mm_or_si128(v, _mm_and_si128(upper, case_bit));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(
+                v, _mm_loadu_si128((const __m128i*)(lower_str + i))))
+           != 0xFFFF)
+            return 0;
+    }
+    return equals_lower_scalar(p + i, lower_str + i, len - i);
+}
+
+/* AVX2: 32 bytes at a time. The tail goes to the (non-VEX) SSE2 version:
+ * clear the upper halves first, which the compiler doesn't do before a tail
+ * call, or every SSE2 instruction pays for the AVX-SSE transition. */
+
+TARGET("avx2")
+static const char *find_byte_avx2(const char *p, size_t len, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(v, needle));
+        if(mask != 0)
+            return p + i + FIRST_SET(mask);
+    }
+    _mm256_zeroupper();
+    return find_byte_sse2(p + i, len - i, c);
+}
+
+TARGET("avx2")
+static const char *find_head_end_avx2(const char *p, size_t len)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for(; i + 32 + 3 <= len; i += 32)
+    {
+        __m256i m = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), cr),
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 1)), lf)),
+                _mm256_and_si256(
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 2)), cr),
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 3)), lf)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if(mask != 0)
+            return p + i + FIRST_SET(mask);
+    }
+    _mm256_zeroupper();
+    return find_head_end_sse2(p + i, len - i);
+}
+
+TARGET("avx2")
+static int equals_lower_avx2(const char *p, const char *lower_str, size_t len)
+{
+    const __m256i before_a = _mm256_set1_epi8('A' - 1);
+    const __m256i after_z = _mm256_set1_epi8('Z' + 1);
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, before_a),
+                                         _mm256_cmpgt_epi8(after_z, v));
+        v = _mm256_or_si256(v, _mm256_and_si256(upper, case_bit));
+        if((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                v, _mm256_loadu_si256((const __m256i*)(lower_str + i))))
+           != 0xFFFFFFFFu)
+            return 0;
+    }
+    _mm256_zeroupper();
+    return equals_lower_sse2(p + i, lower_str + i, len - i);
+}
+
+#endif /* ENABLE_SIMD */
+
+const struct ScanKernels scan_all_kernels[] = {
+    {"scalar", find_byte_scalar, find_head_end_scalar, equals_lower_scalar},
+#ifdef ENABLE_SIMD
+    {"sse2", find_byte_sse2, find_head_end_sse2, equals_lower_sse2},
+    {"avx2", find_byte_avx2, find_head_end_avx2, equals_lower_avx2},
+#endif
+    {NULL, NULL, NULL, NULL}
+};
+
+const struct ScanKernels *scan_kernels = &scan_all_kernels[0];
+
+int scan_supported(const struct ScanKernels *kernels)
+{
+#ifdef ENABLE_SIMD
+    __builtin_cpu_init();
+    if(kernels == &scan_all_kernels[1])
+        return __builtin_cpu_supports("sse2");
+    if(kernels == &scan_all_kernels[2])
+        return __builtin_cpu_supports("avx2");
+#endif
+    return kernels->name != NULL;
+}
+
+const char *scan_init(void)
+{
+    const struct ScanKernels *k;
+    for(k = scan_all_kernels; k->name != NULL; ++k)
+        if(scan_supported(k))
+            scan_kernels = k; /* later entries are faster */
+    return scan_kernels->name;
+}
@@ -0,0 +1,57 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/* Byte-scanning kernels used by the request parser.
+ *
+ * Each kernel has a portable scalar version and, on x86 with GCC or Clang,
+ * SSE2 and AVX2 versions. scan_init() picks the best one the CPU supports;
+ * until it is called, the scalar kernels are used. Vector loads never read
+ * outside [p, p + len). */
+
+#include <stddef.h>
+
+#ifndef ENABLE_SIMD
+    #ifndef DISABLE_SIMD
+        #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+            #define ENABLE_SIMD
+        #endif
+    #endif
+#endif
+#ifdef ENABLE_SIMD
+    #if !defined(__GNUC__) || !(defined(__x86_64__) || defined(__i386__))
+        #warning ENABLE_SIMD needs GCC or Clang on x86
+        #undef ENABLE_SIMD
+    #endif
+#endif
+
+struct ScanKernels {
+    const char *name;
+    /* First occurrence of c, or NULL (like memchr()) */
+    const char *(*find_byte)(const char *p, size_t len, char c);
+    /* Start of the first "\r\n\r\n", or NULL */
+    const char *(*find_head_end)(const char *p, size_t len);
+    /* Non-zero if p[0..len) equals lower[0..len) ignoring ASCII case;
+     * lower must already be lowercase */
+    int (*equals_lower)(const char *p, const char *lower, size_t len);
+};
+
+/* Every kernel set built in, scalar first, terminated by a NULL name; some
+ * may not be supported by this CPU (see scan_supported()) */
+extern const struct ScanKernels scan_all_kernels[];
+
+/* Kernels selected by scan_init() */
+extern const struct ScanKernels *scan_kernels;
+
+/* Selects the fastest kernels supported by the CPU; call once at startup,
+ * before other threads use the scanner. Returns their name. */
+const char *scan_init(void);
+
+/* Non-zero if the CPU can run the given kernels */
+int scan_supported(const struct ScanKernels *kernels);
+
+#define scan_find_byte(p, len, c) (scan_kernels->find_byte((p), (len), (c)))
+#define scan_find_head_end(p, len) (scan_kernels->find_head_end((p), (len)))
+#define scan_equals_lower(p, lower, len) \
+    (scan_kernels->equals_lower((p), (lower), (len)))
+
+#endif /* SCAN_H */
@@ -0,0 +1,368 @@
+#include "stats.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef __WIN32__
+    #include <errno.h>
+    #include <poll.h>
+    #include <pthread.h>
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+#endif
+
+#include "cache.h"
+#include "log.h"
+
+/* Counters of different workers never share a cache line */
+#define STATS_ALIGN 64
+
+union StatsSlot {
+    struct Stats stats;
+    char padding[(sizeof(struct Stats) + STATS_ALIGN - 1)
+                 / STATS_ALIGN * STATS_ALIGN];
+};
+
+/* ms a socket client has to ask for a format before getting the text one */
+#define STATS_SOCKET_WAIT 250
+
+static void *slots_alloc = NULL;
+static union StatsSlot *slots = NULL;
+static int slot_count = 0;
+static time_t started;
+
+/* What is printed, in order */
+static const struct {
+    const char *name;       /* in the text format */
+    const char *metric;     /* Prometheus name, without the prefix */
+    const char *help;
+    size_t offset;
+    int counter;            /* 0 for a gauge */
+} fields[] = {
+    {"accepted", "accepted_connections_total",
+     "Connections accepted", offsetof(struct Stats, accepted), 1},
+    {"wakeups", "accept_wakeups_total",
+     "Wakeups of the listener that accepted connections",
+     offsetof(struct Stats, wakeups), 1},
+    {"largest_batch", "accept_largest_batch",
+     "Most connections accepted in one wakeup",
+     offsetof(struct Stats, largest_batch), 0},
+    {"full_batches", "accept_full_batches_total",
+     "Wakeups that hit the accept batch size",
+     offsetof(struct Stats, full_batches), 1},
+    {"refused", "refused_connections_total",
+     "Connections refused because every slot was taken",
+     offsetof(struct Stats, refused), 1},
+    {"rate_limited", "rate_limited_connections_total",
+     "Connections over their client's rate limit, answered 429",
+     offsetof(struct Stats, rate_limited), 1},
+    {"rate_dropped", "rate_dropped_connections_total",
+     "Connections over their client's rate limit, closed unanswered",
+     offsetof(struct Stats, rate_dropped), 1},
+    {"rate_estimated", "rate_estimated_total",
+     "Rate limit checks made by the approximate fallback, the table being "
+     "full", offsetof(struct Stats, rate_estimated), 1},
+    {"requests", "requests_total",
+     "Requests answered", offsetof(struct Stats, requests), 1},
+    {"redirects", "redirects_total",
+     "Redirects by a redirect rule or the default destination",
+     offsetof(struct Stats, redirects), 1},
+    {"portal_redirects", "portal_redirects_total",
+     "Captive-portal probes redirected, not granted yet",
+     offsetof(struct Stats, portal_redirects), 1},
+    {"successes", "successes_total",
+     "200 Success pages", offsetof(struct Stats, successes), 1},
+    {"errors", "errors_total",
+     "Malformed or oversized requests", offsetof(struct Stats, errors), 1},
+    {"unavailable", "unavailable_total",
+     "Requests answered 503, every render buffer being in use",
+     offsetof(struct Stats, unavailable), 1},
+    {"cache_hits", "cache_hits_total",
+     "Captive-portal probes from granted clients",
+     offsetof(struct Stats, cache_hits), 1},
+    {"cache_misses", "cache_misses_total",
+     "Captive-portal probes from clients not granted yet",
+     offsetof(struct Stats, cache_misses), 1},
+    {"header_timeouts", "header_timeouts_total",
+     "Connections closed before a complete request",
+     offsetof(struct Stats, header_timeouts), 1},
+    {"idle_timeouts", "idle_timeouts_total",
+     "Persistent connections closed while idle",
+     offsetof(struct Stats, idle_timeouts), 1},
+    {"bytes_out", "sent_bytes_total",
+     "Bytes of responses sent", offsetof(struct Stats, bytes_out), 1}
+};
+
+#define FIELD(stats, i) \
+    ((unsigned long*)((char*)(stats) + fields[i].offset))
+
+int stats_init(int workers)
+{
+    size_t size = (size_t)workers * sizeof(union StatsSlot);
+    uintptr_t aligned;
+
+    slots_alloc = calloc(1, size + STATS_ALIGN);
+    if(slots_alloc == NULL)
+        return -1;
+    aligned = ((uintptr_t)slots_alloc + STATS_ALIGN - 1)
+            & ~(uintptr_t)(STATS_ALIGN - 1);
+    slots = (union StatsSlot*)aligned;
+    slot_count = workers;
+    started = time(NULL);
+    return 0;
+}
+
+void stats_free(void)
+{
+    free(slots_alloc);
+    slots_alloc = NULL;
+    slots = NULL;
+    slot_count = 0;
+}
+
+struct Stats *stats_worker(int index)
+{
+    return &slots[index].stats;
+}
+
+void stats_sum(struct Stats *total)
+{
+    size_t i;
+    int w;
+
+    memset(total, 0, sizeof(*total));
+    for(w = 0; w < slot_count; ++w)
+    {
+        for(i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+        {
+            unsigned long value = __atomic_load_n(FIELD(&slots[w].stats, i),
+                                                  __ATOMIC_RELAXED);
+            if(fields[i].counter)
+                *FIELD(total, i) += value;
+            else if(value > *FIELD(total, i))
+                *FIELD(total, i) = value;
+        }
+    }
+}
+
+/* Appends a line to buf, keeping track of the length of the whole output
+ * even once it no longer fits */
+static void append(char *buf, size_t size, size_t *length,
+                   int format, const char *name, const char *metric,
+                   const char *help, int counter, uint64_t value)
+{
+    size_t avail = (*length < size)?size - *length:0;
+    int n;
+
+    if(format == STATS_PROMETHEUS)
+        n = snprintf(buf + *length, avail,
+                     "# HELP http_redirect_%s %s\n"
+                     "# TYPE http_redirect_%s %s\n"
+                     "http_redirect_%s %llu\n",
+                     metric, help, metric, counter?"counter":"gauge",
+                     metric, (unsigned long long)value);
+    else
+        n = snprintf(buf + *length, avail, "%s %llu\n",
+                     name, (unsigned long long)value);
+    if(n > 0)
+        *length += (size_t)n;
+}
+
+size_t stats_format(char *buf, size_t size, int format)
+{
+    struct Stats total;
+    size_t length = 0;
+    size_t i;
+
+    if(size > 0)
+        buf[0] = '\0';
+    stats_sum(&total);
+    for(i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+        append(buf, size, &length, format, fields[i].name, fields[i].metric,
+               fields[i].help, fields[i].counter, *FIELD(&total, i));
+    append(buf, size, &length, format, "cache_entries", "cache_entries",
+           "Captive-portal clients granted", 0, cache_count());
+    append(buf, size, &length, format, "cache_evictions",
+           "cache_evictions_total",
+           "Granted clients evicted to make room for others", 1,
+           cache_evictions());
+    append(buf, size, &length, format, "log_dropped", "log_dropped_total",
+           "Log records dropped because the log couldn't keep up", 1,
+           log_dropped());
+    append(buf, size, &length, format, "workers", "workers",
+           "Worker threads", 0, (uint64_t)slot_count);
+    append(buf, size, &length, format, "uptime", "uptime_seconds",
+           "Seconds since the server started", 0,
+           (uint64_t)(time(NULL) - started));
+    return length;
+}
+
+#ifndef __WIN32__
+
+static int socket_fd = -1;
+static char *socket_path = NULL;
+static struct stat socket_stat;     /* to recognize it when removing it */
+static pthread_t socket_thread;
+static int socket_running = 0;
+
+int stats_socket_open(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: stats socket path %s is too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(socket_fd == -1)
+    {
+        perror("Error: can't create the stats socket");
+        return -1;
+    }
+    /* Left over by a previous run; anything else is not ours to remove */
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if(bind(socket_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+     || lstat(path, &socket_stat) == -1 || listen(socket_fd, 16) == -1)
+    {
+        fprintf(stderr, "Error: can't listen on %s: %s\n",
+                path, strerror(errno));
+        close(socket_fd);
+        socket_fd = -1;
+        return -1;
+    }
+    socket_path = malloc(strlen(path) + 1);
+    if(socket_path != NULL)
+        strcpy(socket_path, path);
+    return 0;
+}
+
+/* Answers one client of the stats socket */
+static void answer_socket(int sock)
+{
+    static char out[STATS_BUFFER_SIZE];
+    char in[32];
+    struct pollfd pfd;
+    struct timeval timeout;
+    int format = STATS_TEXT;
+    size_t length, sent = 0;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, STATS_SOCKET_WAIT) == 1)
+    {
+        ssize_t n = recv(sock, in, sizeof(in), 0);
+        if(n >= 10 && memcmp(in, "prometheus", 10) == 0)
+            format = STATS_PROMETHEUS;
+    }
+
+    /* A client that doesn't read can't hold up the others for long */
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    length = stats_format(out, sizeof(out), format);
+    if(length >= sizeof(out))
+        length = sizeof(out) - 1;
+    while(sent < length)
+    {
+        ssize_t n = send(sock, out + sent, length - sent, MSG_NOSIGNAL);
+        if(n <= 0)
+        {
+            if(n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        sent += (size_t)n;
+    }
+}
+
+static void *socket_main(void *arg)
+{
+    (void)arg;
+    while(__atomic_load_n(&socket_running, __ATOMIC_RELAXED))
+    {
+        struct pollfd pfd;
+        int sock;
+
+        /* Wakes up every second to notice stats_socket_close() */
+        pfd.fd = socket_fd;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, 1000) != 1)
+            continue;
+        sock = accept(socket_fd, NULL, NULL);
+        if(sock == -1)
+            continue;
+        answer_socket(sock);
+        close(sock);
+    }
+    return NULL;
+}
+
+int stats_socket_start(void)
+{
+    if(socket_fd == -1)
+        return 0;
+    socket_running = 1;
+    if(pthread_create(&socket_thread, NULL, socket_main, NULL) != 0)
+    {
+        fprintf(stderr, "Error: can't start the stats socket thread\n");
+        socket_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void stats_socket_close(void)
+{
+    struct stat st;
+
+    if(socket_running)
+    {
+        __atomic_store_n(&socket_running, 0, __ATOMIC_RELAXED);
+        pthread_join(socket_thread, NULL);
+    }
+    if(socket_fd != -1)
+    {
+        close(socket_fd);
+        socket_fd = -1;
+    }
+    if(socket_path != NULL)
+    {
+        /* Not if a server taking over from this one replaced it */
+        if(lstat(socket_path, &st) == 0 && st.st_ino == socket_stat.st_ino
+         && st.st_dev == socket_stat.st_dev)
+            unlink(socket_path);
+        free(socket_path);
+        socket_path = NULL;
+    }
+}
+
+#else
+
+int stats_socket_open(const char *path)
+{
+    (void)path;
+    fprintf(stderr, "Error: the stats socket is not available on Windows\n");
+    return -1;
+}
+
+int stats_socket_start(void)
+{
+    return 0;
+}
+
+void stats_socket_close(void)
+{
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef STATS_H
+#define STATS_H
+
+/* Counters of what the server does, for monitoring.
+ *
+ * Every worker has its own set, on cache lines of its own, and is the only
+ * one writing to it: counting is a plain add, with no lock and no atomic
+ * read-modify-write. The stores are still atomic (relaxed, which compiles to
+ * a plain store) so that stats_sum() may read them from any thread, adding
+ * up the workers' counters only when someone asks for them. Counters are
+ * word-sized, like the cache's: 64-bit atomics are library calls on 32-bit
+ * targets such as MIPS, where the counters wrap instead. */
+
+#include <stddef.h>
+
+struct Stats {
+    unsigned long accepted;         /* connections */
+    unsigned long wakeups;          /* of listeners, accepting connections */
+    unsigned long largest_batch;    /* most accepted in one wakeup */
+    unsigned long full_batches;     /* wakeups that hit the accept batch size */
+    unsigned long refused;          /* while every connection slot was taken */
+    unsigned long rate_limited;     /* over their client's rate, answered 429 */
+    unsigned long rate_dropped;     /* over their client's rate, closed */
+    unsigned long rate_estimated;   /* rate checks decided by the sketch */
+    unsigned long requests;
+    unsigned long redirects;        /* by a redirect rule or the default one */
+    unsigned long portal_redirects; /* captive-portal probes not granted yet */
+    unsigned long successes;        /* 200 pages, granted probes included */
+    unsigned long errors;           /* malformed or oversized requests */
+    unsigned long unavailable;      /* 503, every render buffer in use */
+    unsigned long cache_hits;       /* captive-portal probes already granted */
+    unsigned long cache_misses;
+    unsigned long header_timeouts;
+    unsigned long idle_timeouts;
+    unsigned long bytes_out;
+};
+
+#define STATS_ADD(stats, field, n) \
+    __atomic_store_n(&(stats)->field, (stats)->field + (n), __ATOMIC_RELAXED)
+#define STATS_INC(stats, field) STATS_ADD(stats, field, 1)
+#define STATS_MAX(stats, field, n) \
+    do { \
+        if((unsigned long)(n) > (stats)->field) \
+            __atomic_store_n(&(stats)->field, (unsigned long)(n), \
+                             __ATOMIC_RELAXED); \
+    } while(0)
+
+/* Large enough for stats_format() in either format */
+#define STATS_BUFFER_SIZE 8192
+
+enum {
+    STATS_TEXT,         /* "name value" lines */
+    STATS_PROMETHEUS    /* Prometheus text exposition format */
+};
+
+/* Allocates zeroed counters for workers workers. Returns 0, or -1 if out of
+ * memory. Must be called before the workers start. */
+int stats_init(int workers);
+void stats_free(void);
+
+/* Counters of a worker, to be written by its thread only */
+struct Stats *stats_worker(int index);
+
+/* Totals of all workers, each counter read atomically (but not all of them
+ * at the same instant). largest_batch is the largest of any worker. */
+void stats_sum(struct Stats *total);
+
+/* Writes the totals, the cache's counters and the uptime into buf, like
+ * snprintf(). Returns the length of the whole output. */
+size_t stats_format(char *buf, size_t size, int format);
+
+/* Serves the stats on a Unix-domain socket at path, from a thread of its
+ * own: a client gets the text format, or the Prometheus one if it starts by
+ * sending "prometheus". The socket is created right away, so that it can be
+ * done before dropping privileges; serving only starts with
+ * stats_socket_start(). Returns 0, or -1 after printing an error. */
+int stats_socket_open(const char *path);
+int stats_socket_start(void);
+/* Stops serving (within a second) and removes the socket */
+void stats_socket_close(void);
+
+#endif /* STATS_H */
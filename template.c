@@ -0,0 +1,392 @@
+#include "template.h"
+#include "addr.h"
+#include "token.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_TEMPLATE_FILE 65536
+
+static const char hex[] = "0123456789ABCDEF";
+
+static char lower(char c)
+{
+    return (c >= 'A' && c <= 'Z')?(char)(c - 'A' + 'a'):c;
+}
+
+static bool is_alnum(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9');
+}
+
+/* Characters of a header name, as in request.c */
+static bool is_tchar(unsigned char c)
+{
+    return is_alnum(c) || (c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+/* Characters left as they are by percent-encoding (RFC 3986 unreserved) */
+static bool is_unreserved(unsigned char c)
+{
+    return is_alnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/* Whether a Host is a name or an address literal, safe to echo in a
+ * header */
+static bool is_host(const char *host, size_t size)
+{
+    size_t i;
+    for(i = 0; i < size; ++i)
+    {
+        unsigned char c = (unsigned char)host[i];
+        if(!is_unreserved(c) && c != ':' && c != '[' && c != ']')
+            return false;
+    }
+    return true;
+}
+
+static bool name_equals(const char *name, size_t size, const char *lowercase)
+{
+    size_t i;
+    if(strlen(lowercase) != size)
+        return false;
+    for(i = 0; i < size; ++i)
+        if(lower(name[i]) != lowercase[i])
+            return false;
+    return true;
+}
+
+/* "HTTP/1.x NNN[ reason]" */
+static bool is_status_line(const char *line, size_t size)
+{
+    return size >= 12 && memcmp(line, "HTTP/1.", 7) == 0
+        && line[7] >= '0' && line[7] <= '9' && line[8] == ' '
+        && line[9] >= '1' && line[9] <= '5'
+        && line[10] >= '0' && line[10] <= '9'
+        && line[11] >= '0' && line[11] <= '9'
+        && (size == 12 || line[12] == ' ');
+}
+
+/* Slots by name; TEMPLATE_VALUES stands for {dest} */
+static const struct {
+    const char *name;
+    int value;
+    bool encoded;
+} slots[] = {
+    {"token", TEMPLATE_TOKEN, false},
+    {"host", TEMPLATE_HOST, false},
+    {"path", TEMPLATE_PATH, false},
+    {"path_encoded", TEMPLATE_PATH, true},
+    {"client", TEMPLATE_CLIENT, false},
+    {"dest", TEMPLATE_VALUES, false}
+};
+
+/* Compiler state: static bytes are appended to data, the parts of the
+ * dynamic part collected as slots are met */
+struct Builder {
+    struct Template *t;
+    size_t size;            /* of t->data */
+    size_t last_end;        /* end of the last slot, in data */
+    size_t host_weight, path_weight;
+};
+
+static void add_slot(struct Builder *b, int value, bool encoded)
+{
+    struct Template *t = b->t;
+    struct TemplatePart *part;
+
+    if(t->part_count == 0)
+        t->head_size = b->size;
+    else if(b->size > b->last_end)
+    {
+        /* Static bytes since the previous slot */
+        part = &t->parts[t->part_count++];
+        part->value = -1;
+        part->encoded = false;
+        part->data = t->data + b->last_end;
+        part->size = b->size - b->last_end;
+        t->fixed_size += part->size;
+    }
+    part = &t->parts[t->part_count++];
+    part->value = value;
+    part->encoded = encoded;
+    part->data = NULL;
+    part->size = 0;
+    b->last_end = b->size;
+    t->uses |= 1u << value;
+
+    switch(value)
+    {
+    case TEMPLATE_TOKEN:
+        t->fixed_size += TOKEN_MAX_SIZE;
+        break;
+    case TEMPLATE_CLIENT:
+        t->fixed_size += CLIENT_ADDR_STRLEN;
+        break;
+    case TEMPLATE_HOST:
+        ++b->host_weight;
+        break;
+    case TEMPLATE_PATH:
+        b->path_weight += encoded?3:1;
+        break;
+    }
+}
+
+/* Appends a line of the head, with its slots, and a CRLF */
+static int add_line(struct Builder *b, const char *line, size_t size,
+                    const char *dest, const char *name, unsigned int lineno)
+{
+    char *data = b->t->data;
+    size_t i = 0;
+
+    while(i < size)
+    {
+        const char *end;
+        size_t length, s;
+
+        if(line[i] != '{')
+        {
+            data[b->size++] = line[i++];
+            continue;
+        }
+        if(i + 1 < size && line[i + 1] == '{')
+        {
+            data[b->size++] = '{';
+            i += 2;
+            continue;
+        }
+        end = memchr(line + i, '}', size - i);
+        length = (end != NULL)?(size_t)(end - line) - i - 1:0;
+        for(s = 0; end != NULL && s < sizeof(slots) / sizeof(slots[0]); ++s)
+            if(strlen(slots[s].name) == length
+             && memcmp(slots[s].name, line + i + 1, length) == 0)
+                break;
+        if(end == NULL || s == sizeof(slots) / sizeof(slots[0]))
+        {
+            fprintf(stderr, "Error: %s:%u: unknown slot, expected {token}, "
+                    "{host}, {path}, {path_encoded}, {client} or {dest} "
+                    "(\"{{\" for \"{\")\n", name, lineno);
+            return -1;
+        }
+        if(slots[s].value != TEMPLATE_VALUES)
+            add_slot(b, slots[s].value, slots[s].encoded);
+        else if(dest == NULL)
+        {
+            fprintf(stderr, "Error: %s:%u: {dest} is only known for redirect "
+                    "and portal rules\n", name, lineno);
+            return -1;
+        }
+        else
+        {
+            memcpy(data + b->size, dest, strlen(dest));
+            b->size += strlen(dest);
+        }
+        i += length + 2;
+    }
+    data[b->size++] = '\r';
+    data[b->size++] = '\n';
+    return 0;
+}
+
+int template_compile(struct Template *t, const char *text, size_t size,
+                     const char *dest, const char *name)
+{
+    struct Builder b;
+    const char *p = text, *end = text + size;
+    size_t braces = 0, bound, i;
+    unsigned int lineno = 0;
+    bool in_head = true;
+
+    memset(t, 0, sizeof(*t));
+    for(i = 0; i < size; ++i)
+        if(text[i] == '{')
+            ++braces;
+    /* Every LF may become a CRLF, every slot {dest} */
+    bound = 2 * size + braces * ((dest != NULL)?strlen(dest):0) + 64;
+    t->data = malloc(bound);
+    t->parts = malloc((2 * braces + 1) * sizeof(struct TemplatePart));
+    if(t->data == NULL || t->parts == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        template_free(t);
+        return -1;
+    }
+    memset(&b, 0, sizeof(b));
+    b.t = t;
+
+    while(in_head && p < end)
+    {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        const char *next = (eol != NULL)?eol + 1:end;
+        size_t length;
+
+        if(eol == NULL)
+            eol = end;
+        if(eol > p && eol[-1] == '\r')
+            --eol;
+        length = (size_t)(eol - p);
+        ++lineno;
+
+        if(length == 0 && lineno > 1)
+            in_head = false;
+        else if(lineno == 1 && !is_status_line(p, length))
+        {
+            fprintf(stderr, "Error: %s:1: expected a status line, such as "
+                    "\"HTTP/1.1 302 Found\"\n", name);
+            template_free(t);
+            return -1;
+        }
+        else if(lineno > 1)
+        {
+            const char *colon = memchr(p, ':', length);
+            size_t n;
+            for(n = 0; colon != NULL && p + n < colon; ++n)
+                if(!is_tchar((unsigned char)p[n]))
+                    break;
+            if(colon == NULL || colon == p || p + n != colon)
+            {
+                fprintf(stderr, "Error: %s:%u: expected a \"Name: value\" "
+                        "header\n", name, lineno);
+                template_free(t);
+                return -1;
+            }
+            if(name_equals(p, n, "content-length")
+             || name_equals(p, n, "connection")
+             || name_equals(p, n, "transfer-encoding"))
+            {
+                fprintf(stderr, "Error: %s:%u: %.*s is set by the server\n",
+                        name, lineno, (int)n, p);
+                template_free(t);
+                return -1;
+            }
+        }
+        if(in_head && add_line(&b, p, length, dest, name, lineno) != 0)
+        {
+            template_free(t);
+            return -1;
+        }
+        p = next;
+    }
+
+    if(lineno == 0)
+    {
+        fprintf(stderr, "Error: %s: empty template\n", name);
+        template_free(t);
+        return -1;
+    }
+
+    /* The rest is the body, as it is */
+    b.size += (size_t)sprintf(t->data + b.size, "Content-Length: %lu\r\n",
+                              (unsigned long)(end - p));
+    if(t->part_count == 0)
+    {
+        free(t->parts);
+        t->parts = NULL;
+        b.last_end = t->head_size = b.size;
+    }
+    t->head = t->data;
+    t->tail = t->data + b.last_end;
+    t->tail_size = b.size - b.last_end;
+    t->data[b.size++] = '\r';
+    t->data[b.size++] = '\n';
+    t->body = t->data + b.size;
+    t->body_size = (size_t)(end - p);
+    memcpy(t->data + b.size, p, t->body_size);
+    t->weight = (b.host_weight > b.path_weight)?b.host_weight:b.path_weight;
+    return 0;
+}
+
+int template_load(struct Template *t, const char *filename, const char *dest)
+{
+    char *text = malloc(MAX_TEMPLATE_FILE + 1);
+    size_t size;
+    int ret;
+    FILE *file;
+
+    if(text == NULL)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+    file = fopen(filename, "rb");
+    if(file == NULL)
+    {
+        perror(filename);
+        free(text);
+        return -1;
+    }
+    size = fread(text, 1, MAX_TEMPLATE_FILE + 1, file);
+    if(ferror(file))
+    {
+        perror(filename);
+        ret = -1;
+    }
+    else if(size > MAX_TEMPLATE_FILE)
+    {
+        fprintf(stderr, "Error: %s: larger than %d bytes\n", filename,
+                MAX_TEMPLATE_FILE);
+        ret = -1;
+    }
+    else
+        ret = template_compile(t, text, size, dest, filename);
+    fclose(file);
+    free(text);
+    return ret;
+}
+
+void template_free(struct Template *t)
+{
+    free(t->data);
+    free(t->parts);
+    t->data = NULL;
+    t->parts = NULL;
+}
+
+bool template_token_only(const struct Template *t)
+{
+    return t->part_count == 1 && t->parts[0].value == TEMPLATE_TOKEN;
+}
+
+size_t template_render(const struct Template *t,
+                       const struct TemplateValue *values, char *out)
+{
+    char *p = out;
+    size_t i, j;
+
+    for(i = 0; i < t->part_count; ++i)
+    {
+        const struct TemplatePart *part = &t->parts[i];
+        const struct TemplateValue *v;
+
+        if(part->value == -1)
+        {
+            memcpy(p, part->data, part->size);
+            p += part->size;
+            continue;
+        }
+        v = &values[part->value];
+        if(part->value == TEMPLATE_HOST && !is_host(v->data, v->size))
+            continue;
+        if(!part->encoded)
+        {
+            memcpy(p, v->data, v->size);
+            p += v->size;
+            continue;
+        }
+        for(j = 0; j < v->size; ++j)
+        {
+            unsigned char c = (unsigned char)v->data[j];
+            if(is_unreserved(c))
+                *p++ = (char)c;
+            else
+            {
+                *p++ = '%';
+                *p++ = hex[c >> 4];
+                *p++ = hex[c & 15];
+            }
+        }
+    }
+    return (size_t)(p - out);
+}
@@ -0,0 +1,88 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+/* Response templates.
+ *
+ * A template is the text of a response: a status line, header lines, an
+ * empty line and an optional body, lines ending with LF or CRLF. Headers
+ * may hold slots, filled in for each request:
+ *     {token}         redirect token (random, or signed with a key file;
+ *                     a signed token is only recognised at the end of
+ *                     the path the client comes back with)
+ *     {host}          Host of the request, without the port; empty if
+ *                     there is none, or if it isn't a valid host name
+ *     {path}          request target (path and query) as sent
+ *     {path_encoded}  the same, percent-encoded for a query string
+ *     {client}        address of the client
+ *     {dest}          destination of the rule, filled in once and for all
+ * and "{{" stands for "{". Content-Length is added; Connection is the
+ * server's, as is Transfer-Encoding: templates can't set them.
+ *
+ * A compiled template is a head of static bytes, a dynamic part running
+ * from the first slot to the last (slots and the static bytes between
+ * them), then the static rest of the headers and the body. Rendering
+ * copies the dynamic part into a buffer of the caller's, without any
+ * allocation or formatting call; a template without slots is sent as is. */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Values of the slots, by index */
+enum {
+    TEMPLATE_TOKEN = 0,
+    TEMPLATE_HOST,
+    TEMPLATE_PATH,
+    TEMPLATE_CLIENT,
+    TEMPLATE_VALUES
+};
+
+struct TemplateValue {
+    const char *data;
+    size_t size;
+};
+
+/* Piece of the dynamic part: static bytes, or a slot */
+struct TemplatePart {
+    int value;          /* TEMPLATE_*, or -1 for static bytes */
+    bool encoded;       /* percent-encoded value */
+    const char *data;   /* static bytes */
+    size_t size;
+};
+
+struct Template {
+    char *data;         /* every static byte */
+    const char *head;   /* before the first slot */
+    size_t head_size;
+    struct TemplatePart *parts; /* dynamic part, NULL if there are no slots */
+    size_t part_count;
+    const char *tail;   /* after the last slot, without the empty line */
+    size_t tail_size;
+    const char *body;
+    size_t body_size;
+    unsigned int uses;  /* bit (1 << TEMPLATE_*) of each value used */
+    /* The dynamic part renders to at most fixed_size bytes, plus weight
+     * bytes per byte of the request head (which holds host and path) */
+    size_t fixed_size;
+    size_t weight;
+};
+
+/* Compiles size bytes of text; dest fills {dest} (which is an error if it
+ * is NULL). name is used in error messages. Returns 0, or -1 after printing
+ * an error. */
+int template_compile(struct Template *t, const char *text, size_t size,
+                     const char *dest, const char *name);
+
+/* Same with the content of a file */
+int template_load(struct Template *t, const char *filename, const char *dest);
+
+void template_free(struct Template *t);
+
+/* Whether the dynamic part is nothing but the token */
+bool template_token_only(const struct Template *t);
+
+/* Renders the dynamic part into out, which must hold fixed_size bytes plus
+ * weight times the size of the request head. Returns the bytes written. */
+size_t template_render(const struct Template *t,
+                       const struct TemplateValue *values, char *out);
+
+#endif /* TEMPLATE_H */
@@ -0,0 +1,242 @@
+#include "timer.h"
+
+#ifdef __WIN32__
+    #define _WIN32_WINNT 0x0600 /* GetTickCount64() */
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
+
+#define ROOT_MASK (TIMER_ROOT_SIZE - 1)
+#define LEVEL_MASK (TIMER_LEVEL_SIZE - 1)
+#define LEVEL_SHIFT(n) (TIMER_ROOT_BITS + (n) * TIMER_LEVEL_BITS)
+#define MAX_DELAY_TICKS ((UINT64_C(1) << LEVEL_SHIFT(TIMER_LEVELS - 1)) - 1)
+
+uint64_t timer_now_ms(void)
+{
+#ifdef __WIN32__
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+uint64_t timer_now_us(void)
+{
+#ifdef __WIN32__
+    return GetTickCount64() * 1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+static void list_init(struct Timer *head)
+{
+    head->prev = head->next = head;
+}
+
+static void list_append(struct Timer *head, struct Timer *timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink(struct Timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+}
+
+void timer_wheel_init(struct TimerWheel *wheel, uint64_t now_ms)
+{
+    size_t i, j;
+    wheel->now = now_ms / TIMER_TICK_MS;
+    wheel->count = 0;
+    for(i = 0; i < TIMER_ROOT_SIZE; ++i)
+        list_init(&wheel->root[i]);
+    for(i = 0; i < TIMER_LEVELS - 1; ++i)
+        for(j = 0; j < TIMER_LEVEL_SIZE; ++j)
+            list_init(&wheel->levels[i][j]);
+}
+
+void timer_init(struct Timer *timer, timer_callback callback, void *data)
+{
+    timer->prev = timer->next = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+/* Files timer in the slot matching its distance from the current tick */
+static void place(struct TimerWheel *wheel, struct Timer *timer)
+{
+    uint64_t expires = timer->expires;
+    uint64_t delta;
+    int level;
+
+    if(expires < wheel->now)
+        expires = timer->expires = wheel->now;
+    delta = expires - wheel->now;
+
+    if(delta < TIMER_ROOT_SIZE)
+    {
+        list_append(&wheel->root[expires & ROOT_MASK], timer);
+        return;
+    }
+    for(level = 0; level < TIMER_LEVELS - 2; ++level)
+        if(delta < (UINT64_C(1) << LEVEL_SHIFT(level + 1)))
+            break;
+    list_append(&wheel->levels[level][(expires >> LEVEL_SHIFT(level))
+                                      & LEVEL_MASK],
+                timer);
+}
+
+void timer_schedule(struct TimerWheel *wheel, struct Timer *timer,
+                    uint64_t now_ms, uint64_t delay_ms)
+{
+    uint64_t ticks = (now_ms + delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if(timer_pending(timer))
+        timer_cancel(wheel, timer);
+    if(ticks > wheel->now + MAX_DELAY_TICKS)
+        ticks = wheel->now + MAX_DELAY_TICKS;
+    timer->expires = ticks;
+    place(wheel, timer);
+    ++wheel->count;
+}
+
+void timer_cancel(struct TimerWheel *wheel, struct Timer *timer)
+{
+    if(!timer_pending(timer))
+        return;
+    list_unlink(timer);
+    --wheel->count;
+}
+
+int timer_pending(const struct Timer *timer)
+{
+    return timer->next != NULL;
+}
+
+/* Moves every timer of a higher level slot down to where it now belongs.
+ * Returns the slot index, which is 0 when the next level must cascade too. */
+static size_t cascade(struct TimerWheel *wheel, int level)
+{
+    size_t index = (wheel->now >> LEVEL_SHIFT(level)) & LEVEL_MASK;
+    struct Timer *head = &wheel->levels[level][index];
+    while(head->next != head)
+    {
+        struct Timer *timer = head->next;
+        list_unlink(timer);
+        place(wheel, timer);
+    }
+    return index;
+}
+
+size_t timer_wheel_advance(struct TimerWheel *wheel, uint64_t now_ms)
+{
+    uint64_t target = now_ms / TIMER_TICK_MS;
+    size_t fired = 0;
+
+    while(wheel->now <= target)
+    {
+        size_t index = wheel->now & ROOT_MASK;
+        struct Timer due;
+
+        /* Nothing to run: jump straight to the target tick */
+        if(wheel->count == 0)
+        {
+            wheel->now = target + 1;
+            break;
+        }
+
+        if(index == 0)
+        {
+            int level;
+            for(level = 0; level < TIMER_LEVELS - 1; ++level)
+                if(cascade(wheel, level) != 0)
+                    break;
+        }
+
+        /* Detach the slot first so that callbacks rescheduling timers for
+         * "now" don't run again in this same pass */
+        list_init(&due);
+        if(wheel->root[index].next != &wheel->root[index])
+        {
+            due.next = wheel->root[index].next;
+            due.prev = wheel->root[index].prev;
+            due.next->prev = &due;
+            due.prev->next = &due;
+            list_init(&wheel->root[index]);
+        }
+        ++wheel->now;
+
+        while(due.next != &due)
+        {
+            struct Timer *timer = due.next;
+            list_unlink(timer);
+            --wheel->count;
+            ++fired;
+            timer->callback(timer);
+        }
+    }
+    return fired;
+}
+
+int timer_wheel_timeout(const struct TimerWheel *wheel, uint64_t now_ms,
+                        int max_ms)
+{
+    uint64_t tick, ms;
+    size_t i;
+
+    if(wheel->count == 0)
+        return max_ms;
+
+    /* Next non-empty root slot, or the next cascade (which may be due on the
+     * very next tick) */
+    tick = (wheel->now + ROOT_MASK) & ~(uint64_t)ROOT_MASK;
+    for(i = 0; i < TIMER_ROOT_SIZE; ++i)
+    {
+        uint64_t t = wheel->now + i;
+        const struct Timer *head = &wheel->root[t & ROOT_MASK];
+        if((t & ROOT_MASK) == 0 && i != 0)
+            break;
+        if(head->next != head)
+        {
+            tick = t;
+            break;
+        }
+    }
+
+    ms = tick * TIMER_TICK_MS;
+    if(ms <= now_ms)
+        return 0;
+    if(ms - now_ms < (uint64_t)max_ms)
+        return (int)(ms - now_ms);
+    return max_ms;
+}
+
+struct Timer *timer_wheel_pop(struct TimerWheel *wheel)
+{
+    size_t i, j;
+    struct Timer *timer = NULL;
+
+    if(wheel->count == 0)
+        return NULL;
+    for(i = 0; i < TIMER_ROOT_SIZE && timer == NULL; ++i)
+        if(wheel->root[i].next != &wheel->root[i])
+            timer = wheel->root[i].next;
+    for(i = 0; i < TIMER_LEVELS - 1 && timer == NULL; ++i)
+        for(j = 0; j < TIMER_LEVEL_SIZE && timer == NULL; ++j)
+            if(wheel->levels[i][j].next != &wheel->levels[i][j])
+                timer = wheel->levels[i][j].next;
+    if(timer != NULL)
+        timer_cancel(wheel, timer);
+    return timer;
+}
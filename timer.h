@@ -0,0 +1,74 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/* Hierarchical timer wheel.
+ *
+ * Four levels of slots (256, 64, 64, 64) with a TIMER_TICK_MS resolution:
+ * scheduling and cancelling are O(1), and a tick only touches the timers that
+ * are due, plus the occasional cascade of a higher level slot into the lower
+ * ones. Delays longer than the wheel span (about a week) are clamped.
+ *
+ * A wheel is not thread-safe; each worker owns one and drives it from its
+ * event loop with timer_wheel_timeout() and timer_wheel_advance(). */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef TIMER_TICK_MS
+    #define TIMER_TICK_MS 10
+#endif
+
+#define TIMER_LEVELS 4
+#define TIMER_ROOT_BITS 8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_ROOT_SIZE (1 << TIMER_ROOT_BITS)
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+
+struct Timer;
+typedef void (*timer_callback)(struct Timer *timer);
+
+struct Timer {
+    struct Timer *prev, *next; /* NULL when not scheduled */
+    uint64_t expires;          /* in ticks */
+    timer_callback callback;
+    void *data;
+};
+
+struct TimerWheel {
+    uint64_t now; /* next tick to be processed */
+    size_t count; /* number of scheduled timers */
+    struct Timer root[TIMER_ROOT_SIZE];                       /* list heads */
+    struct Timer levels[TIMER_LEVELS - 1][TIMER_LEVEL_SIZE];  /* list heads */
+};
+
+/* Monotonic clock in milliseconds */
+uint64_t timer_now_ms(void);
+/* Same clock in microseconds (at millisecond resolution on Windows) */
+uint64_t timer_now_us(void);
+
+void timer_wheel_init(struct TimerWheel *wheel, uint64_t now_ms);
+
+void timer_init(struct Timer *timer, timer_callback callback, void *data);
+
+/* (Re)schedules timer to fire delay_ms from now_ms */
+void timer_schedule(struct TimerWheel *wheel, struct Timer *timer,
+                    uint64_t now_ms, uint64_t delay_ms);
+
+/* Unschedules timer; harmless if it is not scheduled */
+void timer_cancel(struct TimerWheel *wheel, struct Timer *timer);
+
+int timer_pending(const struct Timer *timer);
+
+/* Fires every timer due at now_ms. Callbacks may schedule or cancel any
+ * timer, including the one being fired. Returns the number fired. */
+size_t timer_wheel_advance(struct TimerWheel *wheel, uint64_t now_ms);
+
+/* Milliseconds until the wheel next needs to be advanced, at most max_ms */
+int timer_wheel_timeout(const struct TimerWheel *wheel, uint64_t now_ms,
+                        int max_ms);
+
+/* Unschedules and returns any scheduled timer, or NULL if there is none.
+ * Used to release the timers' owners when tearing a wheel down. */
+struct Timer *timer_wheel_pop(struct TimerWheel *wheel);
+
+#endif /* TIMER_H */
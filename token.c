@@ -0,0 +1,261 @@
+#include "token.h"
+
+#include <stdio.h>
+#include <string.h>
+#ifdef __WIN32__
+    #include <windows.h>
+#else
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #if defined(__linux__) && defined(__has_include)
+        #if __has_include(<sys/random.h>)
+            #include <sys/random.h>
+            #define HAVE_GETRANDOM
+        #endif
+    #endif
+#endif
+
+static const char base32[] = "abcdefghijklmnopqrstuvwxyz234567";
+
+static uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+/* Fills buf from the system's entropy source. Returns 0, or -1. */
+static int system_random(void *buf, size_t size)
+{
+#ifdef __WIN32__
+    (void)buf;
+    (void)size;
+    return -1;
+#else
+    char *p = buf;
+    int fd;
+#ifdef HAVE_GETRANDOM
+    while(size > 0)
+    {
+        ssize_t n = getrandom(p, size, 0);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    if(size == 0)
+        return 0;
+#endif
+    fd = open("/dev/urandom", O_RDONLY);
+    if(fd == -1)
+        return -1;
+    while(size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if(n <= 0)
+        {
+            if(n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    close(fd);
+    return (size == 0)?0:-1;
+#endif
+}
+
+int token_rng_seed(struct TokenRng *rng)
+{
+    uint64_t seed;
+    int ret = system_random(rng->s, sizeof(rng->s));
+    int i;
+
+    if(ret != 0)
+    {
+        /* Different for every thread and every run, if not unpredictable */
+        seed = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)rng
+             ^ ((uint64_t)(uintptr_t)&seed << 32) ^ (uint64_t)clock();
+#ifdef __WIN32__
+        seed ^= (uint64_t)GetCurrentThreadId() << 16
+              ^ (uint64_t)GetTickCount64();
+#endif
+        for(i = 0; i < 4; ++i)
+            rng->s[i] = splitmix64(&seed);
+    }
+    /* xoshiro's state must not be all zero */
+    if((rng->s[0] | rng->s[1] | rng->s[2] | rng->s[3]) == 0)
+        rng->s[0] = 1;
+    return ret;
+}
+
+/* xoshiro256** */
+uint64_t token_rng_next(struct TokenRng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+void token_random(struct TokenRng *rng, char *out)
+{
+    uint64_t r = token_rng_next(rng);
+    int i;
+    /* Each letter from the next 10 bits, by multiply-shift: unbiased enough
+     * for a token that only has to differ between clients */
+    for(i = 0; i < TOKEN_RANDOM_SIZE; ++i)
+    {
+        out[i] = (char)('a' + (((r & 0x3ff) * 26) >> 10));
+        r >>= 10;
+    }
+}
+
+int token_key_load(struct TokenKey *key, const char *filename)
+{
+    unsigned char bytes[TOKEN_KEY_SIZE];
+    size_t i, n;
+    FILE *file = fopen(filename, "rb");
+
+    if(file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+    n = fread(bytes, 1, sizeof(bytes), file);
+    fclose(file);
+    if(n != sizeof(bytes))
+    {
+        fprintf(stderr, "Error: %s: a key needs at least %d bytes\n",
+                filename, TOKEN_KEY_SIZE);
+        return -1;
+    }
+    key->k0 = key->k1 = 0;
+    for(i = 0; i < 8; ++i)
+    {
+        key->k0 |= (uint64_t)bytes[i] << (8 * i);
+        key->k1 |= (uint64_t)bytes[8 + i] << (8 * i);
+    }
+    return 0;
+}
+
+#define SIPROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32); \
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32); \
+    } while(0)
+
+/* SipHash-2-4 */
+static uint64_t siphash(const struct TokenKey *key,
+                        const unsigned char *data, size_t size)
+{
+    uint64_t v0 = key->k0 ^ UINT64_C(0x736f6d6570736575);
+    uint64_t v1 = key->k1 ^ UINT64_C(0x646f72616e646f6d);
+    uint64_t v2 = key->k0 ^ UINT64_C(0x6c7967656e657261);
+    uint64_t v3 = key->k1 ^ UINT64_C(0x7465646279746573);
+    uint64_t m;
+    size_t i, end = size - size % 8;
+    int j;
+
+    for(i = 0; i < end; i += 8)
+    {
+        m = 0;
+        for(j = 0; j < 8; ++j)
+            m |= (uint64_t)data[i + j] << (8 * j);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    m = (uint64_t)size << 56;
+    for(j = 0; i + j < size; ++j)
+        m |= (uint64_t)data[i + j] << (8 * j);
+    v3 ^= m;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+    v2 ^= 0xff;
+    for(j = 0; j < 4; ++j)
+        SIPROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* MAC of what a token vouches for */
+static uint64_t token_mac(const struct TokenKey *key,
+                          const struct ClientAddr *addr, uint32_t timestamp)
+{
+    unsigned char data[sizeof(addr->bytes) + 5];
+    memcpy(data, addr->bytes, sizeof(addr->bytes));
+    data[16] = addr->family;
+    data[17] = (unsigned char)(timestamp >> 24);
+    data[18] = (unsigned char)(timestamp >> 16);
+    data[19] = (unsigned char)(timestamp >> 8);
+    data[20] = (unsigned char)timestamp;
+    return siphash(key, data, sizeof(data));
+}
+
+void token_sign(const struct TokenKey *key, const struct ClientAddr *addr,
+                time_t now, char *out)
+{
+    uint32_t timestamp = (uint32_t)now;
+    uint64_t mac = token_mac(key, addr, timestamp);
+    int i;
+
+    /* 96 bits, 5 at a time from the top: the last character holds the
+     * lowest bit of the MAC and four zero bits */
+    for(i = 0; i < 6; ++i)
+        out[i] = base32[(timestamp >> (27 - 5 * i)) & 31];
+    out[6] = base32[((timestamp & 3) << 3) | (uint32_t)(mac >> 61)];
+    for(i = 7; i < TOKEN_SIGNED_SIZE - 1; ++i)
+        out[i] = base32[(mac >> (61 - 5 * (i - 6))) & 31];
+    out[TOKEN_SIGNED_SIZE - 1] = base32[(mac & 1) << 4];
+}
+
+int token_verify(const struct TokenKey *key, const struct ClientAddr *addr,
+                 const char *token, size_t length, time_t now, long max_age)
+{
+    char expected[TOKEN_SIGNED_SIZE];
+    uint64_t bits = 0;
+    uint32_t timestamp;
+    unsigned char diff = 0;
+    int i;
+
+    if(length != TOKEN_SIGNED_SIZE)
+        return 0;
+    for(i = 0; i < 7; ++i)
+    {
+        const char *c = memchr(base32, token[i], 32);
+        if(c == NULL)
+            return 0;
+        bits = (bits << 5) | (uint64_t)(c - base32);
+    }
+    timestamp = (uint32_t)(bits >> 3); /* the last 3 bits are the MAC's */
+
+    /* Compared without an early exit, like MACs should be */
+    token_sign(key, addr, (time_t)timestamp, expected);
+    for(i = 0; i < TOKEN_SIGNED_SIZE; ++i)
+        diff |= (unsigned char)(expected[i] ^ token[i]);
+    if(diff != 0)
+        return 0;
+    return (uint32_t)now - timestamp <= (uint32_t)max_age;
+}
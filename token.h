@@ -0,0 +1,56 @@
+#ifndef TOKEN_H
+#define TOKEN_H
+
+/* Tokens put at the end of the redirect URLs.
+ *
+ * By default a token is TOKEN_RANDOM_SIZE random lowercase letters, from a
+ * per-thread xoshiro256** generator seeded once from the system's entropy
+ * source: no lock, no system call per token.
+ *
+ * With a key, a token instead carries a timestamp and a SipHash-2-4 MAC of
+ * the client's address and that timestamp (TOKEN_SIGNED_SIZE characters of
+ * base32). A client coming back with such a token can be checked with the
+ * key alone: no lookup, nothing shared between workers, and it still holds
+ * after a restart as long as the key file is the same. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "addr.h"
+
+#define TOKEN_RANDOM_SIZE 6
+#define TOKEN_SIGNED_SIZE 20    /* 32-bit timestamp + 64-bit MAC, base32 */
+#define TOKEN_MAX_SIZE 20
+#define TOKEN_KEY_SIZE 16
+
+struct TokenRng {
+    uint64_t s[4];
+};
+
+struct TokenKey {
+    uint64_t k0, k1;
+};
+
+/* Seeds a generator from getrandom() (or /dev/urandom). Returns 0, or -1 if
+ * no entropy source is available, in which case it is seeded from the time
+ * and addresses: fine for tokens that are only meant to differ. */
+int token_rng_seed(struct TokenRng *rng);
+uint64_t token_rng_next(struct TokenRng *rng);
+
+/* Writes TOKEN_RANDOM_SIZE lowercase letters */
+void token_random(struct TokenRng *rng, char *out);
+
+/* Reads the first TOKEN_KEY_SIZE bytes of a file. Prints an error and
+ * returns -1 if it can't be read or is too short. */
+int token_key_load(struct TokenKey *key, const char *filename);
+
+/* Writes the TOKEN_SIGNED_SIZE characters of the token of addr at now */
+void token_sign(const struct TokenKey *key, const struct ClientAddr *addr,
+                time_t now, char *out);
+
+/* 1 if token was signed for addr, at most max_age seconds before now */
+int token_verify(const struct TokenKey *key, const struct ClientAddr *addr,
+                 const char *token, size_t length, time_t now, long max_age);
+
+#endif /* TOKEN_H */
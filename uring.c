@@ -0,0 +1,320 @@
+#include "uring.h"
+
+#ifdef ENABLE_IO_URING
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/* Same numbers on every architecture but alpha */
+#ifndef __NR_io_uring_setup
+    #define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+    #define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+    #define __NR_io_uring_register 427
+#endif
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                     unsigned int flags, const void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned int opcode, const void *arg,
+                        unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct Uring *ring, unsigned int entries,
+               unsigned int buf_count, size_t buf_size)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned int i;
+    size_t map_size;
+    int err;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    if(buf_count == 0 || (buf_count & (buf_count - 1)) != 0
+     || buf_count > 32768)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* SINGLE_ISSUER is refused before 6.0, which also brought everything
+     * else used here */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP | IORING_SETUP_SINGLE_ISSUER
+            | IORING_SETUP_COOP_TASKRUN;
+    ring->fd = sys_setup(entries, &p);
+    if(ring->fd == -1)
+        return -1;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)
+     || !(p.features & IORING_FEAT_EXT_ARG)
+     || !(p.features & IORING_FEAT_NODROP))
+    {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    /* Both rings share one mapping */
+    ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = p.cq_off.cqes
+                      + p.cq_entries * sizeof(struct io_uring_cqe);
+    map_size = (ring->sq_map_size > ring->cq_map_size)
+             ?ring->sq_map_size:ring->cq_map_size;
+    ring->sq_map_size = ring->cq_map_size = map_size;
+    ring->sq_map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if(ring->sq_map == MAP_FAILED)
+    {
+        ring->sq_map = NULL;
+        goto fail;
+    }
+    ring->cq_map = ring->sq_map;
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned int*)((char*)ring->sq_map + p.sq_off.head);
+    ring->sq_tail = (unsigned int*)((char*)ring->sq_map + p.sq_off.tail);
+    ring->sq_mask = (unsigned int*)((char*)ring->sq_map + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)((char*)ring->sq_map + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned int*)((char*)ring->cq_map + p.cq_off.head);
+    ring->cq_tail = (unsigned int*)((char*)ring->cq_map + p.cq_off.tail);
+    ring->cq_mask = (unsigned int*)((char*)ring->cq_map + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_map + p.cq_off.cqes);
+
+    /* Entries are filled in ring order, so the indirection is the identity */
+    for(i = 0; i < p.sq_entries; ++i)
+        ring->sq_array[i] = i;
+
+    /* Provided buffers: the ring must be page aligned */
+    ring->buf_ring_size = buf_count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buf_ring == MAP_FAILED)
+    {
+        ring->buf_ring = NULL;
+        goto fail;
+    }
+    ring->buffers = malloc(buf_count * buf_size);
+    if(ring->buffers == NULL)
+    {
+        errno = ENOMEM;
+        goto fail;
+    }
+    ring->buf_count = buf_count;
+    ring->buf_size = buf_size;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = URING_BUFFER_GROUP;
+    if(sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        goto fail;
+    for(i = 0; i < buf_count; ++i)
+        uring_recycle_buffer(ring, i);
+    return 0;
+
+fail:
+    err = errno;
+    uring_free(ring);
+    errno = err;
+    return -1;
+}
+
+void uring_free(struct Uring *ring)
+{
+    /* Closing the ring unregisters the buffers */
+    if(ring->fd != -1)
+        close(ring->fd);
+    if(ring->sq_map != NULL)
+        munmap(ring->sq_map, ring->sq_map_size);
+    if(ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if(ring->buf_ring != NULL)
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    free(ring->buffers);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/* Makes the filled entries visible to the kernel; returns how many it has
+ * not consumed yet, including those left by a failed submission */
+static unsigned int flush_sq(struct Uring *ring)
+{
+    if(ring->sq_pending != 0)
+    {
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_pending,
+                         __ATOMIC_RELEASE);
+        ring->sq_pending = 0;
+    }
+    return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct Uring *ring)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *ring->sq_tail + ring->sq_pending;
+    struct io_uring_sqe *sqe;
+
+    if(tail - head >= ring->sq_entries)
+    {
+        /* Full: hand the queue over to the kernel without waiting */
+        unsigned int count = flush_sq(ring);
+        if(sys_enter(ring->fd, count, 0, 0, NULL, 0) == -1)
+            return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        tail = *ring->sq_tail;
+        if(tail - head >= ring->sq_entries)
+            return NULL;
+    }
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++ring->sq_pending;
+    return sqe;
+}
+
+int uring_submit_and_wait(struct Uring *ring, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int to_submit = flush_sq(ring);
+    unsigned int flags = 0, min_complete = 0;
+    const void *argp = NULL;
+    size_t argsz = 0;
+
+    /* Completions already waiting: just submit */
+    if(timeout_ms != 0 && *ring->cq_head
+                          == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+        min_complete = 1;
+        if(timeout_ms > 0)
+        {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+    }
+    if(to_submit == 0 && min_complete == 0)
+        return 0;
+
+    for(;;)
+    {
+        if(sys_enter(ring->fd, to_submit, min_complete, flags,
+                     argp, argsz) != -1)
+            return 0;
+        /* Nothing to do but process the completions already there */
+        if(errno == ETIME || errno == EBUSY || errno == EAGAIN)
+            return 0;
+        if(errno != EINTR)
+            return -1;
+    }
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct Uring *ring)
+{
+    unsigned int head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct Uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char *uring_buffer(struct Uring *ring, unsigned int bid)
+{
+    return ring->buffers + (size_t)bid * ring->buf_size;
+}
+
+void uring_recycle_buffer(struct Uring *ring, unsigned int bid)
+{
+    struct io_uring_buf *buf =
+            &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, bid);
+    buf->len = (uint32_t)ring->buf_size;
+    buf->bid = (uint16_t)bid;
+    ++ring->buf_tail;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, unsigned int flags)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+}
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+}
+
+void uring_prep_close(struct io_uring_sqe *sqe, int fd)
+{
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+}
+
+#else
+
+/* ISO C forbids an empty translation unit */
+typedef int uring_unavailable;
+
+#endif /* ENABLE_IO_URING */
@@ -0,0 +1,110 @@
+#ifndef URING_H
+#define URING_H
+
+/* Minimal io_uring wrapper, on top of the raw system calls.
+ *
+ * It covers what the completion-based server loop needs: one submission
+ * and completion queue pair per worker thread, a ring of provided receive
+ * buffers (the kernel picks one for each multishot recv completion), and
+ * waiting for completions with a timeout. uring_init() fails on kernels
+ * that lack any of it (before 6.0), or where io_uring is disabled, so that
+ * the caller can fall back to the event loop of event.h. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __linux__
+    #ifndef ENABLE_IO_URING
+        #ifndef DISABLE_IO_URING
+            #if defined(__has_include)
+                #if __has_include(<linux/io_uring.h>)
+                    #define ENABLE_IO_URING
+                #endif
+            #endif
+        #endif
+    #endif
+#else
+    #ifdef ENABLE_IO_URING
+        #warning ENABLE_IO_URING is only available on Linux
+        #undef ENABLE_IO_URING
+    #endif
+#endif
+
+#ifdef ENABLE_IO_URING
+    #include <linux/io_uring.h>
+    /* Multishot recv and provided buffer rings: headers from Linux 6.0 */
+    #ifndef IORING_RECV_MULTISHOT
+        #undef ENABLE_IO_URING
+    #endif
+#endif
+
+#ifdef ENABLE_IO_URING
+
+struct msghdr;
+
+struct Uring {
+    int fd;
+
+    /* Submission queue */
+    void *sq_map;
+    size_t sq_map_size;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int sq_entries;
+    unsigned int sq_pending;    /* filled but not submitted yet */
+
+    /* Completion queue */
+    void *cq_map;
+    size_t cq_map_size;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Provided buffers, group URING_BUFFER_GROUP */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    unsigned int buf_count;
+    size_t buf_size;
+    uint16_t buf_tail;          /* next free entry of buf_ring */
+};
+
+#define URING_BUFFER_GROUP 0
+
+/* Sets up a ring of entries submissions, with buf_count (a power of two)
+ * provided buffers of buf_size bytes. Must be called, and the ring only
+ * used, by a single thread. Returns 0, or -1 with errno set if io_uring or
+ * one of the features used is unavailable. */
+int uring_init(struct Uring *ring, unsigned int entries,
+               unsigned int buf_count, size_t buf_size);
+void uring_free(struct Uring *ring);
+
+/* Next free submission entry, zeroed; submits the pending ones first if
+ * the queue is full. Returns NULL if that fails. */
+struct io_uring_sqe *uring_get_sqe(struct Uring *ring);
+
+/* Submits the pending entries and waits up to timeout_ms (-1: forever) for
+ * at least one completion. Returns 0, or -1 with errno set (ETIME on
+ * timeout is not an error). */
+int uring_submit_and_wait(struct Uring *ring, int timeout_ms);
+
+/* Oldest unprocessed completion, or NULL; release it with uring_cqe_seen() */
+struct io_uring_cqe *uring_peek_cqe(struct Uring *ring);
+void uring_cqe_seen(struct Uring *ring);
+
+/* Provided buffer of a completion flagged IORING_CQE_F_BUFFER */
+char *uring_buffer(struct Uring *ring, unsigned int bid);
+/* Gives a buffer back to the kernel */
+void uring_recycle_buffer(struct Uring *ring, unsigned int bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, unsigned int flags);
+/* Cancels the request submitted with that user_data */
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t user_data);
+void uring_prep_close(struct io_uring_sqe *sqe, int fd);
+
+#endif /* ENABLE_IO_URING */
+
+#endif /* URING_H */